@@ -0,0 +1,114 @@
+import torch
+
+# decode-step cap of beam search, the first version of the loop stopped once step > 50
+max_decode_steps = 51
+
+class BeamState(object):
+    """
+    beam search bookkeeping in preallocated buffers:
+    each decode-step writes one column of chosen tokens and backpointers,
+    surviving beams are compacted in place and a finished sequence is recovered by a backtrace
+    """
+    def __init__(self, beam_size, max_steps, start_word, end_word, alpha_shape=None, device=None):
+        """
+        :param beam_size: number of sequences to consider at each decode-step
+        :param max_steps: decode-step cap, sequences have at most max_steps + 1 tokens
+        :param start_word: index of <start>
+        :param end_word: index of <end>
+        :param alpha_shape: shape of one attention map, None to not track attention maps
+        :param device: device of the buffers
+        """
+        k = beam_size
+        self.k = k
+        self.step = 0
+        self.max_steps = max_steps
+        self.end_word = end_word
+        self.done = False
+
+        # column t holds the candidates chosen at decode-step t, column 0 is <start>
+        self.tokens = torch.full((k, max_steps + 1), start_word, dtype=torch.long, device=device)
+        # row in column t - 1 that the candidate in column t extends
+        self.backpointers = torch.zeros(k, max_steps + 1, dtype=torch.long, device=device)
+        # attention map that produced the candidate in column t
+        self.alphas = None
+        if alpha_shape is not None:
+            self.alphas = torch.ones((k, max_steps + 1) + tuple(alpha_shape), device=device)
+
+        # live beams, compacted to the first self.k rows after every decode-step
+        self.live = torch.arange(k, device=device)                               # (k), row in the last column
+        self.scores = torch.zeros(k, device=device)                              # (k), accumulated log-probabilities
+        self.words = torch.full((k,), start_word, dtype=torch.long, device=device)  # (k), last word
+
+        # finished sequences as (score, step, row)
+        self.complete = list()
+
+    def prev_words(self):
+        return self.words[:self.k]                                               # (s)
+
+    def top_k_scores(self):
+        return self.scores[:self.k].unsqueeze(1)                                 # (s, 1)
+
+    def advance(self, top_k_scores, prev_word_inds, next_word_inds, alpha=None):
+        """
+        records the candidates chosen at one decode-step
+        :param top_k_scores: accumulated scores of the candidates, a tensor of dimension (n)
+        :param prev_word_inds: live beam each candidate extends, a tensor of dimension (n)
+        :param next_word_inds: word each candidate appends, a tensor of dimension (n)
+        :param alpha: attention maps of the live beams at this step, a tensor of dimension (s, *alpha_shape)
+        :return: live beam each surviving candidate continues from, used to compact the decoder state
+        """
+        n = top_k_scores.size(0)
+        t = self.step + 1
+        self.tokens[:n, t] = next_word_inds
+        self.backpointers[:n, t] = self.live[prev_word_inds]
+        if self.alphas is not None and alpha is not None:
+            self.alphas[:n, t] = alpha[prev_word_inds]
+        self.step = t
+
+        ended = next_word_inds == self.end_word
+        complete_inds = ended.nonzero().squeeze(1)
+        incomplete_inds = (~ended).nonzero().squeeze(1)
+
+        if complete_inds.size(0) > 0:
+            for row, score in zip(complete_inds.tolist(), top_k_scores[complete_inds].tolist()):
+                self.complete.append((score, t, row))
+
+        s = incomplete_inds.size(0)
+        if s == 0 or t == self.max_steps:
+            # nothing finished before the cap, fall back to the running sequences
+            if len(self.complete) == 0:
+                for row, score in zip(incomplete_inds.tolist(), top_k_scores[incomplete_inds].tolist()):
+                    self.complete.append((score, t, row))
+            self.k = 0
+            self.done = True
+            return incomplete_inds[:0]
+
+        # compact the surviving beams into the first s rows
+        torch.index_select(top_k_scores, 0, incomplete_inds, out=self.scores[:s])
+        torch.index_select(next_word_inds, 0, incomplete_inds, out=self.words[:s])
+        self.live[:s] = incomplete_inds
+        self.k = s
+        return prev_word_inds[incomplete_inds]
+
+    def best(self):
+        """
+        backtraces the finished sequence with the highest score
+        :return: caption, weights for visualization (None if not tracked)
+        """
+        score, t, row = max(self.complete, key=lambda x: x[0])
+        tokens = self.tokens.tolist()
+        backpointers = self.backpointers.tolist()
+
+        seq = [0] * (t + 1)
+        rows = [0] * (t + 1)
+        for u in range(t, 0, -1):
+            seq[u] = tokens[row][u]
+            rows[u] = row
+            row = backpointers[row][u]
+        seq[0] = tokens[row][0]
+        rows[0] = row
+
+        alphas = None
+        if self.alphas is not None:
+            alphas = self.alphas[rows, torch.arange(t + 1)].tolist()
+        return seq, alphas
@@ -0,0 +1,162 @@
+import torch
+import torch.nn.functional as F
+
+from beam_state import BeamState, max_decode_steps
+
+class BeamRequest(object):
+    """
+    beam search state of one image inside the decode scheduler
+    """
+    def __init__(self, encoder_out, att1, beam_size, word_map, h, c, max_steps, track_alpha=False):
+        """
+        :param encoder_out: encoded image, a tensor of dimension (1, enc_image_size, enc_image_size, encoder_dim)
+        :param att1: projection of the encoded image used by attention, a tensor of dimension (1, num_pixels, attention_dim)
+        :param beam_size: number of sequences to consider at each decode-step
+        :param word_map: word map
+        :param h: initial hidden state, a tensor of dimension (1, decoder_dim)
+        :param c: initial cell state, a tensor of dimension (1, decoder_dim)
+        :param max_steps: decode-step cap
+        :param track_alpha: keep the attention maps of the beams, to return the ones of the selected caption
+        """
+        k = beam_size
+        self.enc_image_size = encoder_out.size(1)
+        encoder_dim = encoder_out.size(3)
+
+        self.encoder_out = encoder_out.view(1, -1, encoder_dim)                  # (1, num_pixels, encoder_dim)
+        self.att1 = att1                                                           # (1, num_pixels, attention_dim)
+        self.h = h.expand(k, h.size(1))                                            # (k, decoder_dim)
+        self.c = c.expand(k, c.size(1))                                            # (k, decoder_dim)
+        alpha_shape = (self.enc_image_size, self.enc_image_size) if track_alpha else None
+        self.beams = BeamState(k, max_steps, word_map['<start>'], word_map['<end>'],
+                               alpha_shape = alpha_shape, device = encoder_out.device)
+
+        # filled in once the request leaves the scheduler
+        self.done = False
+        self.seq = None
+        self.alphas = None
+
+    @property
+    def k(self):
+        return self.beams.k
+
+    def advance(self, scores, h, c, alpha):
+        """
+        consumes this request's rows of a batched decode-step, same rules as caption_image_beam_search
+        :param scores: accumulated log-probabilities, a tensor of dimension (k, vocab_size)
+        :param h: new hidden state, a tensor of dimension (k, decoder_dim)
+        :param c: new cell state, a tensor of dimension (k, decoder_dim)
+        :param alpha: attention weights, a tensor of dimension (k, enc_image_size, enc_image_size)
+        """
+        beams = self.beams
+        vocab_size = scores.size(1)
+
+        # for the first step all k rows are identical, so only the first one is searched
+        if beams.step == 0:
+            top_k_scores, top_k_words = scores[0].topk(beams.k, 0, True, True)
+        else:
+            top_k_scores, top_k_words = scores.view(-1).topk(beams.k, 0, True, True)
+
+        prev_word_inds = torch.div(top_k_words, vocab_size, rounding_mode='floor')
+        next_word_inds = top_k_words % vocab_size
+
+        sources = beams.advance(top_k_scores, prev_word_inds, next_word_inds, alpha)
+        if beams.done:
+            self.seq, self.alphas = beams.best()
+            self.done = True
+
+            # release the per-step tensors as soon as the request leaves the batch
+            self.encoder_out = self.att1 = self.h = self.c = None
+            return
+
+        # proceed with incomplete sequences
+        self.h = torch.index_select(h, 0, sources)
+        self.c = torch.index_select(c, 0, sources)
+
+class DecodeScheduler(object):
+    """
+    iteration-level batching of beam search:
+    every decode-step runs the active beams of all in-flight requests as one batch,
+    requests join as soon as their encoder output is ready and leave once their beams finish
+    """
+    def __init__(self, decoder, word_map, max_steps=max_decode_steps):
+        """
+        :param decoder: decoder model
+        :param word_map: word map
+        :param max_steps: a request leaves the batch after this many decode-steps
+        """
+        self.decoder = decoder
+        self.word_map = word_map
+        self.max_steps = max_steps
+        self.active = list()
+
+    def has_active(self):
+        return len(self.active) > 0
+
+    def submit(self, encoder_out, beam_size=3, track_alpha=False):
+        """
+        adds an encoded image to the batch, it takes part in the next decode-step
+        :param encoder_out: encoded image, a tensor of dimension (1, enc_image_size, enc_image_size, encoder_dim)
+        :param beam_size: number of sequences to consider at each decode-step
+        :param track_alpha: keep attention maps for this request
+        :return: request handle, its seq and alphas are set once done
+        """
+        with torch.no_grad():
+            encoder_dim = encoder_out.size(3)
+            flat = encoder_out.view(1, -1, encoder_dim)
+            h, c = self.decoder.init_hidden_state(flat)
+            att1 = self.decoder.attention.encoder_att(flat)
+        request = BeamRequest(encoder_out, att1, beam_size, self.word_map, h, c, self.max_steps, track_alpha)
+        self.active.append(request)
+        return request
+
+    def step(self):
+        """
+        runs one decode-step over the beams of every active request
+        """
+        if not self.active:
+            return
+
+        decoder = self.decoder
+        requests = self.active
+
+        with torch.no_grad():
+            k_prev_words = torch.cat([r.beams.prev_words() for r in requests], dim=0)     # (n)
+            top_k_scores = torch.cat([r.beams.top_k_scores() for r in requests], dim=0)  # (n, 1)
+            h = torch.cat([r.h for r in requests], dim=0)                        # (n, decoder_dim)
+            c = torch.cat([r.c for r in requests], dim=0)                        # (n, decoder_dim)
+
+            embeddings = decoder.embedding(k_prev_words)                         # (n, embed_dim)
+            awe, alpha = self.attend(h)                                          # (n, encoder_dim), (n, num_pixels)
+            gate = decoder.sigmoid(decoder.f_beta(h))                            # (n, encoder_dim)
+            awe = gate * awe
+            h, c = decoder.decode_step(torch.cat([embeddings, awe], dim=1), (h, c))  # (n, decoder_dim)
+            scores = F.log_softmax(decoder.fc(h), dim=1)                         # (n, vocab_size)
+            scores = top_k_scores.expand_as(scores) + scores
+
+            # hand every request back its own rows
+            start = 0
+            for r in requests:
+                end = start + r.k
+                r.advance(scores[start:end], h[start:end], c[start:end],
+                          alpha[start:end].view(-1, r.enc_image_size, r.enc_image_size))
+                start = end
+
+        self.active = [r for r in requests if not r.done]
+
+    def attend(self, h):
+        """
+        attention of the beams of every active request over its own image, on the tensors the request holds:
+        the encoded images are never gathered or copied per beam
+        :param h: hidden state of the beams, a tensor of dimension (n, decoder_dim), grouped by request
+        :return: attention weighted encoding (n, encoder_dim), weights (n, num_pixels)
+        """
+        awe, alpha = list(), list()
+        start = 0
+        for r in self.active:
+            end = start + r.k
+            # encoder_out and att1 are (1, num_pixels, ...), broadcast to the k rows of the request
+            request_awe, request_alpha = self.decoder.attention(r.encoder_out, h[start:end], r.att1)
+            awe.append(request_awe)
+            alpha.append(request_alpha)
+            start = end
+        return torch.cat(awe, dim=0), torch.cat(alpha, dim=0)
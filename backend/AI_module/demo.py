@@ -2,6 +2,7 @@
 
 import sys
 import json
+import base64
 import argparse
 import numpy as np
 from PIL import Image
@@ -17,6 +18,9 @@ import matplotlib as mpl
 import matplotlib.cm as cm
 import matplotlib.pyplot as plt
 
+from beam_state import BeamState, max_decode_steps
+from decode_scheduler import DecodeScheduler
+
 # show chinese characters
 mpl.rcParams[u'font.sans-serif'] = ['simhei']
 plt.rcParams['font.sans-serif'] = ['SimHei']
@@ -24,21 +28,12 @@ plt.rcParams['font.sans-serif'] = ['SimHei']
 # define device
 device = torch.device("cuda" if torch.cuda.is_available() else "cpu")
 
-def caption_image_beam_search(encoder, decoder, image_path, word_map, beam_size=3):
+def read_image(image_path):
     """
-    reads an image and captions it with beam search
-    :param encoder: encoder model
-    :param decoder: decoder model
+    reads an image and turns it into the normalized tensor the encoder expects
     :param image_path: path to image
-    :param word_map: word map
-    :param beam_size: number of sequences to consider at each decode-step
-    :return: caption, weights for visualization
+    :return: image, a tensor of dimension (3, 256, 256)
     """
-
-    k = beam_size
-    vocab_size = len(word_map)
-
-    # read image and process
     img = imread(image_path)
     if len(img.shape) == 2:
         img = img[:, :, np.newaxis]
@@ -50,7 +45,28 @@ def caption_image_beam_search(encoder, decoder, image_path, word_map, beam_size=
     normalize = transforms.Normalize(mean = [0.485, 0.456, 0.406],
                                      std = [0.229, 0.224, 0.225])
     transform = transforms.Compose([normalize])
-    image = transform(img)                                                       # (3, 256, 256)
+    return transform(img)
+
+@torch.no_grad()
+def caption_image_beam_search(encoder, decoder, image_path, word_map, beam_size=3, track_alpha=False,
+                              max_steps=max_decode_steps):
+    """
+    reads an image and captions it with beam search
+    :param encoder: encoder model
+    :param decoder: decoder model
+    :param image_path: path to image
+    :param word_map: word map
+    :param beam_size: number of sequences to consider at each decode-step
+    :param track_alpha: keep the attention maps of the beams, to return the ones of the selected caption
+    :param max_steps: maximum number of decode-steps
+    :return: caption, weights for visualization (None unless track_alpha)
+    """
+
+    k = beam_size
+    vocab_size = len(word_map)
+
+    # read image and process
+    image = read_image(image_path)                                               # (3, 256, 256)
 
     # encode
     image = image.unsqueeze(0)                                                   # (1, 3, 256, 256)
@@ -62,32 +78,31 @@ def caption_image_beam_search(encoder, decoder, image_path, word_map, beam_size=
     encoder_out = encoder_out.view(1, -1, encoder_dim)                           # (1, num_pixels, encoder_dim)
     num_pixels = encoder_out.size(1)
 
-    # we'll treat the problem as having a batch size of k
-    encoder_out = encoder_out.expand(k, num_pixels, encoder_dim)                 # (k, num_pixels, encoder_dim)
+    # every beam attends to the same image, so the projection used by attention is computed once
+    # and broadcast over the beams instead of being recomputed for each of them at every step
+    att1 = decoder.attention.encoder_att(encoder_out)                           # (1, num_pixels, attention_dim)
 
-    # tensor to store top k previous words at each step; now they're just <start>
-    k_prev_words = torch.LongTensor([[word_map['<start>']]] * k).to(device)      # (k, 1)
-    seqs = k_prev_words
-
-    # tensor to store top k sequences' scores; now they're just 0
-    # tensor to store top k sequences' alphas; now they're just 1
-    top_k_scores = torch.zeros(k, 1).to(device)  
-    seqs_alpha = torch.ones(k, 1, enc_image_size, enc_image_size).to(device)     # (k, 1, enc_image_size, enc_image_size)
-
-    # lists to store completed sequences, their alphas and scores
-    complete_seqs = list()
-    complete_seqs_alpha = list()
-    complete_seqs_scores = list()
+    # tokens, backpointers and (if asked for) alphas of the k beams live in preallocated [k, max_steps] buffers,
+    # a decode-step only writes one column of them
+    alpha_shape = (enc_image_size, enc_image_size) if track_alpha else None
+    beams = BeamState(k, max_steps, word_map['<start>'], word_map['<end>'],
+                      alpha_shape = alpha_shape, device = device)
 
     # start decoding
-    step = 1
-    h, c = decoder.init_hidden_state(encoder_out)
+    h, c = decoder.init_hidden_state(encoder_out)                                # (1, decoder_dim)
+    h = h.expand(k, h.size(1))                                                   # (k, decoder_dim)
+    c = c.expand(k, c.size(1))                                                   # (k, decoder_dim)
+
+    # surviving beams' states are compacted into these buffers after every step
+    h_live = torch.empty(k, h.size(1), device = device)
+    c_live = torch.empty(k, c.size(1), device = device)
 
     # s is a number less than or equal to k, 
     # because sequences are removed from this process once they hit <end>
     while True:
-        embeddings = decoder.embedding(k_prev_words).squeeze(1)                  # (s, embed_dim)
-        awe, alpha = decoder.attention(encoder_out, h)                           # (s, encoder_dim), (s, num_pixels)
+        k_prev_words = beams.prev_words()                                        # (s)
+        embeddings = decoder.embedding(k_prev_words)                             # (s, embed_dim)
+        awe, alpha = decoder.attention(encoder_out, h, att1)                     # (s, encoder_dim), (s, num_pixels)
         alpha = alpha.view(-1, enc_image_size, enc_image_size)                   # (s, enc_image_size, enc_image_size)
         gate = decoder.sigmoid(decoder.f_beta(h))                                # (s, encoder_dim)
         awe = gate * awe
@@ -96,62 +111,74 @@ def caption_image_beam_search(encoder, decoder, image_path, word_map, beam_size=
         scores = F.log_softmax(scores, dim=1)
 
         # add
-        scores = top_k_scores.expand_as(scores) + scores                         # (s, vocab_size)
+        scores = beams.top_k_scores().expand_as(scores) + scores                 # (s, vocab_size)
 
         # for the first step, 
         # all k points will have the same scores 
         # (since same k previous words, h, c)
-        if step == 1:
-            top_k_scores, top_k_words = scores[0].topk(k, 0, True, True) 
+        if beams.step == 0:
+            top_k_scores, top_k_words = scores[0].topk(beams.k, 0, True, True)
         else:
             # unroll and find top scores, and their unrolled indices
-            top_k_scores, top_k_words = scores.view(-1).topk(k, 0, True, True)
+            top_k_scores, top_k_words = scores.view(-1).topk(beams.k, 0, True, True)
 
         # convert unrolled indices to actual indices of scores
-        prev_word_inds = top_k_words / vocab_size 
-        next_word_inds = top_k_words % vocab_size 
-
-        # add new words to sequences, alphas
-        next_word_inds = next_word_inds.int()
-        prev_word_inds = prev_word_inds.int()
-        seqs = torch.cat([seqs[prev_word_inds], next_word_inds.unsqueeze(1)], dim = 1)
-        seqs_alpha = torch.cat([seqs_alpha[prev_word_inds], alpha[prev_word_inds].unsqueeze(1)], dim = 1)
-
-        # which sequences are incomplete (didn't reach <end>)?
-        incomplete_inds = [ind for ind, next_word in enumerate(next_word_inds) if
-                           next_word != word_map['<end>']]
-        complete_inds = list(set(range(len(next_word_inds))) - set(incomplete_inds))
-
-        # set aside complete sequences
-        if len(complete_inds) > 0:
-            complete_seqs.extend(seqs[complete_inds].tolist())
-            complete_seqs_alpha.extend(seqs_alpha[complete_inds].tolist())
-            complete_seqs_scores.extend(top_k_scores[complete_inds])
-        k -= len(complete_inds)
+        prev_word_inds = torch.div(top_k_words, vocab_size, rounding_mode='floor')
+        next_word_inds = top_k_words % vocab_size
 
-        # proceed with incomplete sequences
-        if k == 0:
-            break
-        seqs = seqs[incomplete_inds]
-        seqs_alpha = seqs_alpha[incomplete_inds]
-        h = h[prev_word_inds[incomplete_inds]]
-        c = c[prev_word_inds[incomplete_inds]]
-        encoder_out = encoder_out[prev_word_inds[incomplete_inds]]
-        top_k_scores = top_k_scores[incomplete_inds].unsqueeze(1)
-        k_prev_words = next_word_inds[incomplete_inds].unsqueeze(1)
-
-        # break if things have been going on too long
-        if step > 50:
+        # record the step, finished sequences are set aside by the beam state
+        sources = beams.advance(top_k_scores, prev_word_inds, next_word_inds, alpha)
+        if beams.done:
             break
-        step += 1
 
-    i = complete_seqs_scores.index(max(complete_seqs_scores))
-    seq = complete_seqs[i]
-    alphas = complete_seqs_alpha[i]
+        # proceed with incomplete sequences
+        s = sources.size(0)
+        h = torch.index_select(h, 0, sources, out = h_live[:s])
+        c = torch.index_select(c, 0, sources, out = c_live[:s])
+
+    seq, alphas = beams.best()
 
     return seq, alphas
 
-def visualize_att(image_path, seq, alphas, rev_word_map, smooth=True):
+def caption_images_beam_search(encoder, decoder, image_paths, word_map, beam_size=3, track_alpha=False,
+                               max_steps=max_decode_steps):
+    """
+    captions several images with one decode scheduler, so their beams share every decoder batch
+    :param encoder: encoder model
+    :param decoder: decoder model
+    :param image_paths: paths to images
+    :param word_map: word map
+    :param beam_size: number of sequences to consider at each decode-step
+    :param track_alpha: keep the attention maps of the beams, to return the ones of the selected captions
+    :param max_steps: maximum number of decode-steps
+    :return: list of (caption, weights for visualization or None), in the order of image_paths
+    """
+    scheduler = DecodeScheduler(decoder, word_map, max_steps)
+    requests = list()
+
+    # an image joins the running batch as soon as it is encoded,
+    # while the images before it keep decoding
+    pending = list(image_paths)
+    while pending or scheduler.has_active():
+        if pending:
+            with torch.no_grad():
+                encoder_out = encoder(read_image(pending.pop(0)).unsqueeze(0))  # (1, enc_image_size, enc_image_size, encoder_dim)
+            requests.append(scheduler.submit(encoder_out, beam_size, track_alpha))
+        scheduler.step()
+
+    return [(r.seq, r.alphas) for r in requests]
+
+def quantize_alphas(alphas):
+    """
+    packs attention maps compactly, one uint8 map per token scaled to its own maximum
+    :param alphas: weights, a tensor of dimension (num_tokens, enc_image_size, enc_image_size)
+    :return: base64 of the row-major uint8 maps
+    """
+    peak = alphas.view(alphas.size(0), -1).max(dim=1)[0].clamp(min=1e-12)
+    maps = (alphas / peak.view(-1, 1, 1) * 255.).round().to(torch.uint8)
+    return base64.b64encode(maps.cpu().numpy().tobytes()).decode('ascii')
+
+def visualize_att(image_path, seq, alphas, rev_word_map, smooth=True, result_path="result.txt"):
     """
     visualizes caption with weights at every word
     :param image_path: path to image that has been captioned
@@ -168,7 +195,7 @@ def visualize_att(image_path, seq, alphas, rev_word_map, smooth=True):
     for w in words[1:-1]:
         result += w
 
-    with open("result.txt", "w", encoding="utf-8") as file:
+    with open(result_path, "w", encoding="utf-8") as file:
         file.write(result)
 
     """
@@ -211,30 +238,58 @@ if __name__ == '__main__':
     
     # parse argument
     parser = argparse.ArgumentParser(description='Show, Attend, and Tell - Tutorial - Generate Caption')
-    parser.add_argument('--img', '-i', help='path to image')
+    parser.add_argument('--img', '-i', nargs='+', help='path to image, several images are decoded as one batch')
     parser.add_argument('--model', '-m', default='BEST_checkpoint_.pth.tar', help='path to model')
+    parser.add_argument('--pack', '-p', help='weight file of export_weights.py --encoder, mapped instead of loading --model')
     parser.add_argument('--word_map', '-wm', default='data/WORDMAP.json', help='path to word map JSON')
     parser.add_argument('--beam_size', '-b', default=5, type=int, help='beam size for beam search')
+    parser.add_argument('--max_steps', default=max_decode_steps, type=int, help='maximum number of decode-steps')
     parser.add_argument('--dont_smooth', dest='smooth', action='store_false', help='do not smooth alpha overlay')
+    parser.add_argument('--alphas', action='store_true', help='also write the attention maps of the captions to result.txt')
+    parser.add_argument('--result', default='result.txt', help='file the captions are written to')
     args = parser.parse_args()
 
     # load model
-    checkpoint = torch.load(args.model)
-    decoder = checkpoint['decoder']
-    decoder = decoder.to(device)
-    decoder.eval()
-    encoder = checkpoint['encoder']
-    encoder = encoder.to(device)
-    encoder.eval()
+    if args.pack:
+        from weight_pack import load_models
+        encoder, decoder = load_models(args.pack, device)
+    else:
+        checkpoint = torch.load(args.model)
+        decoder = checkpoint['decoder']
+        decoder = decoder.to(device)
+        decoder.eval()
+        encoder = checkpoint['encoder']
+        encoder = encoder.to(device)
+        encoder.eval()
 
     # load word map (word2ix)
     with open(args.word_map, 'r') as j:
         word_map = json.load(j)
     rev_word_map = {v: k for k, v in word_map.items()}
 
+    if len(args.img) > 1:
+        # several images, one caption per line of result.txt; with --alphas each caption is followed by
+        # its map size and maps on two lines, like the single image result
+        results = caption_images_beam_search(encoder, decoder, args.img, word_map, args.beam_size, args.alphas,
+                                             args.max_steps)
+        with open(args.result, "w", encoding="utf-8") as file:
+            for seq, alphas in results:
+                file.write("".join([rev_word_map[ind] for ind in seq[1:-1]]) + "\n")
+                if args.alphas:
+                    alphas = torch.FloatTensor(alphas)
+                    file.write("{}\n{}\n".format(alphas.size(1), quantize_alphas(alphas[1:-1])))
+        sys.exit(0)
+
     # encode, decode with attention and beam search
-    seq, alphas = caption_image_beam_search(encoder, decoder, args.img, word_map, args.beam_size)
-    alphas = torch.FloatTensor(alphas)
+    seq, alphas = caption_image_beam_search(encoder, decoder, args.img[0], word_map, args.beam_size, args.alphas,
+                                              args.max_steps)
+    if alphas is not None:
+        alphas = torch.FloatTensor(alphas)
 
     # visualize caption and attention of best sequence
-    visualize_att(args.img, seq, alphas, rev_word_map, args.smooth)
+    visualize_att(args.img[0], seq, alphas, rev_word_map, args.smooth, args.result)
+
+    # attention maps go after the caption: the map size, then one uint8 map per token (<start>, <end> excluded)
+    if alphas is not None:
+        with open(args.result, "a", encoding="utf-8") as file:
+            file.write("\n{}\n{}".format(alphas.size(1), quantize_alphas(alphas[1:-1])))
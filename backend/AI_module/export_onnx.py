@@ -0,0 +1,87 @@
+import os
+import argparse
+
+import torch
+import torch.nn.functional as F
+from torch import nn
+
+# graphs of the onnx backend of cc_server (caption/onnx_backend.h): the encoder, the initial state and attention
+# projection of an image, and one decode-step of the beams of an image
+
+class EncoderGraph(nn.Module):
+    """
+    images (n, 3, 256, 256) -> encoder_out (n, num_pixels, encoder_dim)
+    """
+    def __init__(self, encoder):
+        super(EncoderGraph, self).__init__()
+        self.encoder = encoder
+
+    def forward(self, images):
+        encoder_out = self.encoder(images)
+        return encoder_out.view(encoder_out.size(0), -1, encoder_out.size(3))
+
+class DecoderInitGraph(nn.Module):
+    """
+    encoder_out (1, num_pixels, encoder_dim) -> att1 (1, num_pixels, attention_dim), h0 (1, decoder_dim), c0 (1, decoder_dim)
+    """
+    def __init__(self, decoder):
+        super(DecoderInitGraph, self).__init__()
+        self.decoder = decoder
+
+    def forward(self, encoder_out):
+        att1 = self.decoder.attention.encoder_att(encoder_out)
+        h, c = self.decoder.init_hidden_state(encoder_out)
+        return att1, h, c
+
+class DecoderStepGraph(nn.Module):
+    """
+    one decode-step of s beams of one image, the decode-step of caption_image_beam_search:
+    encoder_out (1, num_pixels, encoder_dim), att1, words (s), h (s, decoder_dim), c -> log_probs (s, vocab_size), h, c
+    """
+    def __init__(self, decoder):
+        super(DecoderStepGraph, self).__init__()
+        self.decoder = decoder
+
+    def forward(self, encoder_out, att1, words, h, c):
+        embeddings = self.decoder.embedding(words)
+        awe, _ = self.decoder.attention(encoder_out, h, att1)
+        gate = self.decoder.sigmoid(self.decoder.f_beta(h))
+        h, c = self.decoder.decode_step(torch.cat([embeddings, gate * awe], dim=1), (h, c))
+        return F.log_softmax(self.decoder.fc(h), dim=1), h, c
+
+if __name__ == '__main__':
+
+    # parse argument
+    parser = argparse.ArgumentParser(description='Export the model to onnx for the onnx backend of cc_server')
+    parser.add_argument('--model', '-m', default='BEST_checkpoint_.pth.tar', help='path to model')
+    parser.add_argument('--out', '-o', default='onnx', help='folder of the graphs')
+    parser.add_argument('--opset', default=13, type=int, help='onnx opset version')
+    args = parser.parse_args()
+
+    checkpoint = torch.load(args.model, map_location='cpu')
+    encoder = checkpoint['encoder'].eval()
+    decoder = checkpoint['decoder'].eval()
+    os.makedirs(args.out, exist_ok=True)
+
+    with torch.no_grad():
+        images = torch.zeros(1, 3, 256, 256)
+        encoder_out = EncoderGraph(encoder)(images)
+        torch.onnx.export(EncoderGraph(encoder), (images,), os.path.join(args.out, 'encoder.onnx'),
+                          input_names=['images'], output_names=['encoder_out'],
+                          dynamic_axes={'images': {0: 'n'}, 'encoder_out': {0: 'n'}}, opset_version=args.opset)
+
+        att1, h, c = DecoderInitGraph(decoder)(encoder_out)
+        torch.onnx.export(DecoderInitGraph(decoder), (encoder_out,), os.path.join(args.out, 'decoder_init.onnx'),
+                          input_names=['encoder_out'], output_names=['att1', 'h0', 'c0'], opset_version=args.opset)
+
+        # the beams are the dynamic dimension of a step
+        s = 3
+        words = torch.zeros(s, dtype=torch.long)
+        h, c = h.expand(s, -1).contiguous(), c.expand(s, -1).contiguous()
+        torch.onnx.export(DecoderStepGraph(decoder), (encoder_out, att1, words, h, c),
+                          os.path.join(args.out, 'decoder_step.onnx'),
+                          input_names=['encoder_out', 'att1', 'words', 'h', 'c'],
+                          output_names=['log_probs', 'h_out', 'c_out'],
+                          dynamic_axes={'words': {0: 's'}, 'h': {0: 's'}, 'c': {0: 's'}, 'log_probs': {0: 's'},
+                                        'h_out': {0: 's'}, 'c_out': {0: 's'}}, opset_version=args.opset)
+    print("[*] wrote encoder.onnx, decoder_init.onnx and decoder_step.onnx to {}".format(args.out))
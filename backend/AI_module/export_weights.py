@@ -0,0 +1,126 @@
+import struct
+import argparse
+
+import torch
+from torch import nn
+
+# layout read by cc_server/caption/weights.h
+WEIGHT_MAGIC = b'ICWT'
+WEIGHT_VERSION = 1
+WEIGHT_ALIGNMENT = 64
+WEIGHT_NAME_SIZE = 96
+DTYPE_F32 = 0
+DTYPE_I8 = 1
+
+# linear layers stored in int8 by --int8, the ones a decode step (or init_h / init_c) reads
+QUANTIZED_WEIGHTS = ['attention.decoder_att.weight', 'f_beta.weight', 'decode_step.weight_ih',
+                     'decode_step.weight_hh', 'init_h.weight', 'init_c.weight', 'fc.weight']
+
+HEADER_FORMAT = '<4sIII'
+ENTRY_FORMAT = '<{}sII4IQQ'.format(WEIGHT_NAME_SIZE)
+
+def align(offset):
+    return (offset + WEIGHT_ALIGNMENT - 1) // WEIGHT_ALIGNMENT * WEIGHT_ALIGNMENT
+
+def quantize_per_channel(weight):
+    """
+    symmetric int8 quantization with one scale per output channel (row)
+    :param weight: weight of a linear layer, a tensor of dimension (out, in)
+    :return: int8 weight, float32 scales (out)
+    """
+    weight = weight.detach().float()
+    scale = weight.abs().max(dim=1).values / 127.
+    scale[scale == 0] = 1.
+    q = torch.round(weight / scale.unsqueeze(1)).clamp(-127, 127).to(torch.int8)
+    return q, scale
+
+def quantize_tensors(tensors):
+    """
+    replaces the weights in QUANTIZED_WEIGHTS by their int8 version and a '<name>.scale' tensor
+    :param tensors: list of (name, tensor)
+    :return: list of (name, tensor)
+    """
+    quantized = list()
+    for name, tensor in tensors:
+        if name in QUANTIZED_WEIGHTS:
+            q, scale = quantize_per_channel(tensor)
+            quantized.append((name, q))
+            quantized.append((name + '.scale', scale))
+        else:
+            quantized.append((name, tensor))
+    return quantized
+
+def fold_batch_norm(encoder):
+    """
+    folds every BatchNorm of the encoder into the convolution before it: the convolution gets
+    w * gamma / sqrt(var + eps) and the bias beta - mean * gamma / sqrt(var + eps)
+    :param encoder: Encoder in eval mode
+    :return: list of (name, tensor) with the 'encoder.' prefix, no BatchNorm tensors
+    """
+    tensors = list()
+    conv = None
+    for name, module in encoder.named_modules():
+        if isinstance(module, nn.Conv2d):
+            conv = (name, module)
+        elif isinstance(module, nn.BatchNorm2d):
+            conv_name, conv_module = conv
+            scale = module.weight.detach() / torch.sqrt(module.running_var + module.eps)
+            bias = module.bias.detach() - module.running_mean * scale
+            if conv_module.bias is not None:
+                bias = bias + conv_module.bias.detach() * scale
+            tensors.append(('encoder.' + conv_name + '.weight', conv_module.weight.detach() * scale.view(-1, 1, 1, 1)))
+            tensors.append(('encoder.' + conv_name + '.bias', bias))
+            conv = None
+    return tensors
+
+def write_weights(tensors, path):
+    """
+    writes float32 and int8 tensors to a flat weight file for the native decoder
+    :param tensors: list of (name, tensor), int8 tensors are kept, anything else is stored as float32
+    :param path: path to weight file
+    """
+    header_size = struct.calcsize(HEADER_FORMAT) + len(tensors) * struct.calcsize(ENTRY_FORMAT)
+
+    entries = list()
+    blobs = list()
+    offset = align(header_size)
+    for name, tensor in tensors:
+        if tensor.dtype == torch.int8:
+            data, dtype = tensor.detach().cpu().contiguous(), DTYPE_I8
+        else:
+            data, dtype = tensor.detach().float().cpu().contiguous(), DTYPE_F32
+        assert data.dim() <= 4 and len(name) < WEIGHT_NAME_SIZE
+        blob = data.numpy().tobytes()
+        dims = list(data.shape) + [0] * (4 - data.dim())
+        entries.append(struct.pack(ENTRY_FORMAT, name.encode('ascii'), dtype, data.dim(), *dims, offset, len(blob)))
+        blobs.append((offset, blob))
+        offset = align(offset + len(blob))
+
+    with open(path, 'wb') as f:
+        f.write(struct.pack(HEADER_FORMAT, WEIGHT_MAGIC, WEIGHT_VERSION, len(tensors), 0))
+        for entry in entries:
+            f.write(entry)
+        for offset, blob in blobs:
+            f.write(b'\0' * (offset - f.tell()))
+            f.write(blob)
+
+if __name__ == '__main__':
+
+    # parse argument
+    parser = argparse.ArgumentParser(description='Export decoder weights for the native decoder')
+    parser.add_argument('--model', '-m', default='BEST_checkpoint_.pth.tar', help='path to model')
+    parser.add_argument('--out', '-o', default='decoder.weights', help='path to weight file')
+    parser.add_argument('--int8', action='store_true', help='store the linear layers of a decode step in int8')
+    parser.add_argument('--encoder', action='store_true',
+                        help='also store the encoder with BatchNorm folded, for weight_pack.py to load without pickle')
+    args = parser.parse_args()
+
+    checkpoint = torch.load(args.model, map_location='cpu')
+    decoder = checkpoint['decoder']
+    tensors = list(decoder.state_dict().items())
+    if args.int8:
+        tensors = quantize_tensors(tensors)
+    if args.encoder:
+        tensors += fold_batch_norm(checkpoint['encoder'].eval())
+    write_weights(tensors, args.out)
+    print("[*] wrote {} tensors to {}".format(len(tensors), args.out))
@@ -8,12 +8,16 @@ class Encoder(nn.Module):
     """
     encoder
     """
-    def __init__(self, encoded_image_size=14):
+    def __init__(self, encoded_image_size=14, pretrained=True):
+        """
+        :param encoded_image_size: size of the encoded image
+        :param pretrained: start from the ImageNet weights, False when the weights are loaded afterwards
+        """
         super(Encoder, self).__init__()
         self.enc_image_size = encoded_image_size
         
         # pretrained ImageNet ResNet-101
-        resnet = torchvision.models.resnet101(pretrained=True)
+        resnet = torchvision.models.resnet101(pretrained=pretrained)
 
         # remove linear and pool layers since we're not doing classification
         modules = list(resnet.children())[:-2]
@@ -69,18 +73,27 @@ class Attention(nn.Module):
         # softmax layer to calculate weights
         self.softmax = nn.Softmax(dim=1) 
 
-    def forward(self, encoder_out, decoder_hidden):
+    def forward(self, encoder_out, decoder_hidden, att1=None):
         """
         forward propagation
-        :param encoder_out: encoded images, a tensor of dimension (batch_size, num_pixels, encoder_dim)
+        :param encoder_out: encoded images, a tensor of dimension (batch_size, num_pixels, encoder_dim),
+                            batch_size may be 1 when every row of decoder_hidden attends to the same image
         :param decoder_hidden: previous decoder output, a tensor of dimension (batch_size, decoder_dim)
+        :param att1: encoder_att(encoder_out) when it is already known, it only depends on the image,
+                     so decoding computes it once per image instead of once per step
         :return: attention weighted encoding, weights
         """
-        att1 = self.encoder_att(encoder_out)                                          # (batch_size, num_pixels, attention_dim)
+        if att1 is None:
+            att1 = self.encoder_att(encoder_out)                                      # (batch_size, num_pixels, attention_dim)
         att2 = self.decoder_att(decoder_hidden)                                       # (batch_size, attention_dim)
         att = self.full_att(self.relu(att1 + att2.unsqueeze(1))).squeeze(2)           # (batch_size, num_pixels)
         alpha = self.softmax(att)                                                     # (batch_size, num_pixels)
-        attention_weighted_encoding = (encoder_out * alpha.unsqueeze(2)).sum(dim=1)   # (batch_size, encoder_dim)
+        if encoder_out.size(0) == 1:
+            # every row attends to the one image: a (batch_size, num_pixels) x (num_pixels, encoder_dim) product,
+            # without a (batch_size, num_pixels, encoder_dim) intermediate
+            attention_weighted_encoding = torch.mm(alpha, encoder_out[0])               # (batch_size, encoder_dim)
+        else:
+            attention_weighted_encoding = (encoder_out * alpha.unsqueeze(2)).sum(dim=1)   # (batch_size, encoder_dim)
 
         return attention_weighted_encoding, alpha
 
@@ -0,0 +1,251 @@
+import os
+import ctypes
+
+import numpy as np
+import torch
+
+from beam_state import BeamState, max_decode_steps
+
+# shared library built from cc_server/caption/capi.cc
+default_library = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'cc_server', 'caption',
+                               'caption.dll' if os.name == 'nt' else 'libcaption.so')
+
+# caption::GateTable
+gate_tables = {'off': 0, 'fp32': 1, 'fp16': 2}
+
+# caption::ShortlistMode
+shortlist_modes = {'off': 0, 'approx': 1, 'guarded': 2}
+
+c_float_p = ctypes.POINTER(ctypes.c_float)
+c_int_p = ctypes.POINTER(ctypes.c_int)
+
+def as_float_p(array):
+    return array.ctypes.data_as(c_float_p)
+
+def as_int_p(array):
+    return array.ctypes.data_as(c_int_p)
+
+class NativeDecoder(object):
+    """
+    the C++ decoder of cc_server, driven step by step from Python
+    """
+    def __init__(self, weight_path, library=default_library, gate_table='fp32', populate=False, lock=False):
+        """
+        :param weight_path: weight file written by export_weights.py, mapped read-only and shared between processes
+        :param library: path to the shared library built from cc_server/caption/capi.cc
+        :param gate_table: precision of the word to LSTM gate table built at load time, 'fp32', 'fp16' or 'off'
+        :param populate: read the whole weight file in at load time instead of on first use
+        :param lock: keep the weight file in memory (mlock / VirtualLock)
+        """
+        lib = ctypes.CDLL(library)
+        lib.caption_last_error.restype = ctypes.c_char_p
+        lib.caption_decoder_open.restype = ctypes.c_void_p
+        lib.caption_decoder_open.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+        lib.caption_decoder_free.argtypes = [ctypes.c_void_p]
+        lib.caption_decoder_dims.argtypes = [ctypes.c_void_p, c_int_p]
+        lib.caption_decoder_shortlist.restype = ctypes.c_int
+        lib.caption_decoder_shortlist.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                                                  ctypes.c_float, c_int_p, ctypes.c_int]
+        lib.caption_decoder_shortlist_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_longlong)]
+        lib.caption_decoder_memory.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_longlong)]
+        lib.caption_image_prepare.restype = ctypes.c_void_p
+        lib.caption_image_prepare.argtypes = [ctypes.c_void_p, c_float_p, ctypes.c_int]
+        lib.caption_image_prepare_into.restype = ctypes.c_int
+        lib.caption_image_prepare_into.argtypes = [ctypes.c_void_p, ctypes.c_void_p, c_float_p, ctypes.c_int]
+        lib.caption_image_free.argtypes = [ctypes.c_void_p]
+        lib.caption_image_state.argtypes = [ctypes.c_void_p, c_float_p, c_float_p]
+        lib.caption_decoder_step.restype = ctypes.c_int
+        lib.caption_decoder_step.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, c_int_p,
+                                             c_float_p, c_float_p, c_float_p, c_float_p, c_float_p, c_float_p]
+        lib.caption_decoder_step_topk.restype = ctypes.c_int
+        lib.caption_decoder_step_topk.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, c_int_p, c_float_p,
+                                                  c_float_p, c_float_p, c_float_p, ctypes.c_int, c_int_p, c_float_p]
+        lib.caption_beam_search.restype = ctypes.c_int
+        lib.caption_beam_search.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_float,
+                                            ctypes.c_int, ctypes.c_int, c_int_p, ctypes.c_int]
+        self.lib = lib
+
+        self.handle = lib.caption_decoder_open(weight_path.encode(), gate_tables[gate_table],
+                                               (1 if populate else 0) | (2 if lock else 0))
+        if not self.handle:
+            raise RuntimeError(lib.caption_last_error().decode())
+
+        dims = np.zeros(5, dtype=np.int32)
+        lib.caption_decoder_dims(self.handle, as_int_p(dims))
+        self.encoder_dim, self.attention_dim, self.embed_dim, self.decoder_dim, self.vocab_size = dims.tolist()
+
+    def close(self):
+        if self.handle:
+            self.lib.caption_decoder_free(self.handle)
+            self.handle = None
+
+    def set_shortlist(self, mode, word_map, image_words=1000, frequent_words=500, tolerance=1e-4):
+        """
+        restricts the output layer of the beam search to a vocabulary shortlist per image, for the images prepared from now on
+        :param mode: 'approx' normalizes over the shortlist, 'guarded' redoes the beams the shortlist cannot vouch for
+                     over the whole vocabulary, 'off'
+        :param word_map: word map, its special tokens are always in the shortlist
+        :param image_words: number of words from the image prior fc(init_h(mean encoder feature))
+        :param frequent_words: number of words with the highest fc bias
+        :param tolerance: probability mass 'guarded' may leave out
+        """
+        words = np.array([word_map[w] for w in ['<start>', '<end>', '<unk>', '<pad>'] if w in word_map], dtype=np.int32)
+        if self.lib.caption_decoder_shortlist(self.handle, shortlist_modes[mode], image_words, frequent_words, tolerance,
+                                              as_int_p(words), words.shape[0]) != 0:
+            raise RuntimeError(self.lib.caption_last_error().decode())
+
+    def shortlist_stats(self):
+        """
+        :return: beams decoded over a shortlist, beams of them redone over the whole vocabulary, words outside the
+                 shortlist the guard scored one by one
+        """
+        stats = (ctypes.c_longlong * 3)()
+        self.lib.caption_decoder_shortlist_stats(self.handle, stats)
+        return stats[0], stats[1], stats[2]
+
+    def activation_memory(self):
+        """
+        :return: bytes of the activation arena of the decoder (its peak activation memory), bytes of the same buffers
+                 without sharing
+        """
+        memory = (ctypes.c_longlong * 2)()
+        self.lib.caption_decoder_memory(self.handle, memory)
+        return memory[0], memory[1]
+
+    def prepare(self, encoder_out, image=None):
+        """
+        :param encoder_out: encoded image, a tensor of dimension (1, enc_image_size, enc_image_size, encoder_dim)
+        :param image: handle of an earlier image to prepare this one into, reusing its buffers
+        :return: image handle, initial hidden state, initial cell state
+        """
+        features = np.ascontiguousarray(encoder_out.detach().cpu().view(-1, self.encoder_dim).numpy(), dtype=np.float32)
+        if image is None:
+            image = self.lib.caption_image_prepare(self.handle, as_float_p(features), features.shape[0])
+            if not image:
+                raise RuntimeError(self.lib.caption_last_error().decode())
+        elif self.lib.caption_image_prepare_into(self.handle, image, as_float_p(features), features.shape[0]) != 0:
+            raise RuntimeError(self.lib.caption_last_error().decode())
+        h = np.zeros(self.decoder_dim, dtype=np.float32)
+        c = np.zeros(self.decoder_dim, dtype=np.float32)
+        self.lib.caption_image_state(image, as_float_p(h), as_float_p(c))
+        return image, h, c
+
+    def release(self, image):
+        self.lib.caption_image_free(image)
+
+    def step(self, image, words, h, c, num_pixels):
+        """
+        one decode-step of the beams of one image
+        :param words: previous words, int32 array of dimension (s)
+        :param h: hidden state, float32 array of dimension (s, decoder_dim)
+        :param c: cell state, float32 array of dimension (s, decoder_dim)
+        :return: new hidden state, new cell state, log-probabilities (s, vocab_size), alphas (s, num_pixels)
+        """
+        s = words.shape[0]
+        h_out = np.empty((s, self.decoder_dim), dtype=np.float32)
+        c_out = np.empty((s, self.decoder_dim), dtype=np.float32)
+        log_probs = np.empty((s, self.vocab_size), dtype=np.float32)
+        alpha = np.empty((s, num_pixels), dtype=np.float32)
+        if self.lib.caption_decoder_step(self.handle, image, s, as_int_p(words), as_float_p(h), as_float_p(c),
+                                         as_float_p(h_out), as_float_p(c_out), as_float_p(log_probs), as_float_p(alpha)) != 0:
+            raise RuntimeError(self.lib.caption_last_error().decode())
+        return h_out, c_out, log_probs, alpha
+
+    def step_topk(self, image, words, h, c, k):
+        """
+        one decode-step that only returns the k most likely next words of every beam
+        (fused output projection, log_softmax and top-k)
+        :param words: previous words, int32 array of dimension (s)
+        :param h: hidden state, float32 array of dimension (s, decoder_dim)
+        :param c: cell state, float32 array of dimension (s, decoder_dim)
+        :param k: number of words to keep per beam
+        :return: new hidden state, new cell state, next words (s, k), their log-probabilities (s, k)
+        """
+        s = words.shape[0]
+        h_out = np.empty((s, self.decoder_dim), dtype=np.float32)
+        c_out = np.empty((s, self.decoder_dim), dtype=np.float32)
+        next_words = np.empty((s, k), dtype=np.int32)
+        next_log_probs = np.empty((s, k), dtype=np.float32)
+        if self.lib.caption_decoder_step_topk(self.handle, image, s, as_int_p(words), as_float_p(h), as_float_p(c),
+                                              as_float_p(h_out), as_float_p(c_out), k, as_int_p(next_words),
+                                              as_float_p(next_log_probs)) != 0:
+            raise RuntimeError(self.lib.caption_last_error().decode())
+        return h_out, c_out, next_words, next_log_probs
+
+    def beam_search(self, image, word_map, beam_size=3, max_steps=max_decode_steps, length_norm=0.0):
+        """
+        whole beam search of one image in the native driver
+        :param image: image handle from prepare
+        :param word_map: word map
+        :param beam_size: number of sequences to consider at each decode-step
+        :param max_steps: maximum number of decode-steps
+        :param length_norm: exponent of the length normalization of finished sequences, 0 to compare raw scores
+        :return: caption
+        """
+        seq = np.zeros(max_steps + 1, dtype=np.int32)
+        n = self.lib.caption_beam_search(self.handle, image, beam_size, max_steps, length_norm,
+                                         word_map['<start>'], word_map['<end>'], as_int_p(seq), seq.shape[0])
+        if n < 0:
+            raise RuntimeError(self.lib.caption_last_error().decode())
+        return seq[:n].tolist()
+
+def native_preprocess(image_path, library=default_library, jpeg_scaling=True):
+    """
+    read_image of demo.py in the native preprocessing of cc_server (caption/preprocess.h)
+    :param image_path: path to a JPEG or PNG image
+    :param library: path to the shared library built from cc_server/caption/capi.cc
+    :param jpeg_scaling: decode large JPEGs at 1/2, 1/4 or 1/8 scale in the IDCT before the resize
+    :return: image, an array of dimension (3, 256, 256)
+    """
+    lib = ctypes.CDLL(library)
+    lib.caption_last_error.restype = ctypes.c_char_p
+    lib.caption_preprocess_image_with.restype = ctypes.c_int
+    lib.caption_preprocess_image_with.argtypes = [ctypes.c_char_p, ctypes.c_longlong, ctypes.c_int, c_float_p]
+    with open(image_path, 'rb') as f:
+        data = f.read()
+    image = np.zeros((3, 256, 256), dtype=np.float32)
+    if lib.caption_preprocess_image_with(data, len(data), 1 if jpeg_scaling else 0, as_float_p(image)) != 0:
+        raise RuntimeError(lib.caption_last_error().decode())
+    return image
+
+def native_beam_search(native, encoder_out, word_map, beam_size=3, max_steps=max_decode_steps):
+    """
+    beam search of caption_image_beam_search with the decode-steps run by the native decoder
+    :param native: NativeDecoder
+    :param encoder_out: encoded image, a tensor of dimension (1, enc_image_size, enc_image_size, encoder_dim)
+    :param word_map: word map
+    :param beam_size: number of sequences to consider at each decode-step
+    :param max_steps: maximum number of decode-steps
+    :return: caption
+    """
+    k = beam_size
+    num_pixels = encoder_out.size(1) * encoder_out.size(2)
+    image, h0, c0 = native.prepare(encoder_out)
+    h = np.ascontiguousarray(np.broadcast_to(h0, (k, native.decoder_dim)))
+    c = np.ascontiguousarray(np.broadcast_to(c0, (k, native.decoder_dim)))
+    beams = BeamState(k, max_steps, word_map['<start>'], word_map['<end>'])
+
+    try:
+        while True:
+            words = beams.prev_words().numpy().astype(np.int32)
+            h, c, log_probs, _ = native.step(image, words, h, c, num_pixels)
+            scores = beams.top_k_scores() + torch.from_numpy(log_probs)         # (s, vocab_size)
+
+            if beams.step == 0:
+                top_k_scores, top_k_words = scores[0].topk(beams.k, 0, True, True)
+            else:
+                top_k_scores, top_k_words = scores.view(-1).topk(beams.k, 0, True, True)
+            prev_word_inds = torch.div(top_k_words, native.vocab_size, rounding_mode='floor')
+            next_word_inds = top_k_words % native.vocab_size
+
+            sources = beams.advance(top_k_scores, prev_word_inds, next_word_inds)
+            if beams.done:
+                break
+            sources = sources.numpy()
+            h = h[sources]
+            c = c[sources]
+    finally:
+        native.release(image)
+
+    seq, _ = beams.best()
+    return seq
@@ -0,0 +1,91 @@
+import json
+import time
+import argparse
+
+import jieba
+import torch
+from nltk.translate.bleu_score import corpus_bleu
+
+from config import *
+from demo import read_image
+from native_decoder import NativeDecoder, default_library
+
+def read_references(word_map, samples):
+    """
+    tokenizes the reference captions of the validation split like data_generator.py
+    :param word_map: word map
+    :param samples: validation annotations
+    :return: list of references per image, <start>/<end>/<pad> excluded
+    """
+    references = list()
+    for sample in samples:
+        references.append([[word_map.get(word, word_map['<unk>']) for word in jieba.cut(c)] for c in sample['caption']])
+    return references
+
+def decode(native, image, word_map, beam_size):
+    """
+    :return: caption without <start> and <end>, decode time in seconds
+    """
+    start = time.perf_counter()
+    seq = native.beam_search(image, word_map, beam_size)
+    elapsed = time.perf_counter() - start
+    return [w for w in seq if w not in {word_map['<start>'], word_map['<end>']}], elapsed
+
+# compares the int8 native decoder with the float32 one on the validation split:
+# identical captions, BLEU-4 against the references and decode time
+if __name__ == '__main__':
+
+    # parse argument
+    parser = argparse.ArgumentParser(description='Accuracy report of the int8 native decoder')
+    parser.add_argument('--model', '-m', default='BEST_checkpoint_.pth.tar', help='path to model')
+    parser.add_argument('--weights', default='decoder.weights', help='float32 weight file written by export_weights.py')
+    parser.add_argument('--int8_weights', default='decoder.int8.weights', help='weight file written by export_weights.py --int8')
+    parser.add_argument('--library', '-l', default=default_library, help='shared library built from caption/capi.cc')
+    parser.add_argument('--word_map', '-wm', default='data/WORDMAP.json', help='path to word map JSON')
+    parser.add_argument('--beam_size', '-b', default=5, type=int, help='beam size for beam search')
+    parser.add_argument('--num_images', '-n', default=500, type=int, help='number of validation images, 0 for all')
+    args = parser.parse_args()
+
+    checkpoint = torch.load(args.model, map_location=device)
+    encoder = checkpoint['encoder'].to(device).eval()
+    with open(args.word_map, 'r') as j:
+        word_map = json.load(j)
+    with open(valid_annotations_filename, 'r') as j:
+        samples = json.load(j)
+    if args.num_images > 0:
+        samples = samples[:args.num_images]
+
+    decoders = {'float32': NativeDecoder(args.weights, args.library),
+                'int8': NativeDecoder(args.int8_weights, args.library)}
+    hypotheses = {name: list() for name in decoders}
+    seconds = {name: 0. for name in decoders}
+    identical = 0
+
+    for i, sample in enumerate(samples):
+        with torch.no_grad():
+            encoder_out = encoder(read_image(os.path.join(valid_image_folder, sample['image_id'])).unsqueeze(0))
+        captions = dict()
+        for name, native in decoders.items():
+            image, _, _ = native.prepare(encoder_out)
+            try:
+                captions[name], elapsed = decode(native, image, word_map, args.beam_size)
+            finally:
+                native.release(image)
+            hypotheses[name].append(captions[name])
+            seconds[name] += elapsed
+        identical += 1 if captions['float32'] == captions['int8'] else 0
+
+        if i % print_freq == 0:
+            print("[{}/{}] identical captions: {}".format(i + 1, len(samples), identical))
+
+    references = read_references(word_map, samples)
+    print("-" * 80)
+    print("images                 : {}".format(len(samples)))
+    print("identical captions     : {:.2f}%".format(100. * identical / len(samples)))
+    for name in decoders:
+        print("{:<8} BLEU-4        : {:.4f}".format(name, corpus_bleu(references, hypotheses[name])))
+        print("{:<8} decode (ms)   : {:.2f}".format(name, 1000. * seconds[name] / len(samples)))
+    print("speedup                : {:.2f}x".format(seconds['float32'] / seconds['int8']))
+
+    for native in decoders.values():
+        native.close()
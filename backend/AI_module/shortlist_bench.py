@@ -0,0 +1,76 @@
+import json
+import time
+import argparse
+
+import torch
+
+from config import *
+from demo import read_image
+from native_decoder import NativeDecoder, default_library
+
+# speed of the vocabulary shortlist of the native decoder against caption agreement with the whole vocabulary,
+# on the validation split
+if __name__ == '__main__':
+
+    # parse argument
+    parser = argparse.ArgumentParser(description='Benchmark the vocabulary shortlist of the native decoder')
+    parser.add_argument('--model', '-m', default='BEST_checkpoint_.pth.tar', help='path to model')
+    parser.add_argument('--weights', '-w', default='decoder.weights', help='weight file written by export_weights.py')
+    parser.add_argument('--library', '-l', default=default_library, help='shared library built from caption/capi.cc')
+    parser.add_argument('--word_map', '-wm', default='data/WORDMAP.json', help='path to word map JSON')
+    parser.add_argument('--beam_size', '-b', default=5, type=int, help='beam size for beam search')
+    parser.add_argument('--num_images', '-n', default=200, type=int, help='number of validation images, 0 for all')
+    parser.add_argument('--image_words', default='250,500,1000,2000', help='shortlist sizes from the image prior')
+    parser.add_argument('--frequent_words', default=500, type=int, help='words with the highest fc bias')
+    parser.add_argument('--tolerance', default=1e-4, type=float, help='probability mass the guarded mode may leave out')
+    args = parser.parse_args()
+
+    checkpoint = torch.load(args.model, map_location=device)
+    encoder = checkpoint['encoder'].to(device).eval()
+    with open(args.word_map, 'r') as j:
+        word_map = json.load(j)
+    with open(valid_annotations_filename, 'r') as j:
+        samples = json.load(j)
+    if args.num_images > 0:
+        samples = samples[:args.num_images]
+
+    # the encoder runs once, every configuration decodes the same features
+    features = list()
+    with torch.no_grad():
+        for sample in samples:
+            features.append(encoder(read_image(os.path.join(valid_image_folder, sample['image_id'])).unsqueeze(0)))
+
+    native = NativeDecoder(args.weights, args.library)
+    configs = [('off', 0)]
+    for mode in ['approx', 'guarded']:
+        configs += [(mode, int(n)) for n in args.image_words.split(',')]
+
+    reference = None
+    # fallbacks: beams redone over the whole vocabulary, checked: words per beam the guard scored one by one
+    print("{:<8} {:>6} {:>10} {:>8} {:>10} {:>10} {:>8}".format('mode', 'words', 'ms/image', 'speedup', 'identical',
+                                                               'fallbacks', 'checked'))
+    for mode, image_words in configs:
+        native.set_shortlist(mode, word_map, image_words, args.frequent_words, args.tolerance)
+        captions = list()
+        seconds = 0.
+        # one image handle for all, prepared again for every image without allocating
+        image = None
+        try:
+            for encoder_out in features:
+                start = time.perf_counter()
+                image, _, _ = native.prepare(encoder_out, image)
+                captions.append(native.beam_search(image, word_map, args.beam_size))
+                seconds += time.perf_counter() - start
+        finally:
+            if image is not None:
+                native.release(image)
+
+        if reference is None:
+            reference, base = captions, seconds
+        identical = sum([1 if a == b else 0 for a, b in zip(captions, reference)])
+        rows, fallbacks, exact_words = native.shortlist_stats()
+        print("{:<8} {:>6} {:>10.2f} {:>7.2f}x {:>9.2f}% {:>9.2f}% {:>8.0f}".format(
+            mode, image_words, 1000. * seconds / len(features), base / seconds, 100. * identical / len(features),
+            100. * fallbacks / rows if rows > 0 else 0., exact_words / rows if rows > 0 else 0.))
+
+    native.close()
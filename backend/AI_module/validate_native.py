@@ -0,0 +1,60 @@
+import os
+import json
+import argparse
+
+import torch
+
+from demo import caption_image_beam_search, read_image, device
+from native_decoder import NativeDecoder, native_beam_search, default_library
+
+# checks the native decoder of cc_server against demo.py, token for token, on a folder of images
+if __name__ == '__main__':
+
+    # parse argument
+    parser = argparse.ArgumentParser(description='Validate the native decoder against demo.py')
+    parser.add_argument('--images', default='../cc_server/images', help='folder of images')
+    parser.add_argument('--model', '-m', default='BEST_checkpoint_.pth.tar', help='path to model')
+    parser.add_argument('--weights', '-w', default='decoder.weights', help='weight file written by export_weights.py')
+    parser.add_argument('--library', '-l', default=default_library, help='shared library built from caption/capi.cc')
+    parser.add_argument('--word_map', '-wm', default='data/WORDMAP.json', help='path to word map JSON')
+    parser.add_argument('--beam_size', '-b', default=5, type=int, help='beam size for beam search')
+    parser.add_argument('--gate_table', choices=['fp32', 'fp16', 'off'], default='fp32',
+                        help='precision of the word to LSTM gate table of the native decoder')
+    parser.add_argument('--driver', choices=['native', 'python'], default='native',
+                        help='beam search in the native driver, or in Python over native decode-steps')
+    args = parser.parse_args()
+
+    checkpoint = torch.load(args.model, map_location=device)
+    decoder = checkpoint['decoder'].to(device).eval()
+    encoder = checkpoint['encoder'].to(device).eval()
+    with open(args.word_map, 'r') as j:
+        word_map = json.load(j)
+    rev_word_map = {v: k for k, v in word_map.items()}
+    native = NativeDecoder(args.weights, args.library, args.gate_table)
+
+    mismatches = 0
+    image_names = sorted(os.listdir(args.images))
+    for name in image_names:
+        path = os.path.join(args.images, name)
+        reference, _ = caption_image_beam_search(encoder, decoder, path, word_map, args.beam_size)
+        with torch.no_grad():
+            encoder_out = encoder(read_image(path).unsqueeze(0))
+        if args.driver == 'native':
+            image, _, _ = native.prepare(encoder_out)
+            try:
+                seq = native.beam_search(image, word_map, args.beam_size)
+            finally:
+                native.release(image)
+        else:
+            seq = native_beam_search(native, encoder_out, word_map, args.beam_size)
+
+        same = seq == reference
+        mismatches += 0 if same else 1
+        print("[{}] {}: {}".format("=" if same else "x", name, "".join([rev_word_map[ind] for ind in seq[1:-1]])))
+        if not same:
+            print("    demo.py: {}".format("".join([rev_word_map[ind] for ind in reference[1:-1]])))
+
+    arena, unshared = native.activation_memory()
+    native.close()
+    print("[*] {} / {} captions identical".format(len(image_names) - mismatches, len(image_names)))
+    print("[*] activation memory: {:.1f} KB ({:.1f} KB without sharing)".format(arena / 1024, unshared / 1024))
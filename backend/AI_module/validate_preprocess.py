@@ -0,0 +1,50 @@
+import os
+import time
+import argparse
+
+import numpy as np
+import torch
+
+from demo import read_image
+from native_decoder import native_preprocess, default_library
+
+# checks the native image preprocessing of cc_server (decode, resize, normalize) against read_image of demo.py
+# on a folder of images, and the encoder outputs of both when a model is given
+if __name__ == '__main__':
+
+    # parse argument
+    parser = argparse.ArgumentParser(description='Validate the native image preprocessing against demo.py')
+    parser.add_argument('--images', default='../cc_server/images', help='folder of images')
+    parser.add_argument('--library', '-l', default=default_library, help='shared library built from caption/capi.cc')
+    parser.add_argument('--model', '-m', default=None, help='path to model, to compare the encoder outputs too')
+    parser.add_argument('--full_decode', action='store_true', help='decode JPEGs at full resolution, without IDCT scaling')
+    args = parser.parse_args()
+
+    encoder = None
+    if args.model:
+        encoder = torch.load(args.model, map_location='cpu')['encoder'].eval()
+
+    worst = 0.0
+    python_time = native_time = 0.0
+    image_names = sorted(os.listdir(args.images))
+    for name in image_names:
+        path = os.path.join(args.images, name)
+        start = time.perf_counter()
+        reference = read_image(path).cpu().numpy()
+        python_time += time.perf_counter() - start
+        start = time.perf_counter()
+        image = native_preprocess(path, args.library, not args.full_decode)
+        native_time += time.perf_counter() - start
+
+        err = float(np.abs(image - reference).max())
+        worst = max(worst, err)
+        line = "{}: max abs err {:.2e}".format(name, err)
+        if encoder is not None:
+            with torch.no_grad():
+                out = encoder(torch.from_numpy(np.stack([reference, image])))
+            line += ", encoder_out max abs err {:.2e}".format(float((out[0] - out[1]).abs().max()))
+        print(line)
+
+    n = max(len(image_names), 1)
+    print("[*] {} images, max abs err {:.2e}; read_image {:.1f} ms, native {:.1f} ms per image".format(
+        len(image_names), worst, python_time * 1000 / n, native_time * 1000 / n))
@@ -0,0 +1,96 @@
+import struct
+import warnings
+
+import numpy as np
+import torch
+from torch import nn
+
+from models import Encoder, DecoderWithAttention
+from export_weights import WEIGHT_MAGIC, WEIGHT_VERSION, HEADER_FORMAT, ENTRY_FORMAT, DTYPE_F32, DTYPE_I8
+
+# loads the models from a weight file written by 'export_weights.py --encoder' instead of unpickling the checkpoint.
+# the file is mapped read-only and the parameters are views of the mapping, so every worker process that loads
+# the same file on the cpu shares one copy of it in the page cache.
+
+def read_weights(path):
+    """
+    maps a weight file
+    :param path: path to weight file
+    :return: dict of name -> read-only numpy array backed by the mapping
+    """
+    data = np.memmap(path, dtype=np.uint8, mode='r')
+    magic, version, count, _ = struct.unpack_from(HEADER_FORMAT, data, 0)
+    if magic != WEIGHT_MAGIC:
+        raise ValueError("not a weight file: {}".format(path))
+    if version != WEIGHT_VERSION:
+        raise ValueError("unsupported weight file version {}".format(version))
+
+    dtypes = {DTYPE_F32: np.float32, DTYPE_I8: np.int8}
+    tensors = dict()
+    position = struct.calcsize(HEADER_FORMAT)
+    for _ in range(count):
+        name, dtype, ndim, d0, d1, d2, d3, offset, nbytes = struct.unpack_from(ENTRY_FORMAT, data, position)
+        position += struct.calcsize(ENTRY_FORMAT)
+        shape = [d0, d1, d2, d3][:ndim]
+        array = data[offset:offset + nbytes].view(dtypes[dtype]).reshape(shape)
+        tensors[name.rstrip(b'\0').decode('ascii')] = array
+    return tensors
+
+def bind_parameters(module, tensors, prefix=''):
+    """
+    points every parameter of the module at its tensor of the weight file, without copying
+    :param module: module whose parameters are named like the file
+    :param tensors: dict from read_weights
+    :param prefix: prefix of the names of the module in the file
+    """
+    with warnings.catch_warnings():
+        # the mapping is read-only, inference never writes to it
+        warnings.simplefilter('ignore', UserWarning)
+        for name, parameter in module.named_parameters():
+            array = tensors[prefix + name]
+            if array.dtype != np.float32 or tuple(array.shape) != tuple(parameter.shape):
+                raise ValueError("unexpected shape or type of tensor {}".format(prefix + name))
+            parameter.requires_grad = False
+            parameter.data = torch.from_numpy(array)
+
+def load_encoder(tensors, encoded_image_size=14):
+    """
+    :param tensors: dict from read_weights, with the 'encoder.' tensors of export_weights.py --encoder
+    :param encoded_image_size: size of the encoded image the model was trained with
+    :return: Encoder whose BatchNorm layers are folded into the convolutions
+    """
+    encoder = Encoder(encoded_image_size, pretrained=False)
+    conv = None
+    for name, module in list(encoder.named_modules()):
+        if isinstance(module, nn.Conv2d):
+            conv = module
+        elif isinstance(module, nn.BatchNorm2d):
+            conv.bias = nn.Parameter(torch.zeros(conv.out_channels))
+            parent, _, child = name.rpartition('.')
+            setattr(encoder.get_submodule(parent), child, nn.Identity())
+    bind_parameters(encoder, tensors, 'encoder.')
+    return encoder
+
+def load_decoder(tensors):
+    """
+    :param tensors: dict from read_weights, the float32 decoder of export_weights.py
+    :return: DecoderWithAttention
+    """
+    vocab_size, embed_dim = tensors['embedding.weight'].shape
+    attention_dim, encoder_dim = tensors['attention.encoder_att.weight'].shape
+    decoder_dim = tensors['fc.weight'].shape[1]
+    decoder = DecoderWithAttention(attention_dim, embed_dim, decoder_dim, vocab_size, encoder_dim)
+    bind_parameters(decoder, tensors)
+    return decoder
+
+def load_models(path, device):
+    """
+    loads encoder and decoder of a weight file written by export_weights.py --encoder
+    :param path: path to weight file
+    :param device: device to run on, anything but the cpu gets its own copy
+    :return: encoder, decoder, both in eval mode
+    """
+    tensors = read_weights(path)
+    encoder = load_encoder(tensors).to(device).eval()
+    decoder = load_decoder(tensors).to(device).eval()
+    return encoder, decoder
@@ -0,0 +1,98 @@
+// Captions every image of a folder with each backend given, one after the other, and reports the
+// captions and the time per image, so the backends are compared on the same harness:
+//   g++ -O2 -std=c++17 backend_bench.cc -o backend_bench.exe -ljpeg -lpng [-DCAPTION_WITH_ONNXRUNTIME ... -lonnxruntime]
+//   backend_bench.exe images python onnx native
+// With --features f32|f16|int8 the in-process backends caption every image a second time from its cached
+// encoder output, to time the decode alone and count the captions the format changes.
+
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0A00
+#define NOMINMAX
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+
+#include "backends.h"
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: backend_bench <image folder> <backend>... [--threads n] [--features f32|f16|int8]"
+                  << " [--weights file]" << std::endl;
+        return -1;
+    }
+
+    caption::BackendConfig config;
+    std::vector<std::string> backends;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            config.intra_op_threads = std::atoi(argv[++i]);
+        } else if (arg == "--weights" && i + 1 < argc) {
+            config.weights = argv[++i];
+        } else if (arg == "--features" && i + 1 < argc) {
+            config.feature_format = caption::ParseFeatureFormat(argv[++i]);
+            config.feature_cache_bytes = size_t(1) << 30;
+        } else {
+            backends.push_back(arg);
+        }
+    }
+
+    std::vector<std::string> images;
+    for (const auto& entry : std::filesystem::directory_iterator(argv[1])) {
+        if (entry.is_regular_file()) {
+            images.push_back(entry.path().string());
+        }
+    }
+    std::sort(images.begin(), images.end());
+
+    for (const std::string& name : backends) {
+        try {
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<caption::CaptionBackend> backend = http_server::make_backend(name);
+            backend->Load(config);
+            double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            double total_ms = 0.0;
+            std::vector<std::string> captions;
+            for (const std::string& image : images) {
+                start = std::chrono::steady_clock::now();
+                caption::CaptionResult result = backend->Caption(image, false);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                total_ms += ms;
+                captions.push_back(result.caption);
+                std::cout << "[" << name << "] " << image << " " << ms << " ms: " << result.caption << std::endl;
+            }
+            std::cout << "[" << name << "] load " << load_ms << " ms, " << total_ms / std::max<size_t>(images.size(), 1)
+                      << " ms per image over " << images.size() << " images" << std::endl;
+
+            // the first pass decoded the fresh encoder output, this one the cached and converted features
+            if (config.feature_cache_bytes > 0 && dynamic_cast<caption::InProcessBackend*>(backend.get()) != nullptr) {
+                double cached_ms = 0.0;
+                int changed = 0;
+                for (size_t i = 0; i < images.size(); i++) {
+                    start = std::chrono::steady_clock::now();
+                    caption::CaptionResult result = backend->Caption(images[i], false);
+                    cached_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                    if (result.caption != captions[i]) {
+                        changed++;
+                        std::cout << "[" << name << "] " << images[i] << " from "
+                                  << caption::FeatureFormatName(config.feature_format) << " features: " << result.caption
+                                  << std::endl;
+                    }
+                }
+                std::cout << "[" << name << "] " << cached_ms / std::max<size_t>(images.size(), 1)
+                          << " ms per image from cached " << caption::FeatureFormatName(config.feature_format)
+                          << " features, " << changed << " captions changed" << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "[" << name << "] " << e.what() << std::endl;
+        }
+    }
+    return 0;
+}
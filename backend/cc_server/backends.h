@@ -0,0 +1,35 @@
+#ifndef BACKENDS_H_
+#define BACKENDS_H_
+
+#include <memory>
+#include <string>
+#include <stdexcept>
+
+#include "caption/backend.h"
+#include "python_backend.h"
+#ifdef CAPTION_WITH_ONNXRUNTIME
+#include "caption/onnx_backend.h"
+#include "caption/native_backend.h"
+#endif
+
+namespace http_server {
+
+    // "python" runs demo.py in a subprocess, "onnx" the exported graphs in-process, "native" encoder.onnx
+    // and the native decoder on the exported weights (both built with -DCAPTION_WITH_ONNXRUNTIME)
+    std::unique_ptr<caption::CaptionBackend> make_backend(const std::string& name) {
+        if (name == "python") {
+            return std::unique_ptr<caption::CaptionBackend>(new PythonBackend());
+        }
+#ifdef CAPTION_WITH_ONNXRUNTIME
+        if (name == "onnx") {
+            return std::unique_ptr<caption::CaptionBackend>(new caption::OnnxBackend());
+        }
+        if (name == "native") {
+            return std::unique_ptr<caption::CaptionBackend>(new caption::NativeBackend());
+        }
+#endif
+        throw std::invalid_argument("Unknown backend " + name + " (or not built in)");
+    }
+}
+
+#endif
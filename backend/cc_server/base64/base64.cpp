@@ -7,6 +7,9 @@
 
    Version: 2.rc.09 (release candidate)
 
+   Altered for image-caption: the bulk of base64_decode and base64_encode
+   runs in SSE4.1/AVX2 or table kernels picked at run time (base64_kernel).
+
    Copyright (C) 2004-2017, 2020-2022 René Nyffenegger
 
    This source code is provided 'as-is', without any express or implied
@@ -33,9 +36,16 @@
 
 #include "base64.h"
 
+#include <atomic>
+#include <cstdint>
 #include <algorithm>
 #include <stdexcept>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
  //
  // Depending on the url parameter in base64_chars, one of
  // two sets of base64 characters needs to be chosen.
@@ -70,37 +80,539 @@ static unsigned int pos_of_char(const unsigned char chr) {
     throw std::runtime_error("Input is not valid base64-encoded data.");
 }
 
-static std::string insert_linebreaks(std::string str, size_t distance) {
  //
- // Provided by https://github.com/JomaCorpFX, adapted by me.
+ // Kernels for the bulk of the data (altered, see the notice above).
+ //
+ // Each kernel decodes whole 4-character chunks from the start of the
+ // input and stops before the first chunk it cannot take as is: a
+ // padding character, a character outside both alphabets or the end of
+ // the data. It returns the characters consumed; the byte-wise code of
+ // decode(…) carries on from there, so padding, the last chunk and the
+ // errors behave exactly as before. The encode kernels likewise take
+ // whole 3-byte groups that have data after them and leave the tail to
+ // base64_encode.
+ //
+ // There is no NEON kernel yet; on ARM the table kernel runs, and a NEON
+ // one would slot in as another base64_kernel.
+ //
+
+ //
+ // Value of every character, both alphabets at once; -1 for anything
+ // that is not a base64 digit (padding included)
+ //
+struct decode_table {
+    signed char value[256];
+
+    decode_table() {
+        for (int i = 0; i < 256; i++) value[i] = -1;
+        for (int i = 0; i < 64; i++) {
+            value[static_cast<unsigned char>(base64_chars[0][i])] = static_cast<signed char>(i);
+            value[static_cast<unsigned char>(base64_chars[1][i])] = static_cast<signed char>(i);
+        }
+    }
+};
+
+static const decode_table decode_values;
+
+static size_t decode_table_kernel(const unsigned char* in, size_t len, size_t pos, unsigned char* out) {
+    const signed char* value = decode_values.value;
+    while (pos + 4 <= len) {
+        int a = value[in[pos + 0]];
+        int b = value[in[pos + 1]];
+        int c = value[in[pos + 2]];
+        int d = value[in[pos + 3]];
+        if ((a | b | c | d) < 0) break;
+
+        unsigned char* o = out + pos / 4 * 3;
+        o[0] = static_cast<unsigned char>((a << 2) | (b >> 4));
+        o[1] = static_cast<unsigned char>((b << 4) | (c >> 2));
+        o[2] = static_cast<unsigned char>((c << 6) | d);
+        pos += 4;
+    }
+    return pos;
+}
+
+#ifdef BASE64_X86
+
+ //
+ // Decoding 16 characters (after Wojciech Muła, "Base64 decoding with
+ // SIMD instructions"): the high nibble of a character picks its class,
+ // a bit set per class marks the low nibbles that are not valid in it,
+ // so one pair of pshufb validates all 16 characters. A second pshufb
+ // on the class gives the offset from the character to its value; '-',
+ // '/' and '_' share their class with other characters of another value
+ // and are moved to unused classes first. pmaddubsw and pmaddwd then
+ // pack four 6-bit values into three bytes.
+ //
+ //   class   valid low nibbles         offset
+ //   0x2_    b ('+') d ('-') f ('/')   +19, '-' +17, '/' +16
+ //   0x3_    0-9                       +4
+ //   0x4_    1-f                       -65
+ //   0x5_    0-a, f ('_')              -65, '_' -32
+ //   0x6_    1-f                       -71
+ //   0x7_    0-a                       -71
+ //
+
+__attribute__((target("sse4.1")))
+static inline bool decode_values_sse(__m128i c, __m128i* values) {
+    const __m128i lut_invalid_lo = _mm_setr_epi8(
+        0x55, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
+        0x41, 0x41, 0x43, 0x6a, 0x6b, 0x6a, 0x6b, 0x62);
+    const __m128i lut_class = _mm_setr_epi8(
+        0x40, 0x40, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+        0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40);
+    const __m128i lut_offset = _mm_setr_epi8(
+        17, 16, 19, 4, -65, -65, -71, -71,
+        -32, 0, 0, 0, 0, 0, 0, 0);
+
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(c, 4), _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_and_si128(c, _mm_set1_epi8(0x0f));
+    __m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lut_invalid_lo, lo), _mm_shuffle_epi8(lut_class, hi));
+    if (!_mm_testz_si128(invalid, invalid)) return false;
+
+    // '-' 0x2d -> class 0, '/' 0x2f -> class 1, '_' 0x5f -> class 8
+    __m128i index = hi;
+    index = _mm_sub_epi8(index, _mm_and_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('-')), _mm_set1_epi8(2)));
+    index = _mm_sub_epi8(index, _mm_and_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('/')), _mm_set1_epi8(1)));
+    index = _mm_add_epi8(index, _mm_and_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('_')), _mm_set1_epi8(3)));
+    __m128i v = _mm_add_epi8(c, _mm_shuffle_epi8(lut_offset, index));
+
+    // 00aaaaaa 00bbbbbb 00cccccc 00dddddd -> aaaaaabb bbbbcccc ccdddddd in the low 12 bytes
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    *values = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+__attribute__((target("sse4.1")))
+static size_t decode_sse41_kernel(const unsigned char* in, size_t len, size_t pos, unsigned char* out) {
+ //
+ // Every store writes 16 bytes for 12, so stop while there is input
+ // left whose output the last 4 bytes fall into
+ //
+    while (pos + 24 <= len) {
+        __m128i bytes;
+        if (!decode_values_sse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos)), &bytes)) break;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + pos / 4 * 3), bytes);
+        pos += 16;
+    }
+    return decode_table_kernel(in, len, pos, out);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2_kernel(const unsigned char* in, size_t len, size_t pos, unsigned char* out) {
+    const __m256i lut_invalid_lo = _mm256_setr_epi8(
+        0x55, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
+        0x41, 0x41, 0x43, 0x6a, 0x6b, 0x6a, 0x6b, 0x62,
+        0x55, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
+        0x41, 0x41, 0x43, 0x6a, 0x6b, 0x6a, 0x6b, 0x62);
+    const __m256i lut_class = _mm256_setr_epi8(
+        0x40, 0x40, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+        0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+        0x40, 0x40, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+        0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40);
+    const __m256i lut_offset = _mm256_setr_epi8(
+        17, 16, 19, 4, -65, -65, -71, -71,
+        -32, 0, 0, 0, 0, 0, 0, 0,
+        17, 16, 19, 4, -65, -65, -71, -71,
+        -32, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+ //
+ // 32 characters per step, as the SSE kernel but with the 12 bytes of
+ // both lanes moved together. The 8 spare bytes of the 32-byte store
+ // must fall into the output of the characters left, padding and all.
+ //
+    while (pos + 48 <= len) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + pos));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi32(c, 4), _mm256_set1_epi8(0x0f));
+        __m256i lo = _mm256_and_si256(c, _mm256_set1_epi8(0x0f));
+        __m256i invalid = _mm256_and_si256(_mm256_shuffle_epi8(lut_invalid_lo, lo), _mm256_shuffle_epi8(lut_class, hi));
+        if (!_mm256_testz_si256(invalid, invalid)) break;
+
+        __m256i index = hi;
+        index = _mm256_sub_epi8(index, _mm256_and_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')), _mm256_set1_epi8(2)));
+        index = _mm256_sub_epi8(index, _mm256_and_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('/')), _mm256_set1_epi8(1)));
+        index = _mm256_add_epi8(index, _mm256_and_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')), _mm256_set1_epi8(3)));
+        __m256i v = _mm256_add_epi8(c, _mm256_shuffle_epi8(lut_offset, index));
+
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + pos / 4 * 3), v);
+        pos += 32;
+    }
+    return decode_sse41_kernel(in, len, pos, out);
+}
+
+ //
+ // Encoding 12 bytes (after Muła and Lemire, "Faster Base64 Encoding and
+ // Decoding using AVX2 Instructions"): pshufb spreads every 3 bytes over
+ // a 32-bit word, two multiplies move the four 6-bit fields to the low
+ // bits of its bytes, and a pshufb on the range of each value gives the
+ // offset to its character.
+ //
+
+__attribute__((target("sse4.1")))
+static inline __m128i encode_chars_sse(__m128i in, __m128i shift_lut) {
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t0, t1);
+
+    // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(shift_lut, range));
+}
+
+__attribute__((target("sse4.1")))
+static __m128i encode_shift_lut_sse(const char* chars) {
+    return _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, static_cast<char>(chars[62] - 62), static_cast<char>(chars[63] - 63), 'A', 0, 0);
+}
+
+__attribute__((target("sse4.1")))
+static size_t encode_sse41_kernel(const unsigned char* in, size_t len, size_t pos, char* out, const char* chars) {
+    const __m128i shift_lut = encode_shift_lut_sse(chars);
+    // 16-byte loads for 12 bytes
+    while (pos + 16 <= len) {
+        __m128i v = encode_chars_sse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos)), shift_lut);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + pos / 3 * 4), v);
+        pos += 12;
+    }
+    return pos;
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2_kernel(const unsigned char* in, size_t len, size_t pos, char* out, const char* chars) {
+    const __m128i shift_lut_128 = encode_shift_lut_sse(chars);
+    const __m256i shift_lut = _mm256_broadcastsi128_si256(shift_lut_128);
+    const __m256i spread = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+
+ //
+ // 24 bytes per step, 12 in each lane
+ //
+    while (pos + 28 <= len) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos + 12)), 1);
+        v = _mm256_shuffle_epi8(v, spread);
+        __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t0, t1);
+
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + pos / 3 * 4),
+                            _mm256_add_epi8(indices, _mm256_shuffle_epi8(shift_lut, range)));
+        pos += 24;
+    }
+    return encode_sse41_kernel(in, len, pos, out, chars);
+}
+
+#endif  // BASE64_X86
+
+static bool kernel_supported(base64_kernel kernel) {
+    switch (kernel) {
+        case base64_kernel::bytewise:
+        case base64_kernel::table:
+            return true;
+#ifdef BASE64_X86
+        case base64_kernel::sse41:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.1");
+        case base64_kernel::avx2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+static base64_kernel best_kernel() {
+    for (base64_kernel kernel : {base64_kernel::avx2, base64_kernel::sse41}) {
+        if (kernel_supported(kernel)) return kernel;
+    }
+    return base64_kernel::table;
+}
+
+static std::atomic<base64_kernel>& active_kernel() {
+    static std::atomic<base64_kernel> kernel(best_kernel());
+    return kernel;
+}
+
+ //
+ // Characters decoded into out by the active kernel, a multiple of 4.
+ // Writes stay within len / 4 * 3 - 2 bytes, the shortest decoding of
+ // len characters.
+ //
+static size_t decode_bulk(const unsigned char* in, size_t len, unsigned char* out) {
+    switch (active_kernel().load(std::memory_order_relaxed)) {
+#ifdef BASE64_X86
+        case base64_kernel::avx2:
+            return decode_avx2_kernel(in, len, 0, out);
+        case base64_kernel::sse41:
+            return decode_sse41_kernel(in, len, 0, out);
+#endif
+        case base64_kernel::table:
+            return decode_table_kernel(in, len, 0, out);
+        default:
+            return 0;
+    }
+}
+
+ //
+ // Bytes encoded into out by the active kernel, a multiple of 3; out has
+ // room for the whole encoding
+ //
+static size_t encode_bulk(const unsigned char* in, size_t len, char* out, const char* chars) {
+    switch (active_kernel().load(std::memory_order_relaxed)) {
+#ifdef BASE64_X86
+        case base64_kernel::avx2:
+            return encode_avx2_kernel(in, len, 0, out, chars);
+        case base64_kernel::sse41:
+            return encode_sse41_kernel(in, len, 0, out, chars);
+#endif
+        default:
+            return 0;
+    }
+}
+
+bool base64_kernel_supported(base64_kernel kernel) {
+    return kernel_supported(kernel);
+}
+
+bool base64_use_kernel(base64_kernel kernel) {
+    if (!kernel_supported(kernel)) return false;
+    active_kernel().store(kernel);
+    return true;
+}
+
+base64_kernel base64_active_kernel() {
+    return active_kernel().load();
+}
+
+const char* base64_kernel_name(base64_kernel kernel) {
+    switch (kernel) {
+        case base64_kernel::bytewise: return "bytewise";
+        case base64_kernel::table:    return "table";
+        case base64_kernel::sse41:    return "sse4.1";
+        case base64_kernel::avx2:     return "avx2";
+        default:                      return "";
+    }
+}
+
+size_t base64_encoded_length(size_t len, size_t line_length) {
+    size_t chars = (len + 2) / 3 * 4;
+    if (line_length == 0 || chars == 0) return chars;
+    return chars + (chars - 1) / line_length;
+}
+
+size_t base64_decoded_length(char const* in, size_t len) {
+    size_t bytes = len / 4 * 3;
+    switch (len % 4) {
+        case 2: return bytes + 1;
+        case 3: return bytes + 2;
+        default: break;
+    }
+    for (size_t i = 1; i <= 2 && i <= len; i++) {
+        if (in[len - i] != '=' && in[len - i] != '.') break;
+        bytes--;
+    }
+    return bytes;
+}
+
+ //
+ // Whole 3-byte groups and the padded last one, without line breaks
+ //
+static void encode_span(const unsigned char* in, size_t len, char* out, bool url) {
+    const char* chars = base64_chars[url];
+    const char trailing_char = url ? '.' : '=';
+
+    size_t pos = encode_bulk(in, len, out, chars);
+    char* o = out + pos / 3 * 4;
+    for (; pos + 3 <= len; pos += 3, o += 4) {
+        o[0] = chars[in[pos] >> 2];
+        o[1] = chars[((in[pos] & 0x03) << 4) | (in[pos + 1] >> 4)];
+        o[2] = chars[((in[pos + 1] & 0x0f) << 2) | (in[pos + 2] >> 6)];
+        o[3] = chars[in[pos + 2] & 0x3f];
+    }
+    if (pos + 1 == len) {
+        o[0] = chars[in[pos] >> 2];
+        o[1] = chars[(in[pos] & 0x03) << 4];
+        o[2] = trailing_char;
+        o[3] = trailing_char;
+    } else if (pos + 2 == len) {
+        o[0] = chars[in[pos] >> 2];
+        o[1] = chars[((in[pos] & 0x03) << 4) | (in[pos + 1] >> 4)];
+        o[2] = chars[(in[pos + 1] & 0x0f) << 2];
+        o[3] = trailing_char;
+    }
+}
+
+base64_result base64_encode_into(unsigned char const* in, size_t in_len, char* out, size_t out_len, bool url,
+                                 size_t line_length) {
+    if (line_length % 4 != 0) return {base64_status::invalid_length, 0, 0};
+
+    const size_t length = base64_encoded_length(in_len, line_length);
+    if (out_len < length) return {base64_status::output_too_small, length, 0};
+    if (line_length == 0) {
+        encode_span(in, in_len, out, url);
+        return {base64_status::ok, length, 0};
+    }
+
+ //
+ // Line by line, each line from its own bytes, so every character is
+ // written once (altered: this used to insert the breaks into the
+ // encoded string one by one)
  //
-    if (!str.length()) {
-        return "";
+    const size_t line_bytes = line_length / 4 * 3;
+    char* o = out;
+    for (size_t pos = 0; pos < in_len; pos += line_bytes) {
+        if (pos > 0) *o++ = '\n';
+        const size_t n = std::min(line_bytes, in_len - pos);
+        encode_span(in + pos, n, o, url);
+        o += (n + 2) / 3 * 4;
     }
+    return {base64_status::ok, length, 0};
+}
 
-    size_t pos = distance;
+base64_result base64_decode_into(char const* in, size_t in_len, unsigned char* out, size_t out_len) {
+    if (in_len % 4 == 1) return {base64_status::invalid_length, 0, in_len - 1};
 
-    while (pos < str.size()) {
-        str.insert(pos, "\n");
-        pos += distance + 1;
+    const size_t length = base64_decoded_length(in, in_len);
+    if (out_len < length) return {base64_status::output_too_small, length, 0};
+
+    const unsigned char* chars = reinterpret_cast<const unsigned char*>(in);
+    size_t pos = decode_bulk(chars, in_len, out);
+
+ //
+ // The kernel stopped at the end, at the padded last chunk or at an
+ // invalid character. Padding ends the data: the characters before it
+ // in the chunk are decoded, anything after it is an error.
+ //
+    const signed char* value = decode_values.value;
+    unsigned char* o = out + pos / 4 * 3;
+    for (; pos < in_len; pos += 4) {
+        int v[4] = {0, 0, 0, 0};
+        size_t n = 0;
+        for (; n < 4 && pos + n < in_len; n++) {
+            const unsigned char c = chars[pos + n];
+            v[n] = value[c];
+            if (v[n] < 0) {
+                const bool padding = (c == '=' || c == '.') && n >= 2 && pos + 4 == in_len;
+                if (!padding) return {base64_status::invalid_character, static_cast<size_t>(o - out), pos + n};
+                if (n == 2 && chars[pos + 3] != '=' && chars[pos + 3] != '.') {
+                    return {base64_status::invalid_character, static_cast<size_t>(o - out), pos + 3};
+                }
+                break;
+            }
+        }
+        o[0] = static_cast<unsigned char>((v[0] << 2) | (v[1] >> 4));
+        if (n > 2) o[1] = static_cast<unsigned char>((v[1] << 4) | (v[2] >> 2));
+        if (n > 3) o[2] = static_cast<unsigned char>((v[2] << 6) | v[3]);
+        o += n - 1;
     }
+    return {base64_status::ok, length, 0};
+}
 
-    return str;
+ //
+ // Streaming decode (altered, see the notice above). Whole chunks go
+ // through base64_decode_into as they arrive; a chunk split between two
+ // pieces waits in state.pending until the next one completes it.
+ //
+static base64_result decode_chunks(base64_decode_state& state, const char* in, size_t in_len, unsigned char* out,
+                                   size_t offset) {
+    if (in_len == 0) return {base64_status::ok, 0, 0};
+    if (state.padded) return {base64_status::invalid_character, 0, offset};
+
+    base64_result result = base64_decode_into(in, in_len, out, in_len / 4 * 3);
+    if (result.status != base64_status::ok) {
+        result.position += offset;
+        return result;
+    }
+    state.padded = result.length < in_len / 4 * 3;
+    return result;
 }
 
-template <typename String, unsigned int line_length>
-static std::string encode_with_line_breaks(String s) {
-  return insert_linebreaks(base64_encode(s, false), line_length);
+size_t base64_decode_update_length(base64_decode_state const& state, size_t in_len) {
+    return (state.pending_length + in_len) / 4 * 3;
+}
+
+base64_result base64_decode_update(base64_decode_state& state, char const* in, size_t in_len, unsigned char* out,
+                                   size_t out_len) {
+    const size_t needed = base64_decode_update_length(state, in_len);
+    if (out_len < needed) return {base64_status::output_too_small, needed, 0};
+
+    size_t written = 0;
+    size_t i = 0;
+    if (state.pending_length > 0) {
+        const size_t start = state.position - state.pending_length;
+        while (state.pending_length < 4 && i < in_len) state.pending[state.pending_length++] = in[i++];
+        if (state.pending_length < 4) {
+            state.position += i;
+            return {base64_status::ok, 0, 0};
+        }
+        base64_result result = decode_chunks(state, state.pending, 4, out, start);
+        if (result.status != base64_status::ok) return result;
+        written += result.length;
+        state.pending_length = 0;
+    }
+
+    const size_t whole = (in_len - i) / 4 * 4;
+    base64_result result = decode_chunks(state, in + i, whole, out + written, state.position + i);
+    if (result.status != base64_status::ok) {
+        result.length = written;
+        return result;
+    }
+    written += result.length;
+    i += whole;
+
+    if (i < in_len && state.padded) return {base64_status::invalid_character, written, state.position + i};
+    for (; i < in_len; i++) state.pending[state.pending_length++] = in[i];
+    state.position += in_len;
+    return {base64_status::ok, written, 0};
+}
+
+base64_result base64_decode_final(base64_decode_state& state, unsigned char* out, size_t out_len) {
+    const size_t n = state.pending_length;
+    if (n == 0) return {base64_status::ok, 0, 0};
+    if (n == 1) return {base64_status::invalid_length, 0, state.position - 1};
+    if (out_len < n - 1) return {base64_status::output_too_small, n - 1, 0};
+
+    // an unpadded last chunk of 2 or 3 characters
+    base64_result result = base64_decode_into(state.pending, n, out, out_len);
+    if (result.status != base64_status::ok) {
+        result.position += state.position - n;
+        return result;
+    }
+    state.pending_length = 0;
+    return result;
+}
+
+template <typename String>
+static std::string encode_with_line_breaks(String s, size_t line_length) {
+  std::string ret(base64_encoded_length(s.length(), line_length), '\0');
+  base64_encode_into(reinterpret_cast<const unsigned char*>(s.data()), s.length(), &ret[0], ret.size(), false, line_length);
+  return ret;
 }
 
 template <typename String>
 static std::string encode_pem(String s) {
-  return encode_with_line_breaks<String, 64>(s);
+  return encode_with_line_breaks(s, 64);
 }
 
 template <typename String>
 static std::string encode_mime(String s) {
-  return encode_with_line_breaks<String, 76>(s);
+  return encode_with_line_breaks(s, 76);
 }
 
 template <typename String>
@@ -126,9 +638,10 @@ std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, b
     const char* base64_chars_ = base64_chars[url];
 
     std::string ret;
-    ret.reserve(len_encoded);
+    ret.resize(len_encoded);
 
-    unsigned int pos = 0;
+    size_t pos = encode_bulk(bytes_to_encode, in_len, &ret[0], base64_chars_);
+    ret.resize(pos / 3 * 4);
 
     while (pos < in_len) {
         ret.push_back(base64_chars_[(bytes_to_encode[pos + 0] & 0xfc) >> 2]);
@@ -188,7 +701,15 @@ static std::string decode(String const& encoded_string, bool remove_linebreaks)
  //
     size_t approx_length_of_decoded_string = length_of_string / 4 * 3;
     std::string ret;
-    ret.reserve(approx_length_of_decoded_string);
+    ret.resize(approx_length_of_decoded_string);
+
+ //
+ // The kernel decodes the chunks it can take as is, the loop below the
+ // rest (altered, see the notice above)
+ //
+    pos = decode_bulk(reinterpret_cast<const unsigned char*>(encoded_string.data()), length_of_string,
+                      reinterpret_cast<unsigned char*>(&ret[0]));
+    ret.resize(pos / 4 * 3);
 
     while (pos < length_of_string) {
     //
@@ -19,6 +19,66 @@ std::string base64_encode_mime(std::string const& s);
 std::string base64_decode(std::string const& s, bool remove_linebreaks = false);
 std::string base64_encode(unsigned char const*, size_t len, bool url = false);
 
+//
+// Kernels that decode and encode the bulk of the data (altered for
+// image-caption). The best one the CPU supports is picked at run time;
+// bytewise is the original character-by-character code, table decodes
+// whole chunks through a 256-entry table, sse41 and avx2 take 16 and 32
+// characters at a time. All of them give the same results.
+//
+enum class base64_kernel { bytewise, table, sse41, avx2 };
+
+bool          base64_kernel_supported(base64_kernel kernel);
+bool          base64_use_kernel      (base64_kernel kernel);  // false if the CPU lacks it
+base64_kernel base64_active_kernel   ();
+const char*   base64_kernel_name     (base64_kernel kernel);
+
+//
+// Allocation-free, exception-free interface (altered for image-caption):
+// decode into and encode to caller buffers, with errors reported in the
+// result. Unlike base64_decode, decoding is strict: padding ('=' or '.')
+// may only end the data, and line breaks are not skipped.
+//
+enum class base64_status { ok, invalid_character, invalid_length, output_too_small };
+
+struct base64_result {
+    base64_status status;
+    size_t        length;    // bytes or characters written; the length needed for output_too_small
+    size_t        position;  // input offset of the character at fault for invalid_character
+};
+
+// Exact output lengths, to size the buffers up front. line_length puts a
+// '\n' between lines of that many characters (64 for PEM, 76 for MIME, a
+// multiple of 4); 0 encodes on one line.
+size_t base64_encoded_length(size_t len, size_t line_length = 0);
+size_t base64_decoded_length(char const* in, size_t len);
+
+base64_result base64_decode_into(char const* in, size_t in_len, unsigned char* out, size_t out_len);
+base64_result base64_encode_into(unsigned char const* in, size_t in_len, char* out, size_t out_len,
+                                 bool url = false, size_t line_length = 0);
+
+//
+// Streaming decode of data that arrives in pieces (altered for
+// image-caption), with the rules of base64_decode_into. Feed every piece
+// to base64_decode_update, which decodes the whole chunks it completes
+// and keeps up to 3 characters for the next piece, then call
+// base64_decode_final for an unpadded last chunk. Positions count from
+// the start of the stream.
+//
+struct base64_decode_state {
+    char   pending[4];
+    size_t pending_length = 0;
+    size_t position       = 0;      // characters fed so far
+    bool   padded         = false;  // a padded chunk came, nothing may follow
+};
+
+// Room base64_decode_update needs for a piece of in_len characters
+size_t base64_decode_update_length(base64_decode_state const& state, size_t in_len);
+
+base64_result base64_decode_update(base64_decode_state& state, char const* in, size_t in_len,
+                                   unsigned char* out, size_t out_len);
+base64_result base64_decode_final (base64_decode_state& state, unsigned char* out, size_t out_len);
+
 #if __cplusplus >= 201703L
 //
 // Interface with std::string_view rather than const std::string&
@@ -0,0 +1,216 @@
+// Checks every base64 kernel the CPU supports against the original byte-wise code, and the buffer and
+// streaming interfaces against the string one, then reports the decode and encode throughput of each on a data-URL sized payload:
+//   g++ -O2 -std=c++17 base64_bench.cc base64/base64.cpp -o base64_bench.exe
+//   base64_bench.exe [megabytes] [repeats]
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "base64/base64.h"
+
+static const base64_kernel kernels[] = {base64_kernel::bytewise, base64_kernel::table, base64_kernel::sse41,
+                                        base64_kernel::avx2};
+
+// Decoded string, or "!" and the message if it throws
+static std::string try_decode(const std::string& s) {
+    try {
+        return base64_decode(s);
+    } catch (const std::exception& e) {
+        return std::string("!") + e.what();
+    }
+}
+
+// Encodings of random data, with the url alphabet, the alphabets mixed and single characters replaced by
+// padding or by anything else, so the kernels have to hand over to the byte-wise code in every position
+static std::vector<std::string> decode_cases(std::mt19937& rng) {
+    std::vector<std::string> cases;
+    for (int n = 0; n < 300; n++) {
+        std::string bytes(n, '\0');
+        for (char& b : bytes) {
+            b = static_cast<char>(rng());
+        }
+        std::string plain = base64_encode(bytes);
+        std::string url = base64_encode(bytes, true);
+        cases.push_back(plain);
+        cases.push_back(url);
+
+        std::string mixed = plain;
+        for (size_t i = 0; i < mixed.size(); i++) {
+            if (rng() % 2) {
+                mixed[i] = url[i];
+            }
+        }
+        cases.push_back(mixed);
+        if (!plain.empty()) {
+            cases.push_back(plain.substr(0, plain.size() - 1 - rng() % std::min<size_t>(plain.size(), 3)));
+            for (int k = 0; k < 4; k++) {
+                std::string broken = plain;
+                broken[rng() % broken.size()] = static_cast<char>(rng());
+                cases.push_back(broken);
+            }
+        }
+    }
+    // every byte value in every position of a 64-character block
+    std::string block = base64_encode(std::string(48, 'x'));
+    for (int c = 0; c < 256; c++) {
+        for (size_t i = 0; i < block.size(); i += 7) {
+            std::string s = block + block;
+            s[i] = static_cast<char>(c);
+            cases.push_back(s);
+        }
+    }
+    return cases;
+}
+
+// base64_decode_into must agree with base64_decode wherever it accepts the input, and accept every padded
+// or unpadded encoding; PEM and MIME must match the old insertion of a '\n' every 64 or 76 characters
+static int check_into(const std::vector<std::string>& cases, const std::vector<std::string>& bytes_cases) {
+    int mismatches = 0;
+    for (const std::string& s : cases) {
+        std::vector<unsigned char> out(base64_decoded_length(s.data(), s.size()) + 1);
+        base64_result result = base64_decode_into(s.data(), s.size(), out.data(), out.size() - 1);
+        if (result.status == base64_status::ok) {
+            mismatches += try_decode(s) != std::string(out.begin(), out.begin() + result.length) ||
+                          result.length != out.size() - 1;
+        }
+    }
+    for (const std::string& b : bytes_cases) {
+        for (bool url : {false, true}) {
+            std::string encoded = base64_encode(b, url);
+            for (const std::string& s : {encoded, encoded.substr(0, encoded.find_first_of("=."))}) {
+                std::string out(base64_decoded_length(s.data(), s.size()), '\0');
+                base64_result result = base64_decode_into(s.data(), s.size(),
+                                                          reinterpret_cast<unsigned char*>(&out[0]), out.size());
+                mismatches += result.status != base64_status::ok || out != b;
+            }
+        }
+        for (size_t line : {64, 76}) {
+            std::string expected = base64_encode(b);
+            for (size_t pos = line; pos < expected.size(); pos += line + 1) {
+                expected.insert(pos, "\n");
+            }
+            mismatches += (line == 64 ? base64_encode_pem(b) : base64_encode_mime(b)) != expected;
+        }
+    }
+    return mismatches;
+}
+
+// base64_decode_update fed random pieces must accept what base64_decode_into accepts, with the same bytes
+static int check_stream(const std::vector<std::string>& cases, std::mt19937& rng) {
+    int mismatches = 0;
+    for (const std::string& s : cases) {
+        std::vector<unsigned char> whole(base64_decoded_length(s.data(), s.size()));
+        const bool valid = base64_decode_into(s.data(), s.size(), whole.data(), whole.size()).status == base64_status::ok;
+
+        base64_decode_state state;
+        std::vector<unsigned char> out;
+        bool ok = true;
+        for (size_t pos = 0; ok && pos < s.size();) {
+            const size_t n = std::min<size_t>(s.size() - pos, rng() % 9);
+            const size_t length = out.size();
+            out.resize(length + base64_decode_update_length(state, n));
+            base64_result result = base64_decode_update(state, s.data() + pos, n, out.data() + length, out.size() - length);
+            ok = result.status == base64_status::ok;
+            out.resize(length + result.length);
+            pos += n;
+        }
+        if (ok) {
+            const size_t length = out.size();
+            out.resize(length + 2);
+            base64_result result = base64_decode_final(state, out.data() + length, 2);
+            ok = result.status == base64_status::ok;
+            out.resize(length + result.length);
+        }
+        mismatches += ok != valid || (ok && out != whole);
+    }
+    return mismatches;
+}
+
+// GB/s of the input, the best of `repeats`
+template <typename F>
+static double throughput(size_t bytes, int repeats, F f) {
+    double best = 1e30;
+    for (int i = 0; i < repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return bytes / best / 1e9;
+}
+
+int main(int argc, char** argv) {
+    const size_t megabytes = argc > 1 ? std::max(1, std::atoi(argv[1])) : 8;
+    const int repeats = argc > 2 ? std::max(1, std::atoi(argv[2])) : 10;
+    std::mt19937 rng(42);
+
+    std::cout << "[*] runtime kernel: " << base64_kernel_name(base64_active_kernel()) << std::endl;
+    const base64_kernel dispatched = base64_active_kernel();
+
+    std::vector<std::string> cases = decode_cases(rng);
+    std::vector<std::string> bytes_cases;
+    for (int n = 0; n < 300; n++) {
+        std::string bytes(n, '\0');
+        for (char& b : bytes) {
+            b = static_cast<char>(rng());
+        }
+        bytes_cases.push_back(bytes);
+    }
+    base64_use_kernel(base64_kernel::bytewise);
+    std::vector<std::string> expected;
+    for (const std::string& s : cases) {
+        expected.push_back(try_decode(s));
+    }
+    std::vector<std::string> expected_encoded;
+    for (const std::string& b : bytes_cases) {
+        expected_encoded.push_back(base64_encode(b) + base64_encode(b, true));
+    }
+
+    std::string payload(megabytes << 20, '\0');
+    for (char& b : payload) {
+        b = static_cast<char>(rng());
+    }
+    const std::string encoded = base64_encode(payload);
+
+    int failed = 0;
+    for (base64_kernel kernel : kernels) {
+        if (!base64_use_kernel(kernel)) {
+            std::cout << base64_kernel_name(kernel) << ": not supported by this CPU" << std::endl;
+            continue;
+        }
+        int mismatches = 0;
+        for (size_t i = 0; i < cases.size(); i++) {
+            mismatches += try_decode(cases[i]) != expected[i];
+        }
+        for (size_t i = 0; i < bytes_cases.size(); i++) {
+            mismatches += base64_encode(bytes_cases[i]) + base64_encode(bytes_cases[i], true) != expected_encoded[i];
+        }
+        mismatches += base64_decode(encoded) != payload;
+        mismatches += check_into(cases, bytes_cases);
+        mismatches += check_stream(cases, rng);
+        failed += mismatches;
+
+        const double decode = throughput(encoded.size(), repeats, [&]() { base64_decode(encoded); });
+        const double encode = throughput(payload.size(), repeats, [&]() { base64_encode(payload); });
+        // into buffers allocated once, as the server does per request
+        std::vector<unsigned char> decoded(payload.size());
+        std::vector<char> text(encoded.size());
+        const double decode_into = throughput(encoded.size(), repeats, [&]() {
+            base64_decode_into(encoded.data(), encoded.size(), decoded.data(), decoded.size());
+        });
+        const double encode_into = throughput(payload.size(), repeats, [&]() {
+            base64_encode_into(reinterpret_cast<const unsigned char*>(payload.data()), payload.size(), text.data(),
+                               text.size());
+        });
+        std::cout << base64_kernel_name(kernel) << ": decode " << decode << " GB/s (into " << decode_into
+                  << "), encode " << encode << " GB/s (into " << encode_into << "), " << mismatches << " mismatches"
+                  << std::endl;
+    }
+    base64_use_kernel(dispatched);
+    return failed == 0 ? 0 : 1;
+}
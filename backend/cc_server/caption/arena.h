@@ -0,0 +1,129 @@
+#ifndef CAPTION_ARENA_H_
+#define CAPTION_ARENA_H_
+
+#include <new>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+namespace caption {
+
+    constexpr size_t kArenaAlignment = 64;
+
+    // Static memory plan of the activations of a fixed computation. Every buffer has a size and the interval
+    // of phases [first, last] it is live in; buffers whose intervals do not overlap may share memory. Plan
+    // places the largest buffers first, each at the lowest aligned offset that does not collide with a placed
+    // buffer it is live together with, so the arena needs about the peak of the live bytes, not their sum.
+    class MemoryPlan {
+        public:
+            MemoryPlan() = default;
+            ~MemoryPlan() = default;
+
+            // Returns the id of the buffer, its offset is known after Plan
+            int Add(size_t bytes, int first, int last) {
+                buffers_.push_back(Buffer{Align(bytes), first, last, 0});
+                return static_cast<int>(buffers_.size()) - 1;
+            }
+
+            void Plan() {
+                std::vector<int> order(buffers_.size());
+                for (size_t i = 0; i < order.size(); i++) {
+                    order[i] = static_cast<int>(i);
+                }
+                std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+                    return buffers_[a].bytes > buffers_[b].bytes;
+                });
+
+                size_ = 0;
+                std::vector<int> placed;
+                std::vector<const Buffer*> live;
+                for (int id : order) {
+                    Buffer& buffer = buffers_[id];
+                    live.clear();
+                    for (int other : placed) {
+                        const Buffer& b = buffers_[other];
+                        if (b.first <= buffer.last && buffer.first <= b.last) {
+                            live.push_back(&b);
+                        }
+                    }
+                    std::sort(live.begin(), live.end(), [](const Buffer* a, const Buffer* b) { return a->offset < b->offset; });
+
+                    // first gap between the buffers live at the same time that fits
+                    size_t offset = 0;
+                    for (const Buffer* b : live) {
+                        if (offset + buffer.bytes <= b->offset) {
+                            break;
+                        }
+                        offset = std::max(offset, b->offset + b->bytes);
+                    }
+                    buffer.offset = offset;
+                    size_ = std::max(size_, offset + buffer.bytes);
+                    placed.push_back(id);
+                }
+            }
+
+            size_t offset(int id) const { return buffers_[id].offset; }
+
+            // Bytes of the arena, the peak of the plan
+            size_t size() const { return size_; }
+
+            // Bytes without sharing, one buffer each
+            size_t unshared() const {
+                size_t n = 0;
+                for (const Buffer& b : buffers_) {
+                    n += b.bytes;
+                }
+                return n;
+            }
+
+        private:
+            struct Buffer {
+                size_t bytes;
+                int first;
+                int last;
+                size_t offset;
+            };
+
+            std::vector<Buffer> buffers_;
+            size_t size_ = 0;
+
+            static size_t Align(size_t bytes) {
+                return (bytes + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+            }
+    };
+
+    // One aligned block carved up by a MemoryPlan
+    class Arena {
+        public:
+            Arena() : storage_(nullptr, &Free), size_(0) {}
+            ~Arena() = default;
+            Arena(const Arena&) = delete;
+            Arena& operator=(const Arena&) = delete;
+
+            void Allocate(const MemoryPlan& plan) {
+                size_ = plan.size();
+                storage_.reset(size_ > 0 ? static_cast<char*>(::operator new(size_, std::align_val_t(kArenaAlignment)))
+                                         : nullptr);
+                plan_ = &plan;
+            }
+
+            template <typename T>
+            T* get(int id) const {
+                return reinterpret_cast<T*>(storage_.get() + plan_->offset(id));
+            }
+
+            size_t size() const { return size_; }
+
+        private:
+            static void Free(char* p) {
+                ::operator delete(p, std::align_val_t(kArenaAlignment));
+            }
+
+            std::unique_ptr<char, void (*)(char*)> storage_;
+            size_t size_;
+            const MemoryPlan* plan_ = nullptr;
+    };
+}
+
+#endif
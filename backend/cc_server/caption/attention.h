@@ -0,0 +1,56 @@
+#ifndef CAPTION_ATTENTION_H_
+#define CAPTION_ATTENTION_H_
+
+#include <cmath>
+#include <cstring>
+
+#include "kernels.h"
+
+namespace caption {
+
+    // Attention.forward (AI_module/models.py) of one beam in a single pass over the image. Pixel by pixel,
+    // the score e = full_att(relu(att1[p] + att2)) goes into an online softmax and encoder_out[p] is added to
+    // the context with its unnormalized weight; the context is rescaled only when the running max grows.
+    // No (num_pixels, attention_dim) or (num_pixels, encoder_dim) temporaries are formed.
+    // Writes the attention weighted encoding to context (encoder_dim) and, if alpha is not null, the
+    // attention weights (num_pixels).
+    inline void Attend(const float* encoder_out, const float* att1, int num_pixels, int encoder_dim, int attention_dim,
+                       const float* att2, const float* full_att_w, float full_att_b, float* context, float* alpha) {
+        float max = 0.0f;
+        float sum = 0.0f;
+        for (int p = 0; p < num_pixels; p++) {
+            const float* feature = encoder_out + static_cast<size_t>(p) * encoder_dim;
+            const float e = full_att_b + ReluDot(att1 + static_cast<size_t>(p) * attention_dim, att2, full_att_w, attention_dim);
+            if (alpha) {
+                alpha[p] = e;
+            }
+
+            if (p == 0) {
+                max = e;
+                sum = 1.0f;
+                std::memcpy(context, feature, sizeof(float) * encoder_dim);
+            } else if (e > max) {
+                const float scale = std::exp(max - e);
+                max = e;
+                sum = sum * scale + 1.0f;
+                ScaleAxpy(scale, 1.0f, feature, context, encoder_dim);
+            } else {
+                const float weight = std::exp(e - max);
+                sum += weight;
+                Axpy(weight, feature, context, encoder_dim);
+            }
+        }
+
+        const float inv = 1.0f / sum;
+        for (int i = 0; i < encoder_dim; i++) {
+            context[i] *= inv;
+        }
+        if (alpha) {
+            for (int p = 0; p < num_pixels; p++) {
+                alpha[p] = std::exp(alpha[p] - max) * inv;
+            }
+        }
+    }
+}
+
+#endif
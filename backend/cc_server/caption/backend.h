@@ -0,0 +1,165 @@
+#ifndef CAPTION_BACKEND_H_
+#define CAPTION_BACKEND_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "word_map.h"
+#include "preprocess.h"
+#include "beam_search.h"
+#include "hash.h"
+#include "feature_cache.h"
+
+namespace caption {
+
+    struct BackendConfig {
+        // AI_module folder: demo.py, the checkpoint and the word map of the python backend
+        std::string model_dir = "../AI_module/";
+        // checkpoint of the python backend
+        std::string model = "BEST_checkpoint_.pth.tar";
+        // folder of the graphs of export_onnx.py for the onnx backend
+        std::string graph_dir = "../AI_module/onnx/";
+        // weight file of export_weights.py for the native backend, in model_dir
+        std::string weights = "decoder.weights";
+        // beams the native backend decodes together in one step across captions (DecodeScheduler), 0 = every
+        // server thread decodes its captions alone
+        int batch_rows = 64;
+        std::string word_map = "data/WORDMAP.json";
+        int beam_size = 5;
+        int max_steps = 51;
+        // threads of one encode or decode step, 0 = the runtime's default
+        int intra_op_threads = 0;
+        // encoder outputs kept by image for the in-process backends (FeatureCache), 0 = none
+        size_t feature_cache_bytes = 0;
+        FeatureFormat feature_format = FeatureFormat::Float16;
+    };
+
+    struct CaptionResult {
+        std::string caption;
+        // uint8 attention maps, base64, one (attention_size x attention_size) map per word (python backend only)
+        int attention_size = 0;
+        std::string attention_maps;
+    };
+
+    // One way of running the captioning model. In-process backends expose the encoder and the decode step,
+    // so the server and the benchmarks can batch and drive them; the python backend only captions files.
+    // Backends are shared by the server threads, Caption must be safe to call concurrently.
+    class CaptionBackend {
+        public:
+            virtual ~CaptionBackend() = default;
+
+            virtual const char* name() const = 0;
+
+            virtual void Load(const BackendConfig& config) = 0;
+
+            // encoder_out (batch, num_pixels, encoder_dim) of images (batch, 3, kImageSize, kImageSize),
+            // normalized like read_image
+            virtual void EncodeBatch(const float* /*images*/, int /*batch*/, std::vector<float>* /*encoder_out*/) {
+                throw std::logic_error(std::string("The ") + name() + " backend has no separate encoder");
+            }
+
+            // Decode steps of the beams of one encoded image (num_pixels, encoder_dim), for BeamSearch. The
+            // decoder belongs to the calling thread and is reused for its next image, so it is valid until then.
+            virtual StepFunction* ThreadDecoder(const float* /*encoder_out*/, int /*beam_size*/) {
+                throw std::logic_error(std::string("The ") + name() + " backend has no separate decode step");
+            }
+
+            // Caption of an image file, the server saves every upload before captioning it
+            virtual CaptionResult Caption(const std::string& image_path, bool attention_maps) = 0;
+    };
+
+    // Runtime-independent part of the in-process backends: the word map, and a caption as
+    // encode -> BeamSearch over ThreadDecoder
+    class InProcessBackend : public CaptionBackend {
+        public:
+            void Load(const BackendConfig& config) override {
+                config_ = config;
+                word_map_.reset(new WordMap(config.model_dir + config.word_map));
+                feature_cache_.reset(config.feature_cache_bytes > 0
+                                         ? new FeatureCache(config.feature_cache_bytes, config.feature_format)
+                                         : nullptr);
+                LoadModel(config);
+            }
+
+            // The decode settings of the config
+            BeamSearchOptions DecodeOptions() const {
+                BeamSearchOptions options;
+                options.beam_size = config_.beam_size;
+                options.max_steps = config_.max_steps;
+                return options;
+            }
+
+            // Null without config.feature_cache_bytes
+            const FeatureCache* feature_cache() const { return feature_cache_.get(); }
+
+            // false on a miss or without a feature cache; image_key is the XXH64 of the image file
+            bool CachedFeatures(std::uint64_t image_key, std::vector<float>* encoder_out) {
+                return feature_cache_ && feature_cache_->Lookup(image_key, encoder_out);
+            }
+
+            // encoder_out of one preprocessed image (3, kImageSize, kImageSize), kept in the feature cache
+            void Encode(const float* image, std::uint64_t image_key, std::vector<float>* encoder_out) {
+                EncodeBatch(image, 1, encoder_out);
+                if (feature_cache_) {
+                    feature_cache_->Insert(image_key, encoder_out->data(), encoder_out->size());
+                }
+            }
+
+            // Caption of one encoded image (num_pixels, encoder_dim), the encoder output or cached features
+            virtual CaptionResult CaptionFeatures(const float* encoder_out, const BeamSearchOptions& options) {
+                StepFunction* step = ThreadDecoder(encoder_out, options.beam_size);
+                thread_local std::vector<int> seq;
+                BeamSearch(step, options, word_map_->id("<start>"), word_map_->id("<end>"), &seq);
+
+                CaptionResult result;
+                result.caption = word_map_->Join(seq);
+                return result;
+            }
+
+            // Caption of one preprocessed image (3, kImageSize, kImageSize)
+            CaptionResult CaptionImage(const float* image) {
+                std::vector<float> encoder_out;
+                EncodeBatch(image, 1, &encoder_out);
+                return CaptionFeatures(encoder_out.data(), DecodeOptions());
+            }
+
+            // Decodes and preprocesses the file natively (caption/preprocess.h), or starts from its cached
+            // features; no attention maps
+            CaptionResult Caption(const std::string& image_path, bool /*attention_maps*/) override {
+                std::vector<float> image;
+                if (!feature_cache_) {
+                    image.resize(static_cast<size_t>(3) * kImageSize * kImageSize);
+                    PreprocessFile(image_path, image.data());
+                    return CaptionImage(image.data());
+                }
+
+                std::ifstream file(image_path, std::ios::binary);
+                if (!file.is_open()) {
+                    throw std::runtime_error("Cannot open " + image_path);
+                }
+                std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+                const std::uint64_t image_key = XXHash64(data);
+                std::vector<float> encoder_out;
+                if (!CachedFeatures(image_key, &encoder_out)) {
+                    image.resize(static_cast<size_t>(3) * kImageSize * kImageSize);
+                    PreprocessImage(reinterpret_cast<const std::uint8_t*>(data.data()), data.size(), image.data());
+                    Encode(image.data(), image_key, &encoder_out);
+                }
+                return CaptionFeatures(encoder_out.data(), DecodeOptions());
+            }
+
+        protected:
+            BackendConfig config_;
+            std::unique_ptr<WordMap> word_map_;
+            std::unique_ptr<FeatureCache> feature_cache_;
+
+            virtual void LoadModel(const BackendConfig& config) = 0;
+    };
+}
+
+#endif
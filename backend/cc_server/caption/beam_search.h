@@ -0,0 +1,179 @@
+#ifndef CAPTION_BEAM_SEARCH_H_
+#define CAPTION_BEAM_SEARCH_H_
+
+#include <vector>
+#include <stdexcept>
+
+#include "topk.h"
+#include "beam_state.h"
+#include "decoder.h"
+
+namespace caption {
+
+    struct BeamSearchOptions {
+        int beam_size = 5;
+        // decode-step cap, 51 is the 'step > 50' check of demo.py
+        int max_steps = 51;
+        // exponent of the length normalization of finished sequences, 0 = raw scores like demo.py
+        float length_norm = 0.0f;
+        // use StepTopK of the step function when it has one
+        bool fused_output = true;
+    };
+
+    // What the beam search driver needs from a model: log-probabilities of the next word of every live
+    // beam, and a way to follow the beams when they are reordered
+    class StepFunction {
+        public:
+            virtual ~StepFunction() = default;
+
+            virtual int vocab_size() const = 0;
+
+            // log_probs is (rows, vocab_size), row r continues words[r]
+            virtual void Step(const int* words, int rows, float* log_probs) = 0;
+
+            // Optional fused Step for beam search: the k most likely next words of every row in candidates
+            // (rows, k), best first, with index = word and score = log-probability. Returns false, without
+            // stepping, when the model only has Step.
+            virtual bool StepTopK(const int* /*words*/, int /*rows*/, int /*k*/, Candidate* /*candidates*/) {
+                return false;
+            }
+
+            // Live beam j now continues from live beam sources[j] of the last Step
+            virtual void Reorder(const int* sources, int rows) = 0;
+    };
+
+    // Buffers of BeamSearch, kept from one search to the next so that a search only allocates while they grow
+    struct BeamSearchScratch {
+        BeamSearchScratch() : beams(1, 1, 0, 0) {}
+
+        BeamState beams;
+        TopK topk;
+        std::vector<float> log_probs;
+        std::vector<Candidate> candidates;
+        std::vector<Candidate> best;
+        std::vector<float> score;
+        std::vector<int> prev;
+        std::vector<int> next;
+    };
+
+    // Beam search of caption_image_beam_search (AI_module/demo.py) over any step function.
+    // Writes the best caption (<start> and <end> included) to seq and returns its score.
+    // Without scratch the search uses the scratch of the calling thread.
+    inline float BeamSearch(StepFunction* step, const BeamSearchOptions& options, int start_word, int end_word,
+                            std::vector<int>* seq, BeamSearchScratch* scratch = nullptr) {
+        if (options.beam_size < 1 || options.max_steps < 1) {
+            throw std::invalid_argument("beam search needs beam_size >= 1 and max_steps >= 1");
+        }
+        thread_local BeamSearchScratch thread_scratch;
+        BeamSearchScratch& s = scratch ? *scratch : thread_scratch;
+
+        const int k = options.beam_size;
+        const int V = step->vocab_size();
+        BeamState& beams = s.beams;
+        TopK& topk = s.topk;
+        beams.Reset(k, options.max_steps, start_word, end_word);
+        s.candidates.resize(static_cast<size_t>(k) * k);
+        s.best.resize(k);
+        s.score.resize(k);
+        s.prev.resize(k);
+        s.next.resize(k);
+        Candidate* candidates = s.candidates.data();
+        Candidate* best = s.best.data();
+        float* score = s.score.data();
+        int* prev = s.prev.data();
+        int* next = s.next.data();
+        bool fused = options.fused_output;
+
+        while (!beams.done()) {
+            int rows = beams.live();
+            // At the first step all beams are <start> with the same state, only the first one is searched
+            int search_rows = beams.step() == 0 ? 1 : rows;
+            topk.Reset(rows);
+
+            if (fused && step->StepTopK(beams.words(), rows, k, candidates)) {
+                // the best `rows` continuations overall are among the best k of each row
+                for (int r = 0; r < search_rows; r++) {
+                    const Candidate* row = candidates + static_cast<size_t>(r) * k;
+                    for (int j = 0; j < k; j++) {
+                        topk.Push(beams.scores()[r] + row[j].score, r * V + row[j].index);
+                    }
+                }
+            } else {
+                fused = false;
+                s.log_probs.resize(static_cast<size_t>(k) * V);
+                float* log_probs = s.log_probs.data();
+                step->Step(beams.words(), rows, log_probs);
+                for (int r = 0; r < search_rows; r++) {
+                    topk.Scan(log_probs + static_cast<size_t>(r) * V, V, beams.scores()[r], r * V);
+                }
+            }
+
+            int n = topk.Sorted(best);
+            for (int i = 0; i < n; i++) {
+                score[i] = best[i].score;
+                prev[i] = best[i].index / V;
+                next[i] = best[i].index % V;
+            }
+
+            int survivors = beams.Advance(score, prev, next, n);
+            if (survivors > 0) {
+                step->Reorder(beams.sources(), survivors);
+            }
+        }
+
+        return beams.Best(seq, options.length_norm);
+    }
+
+    // StepFunction of the native decoder for the beams of one image. Reset moves it to the next image
+    // without allocating, so a thread can keep one for all its captions.
+    class DecoderStep : public StepFunction {
+        public:
+            explicit DecoderStep(DecoderEngine* engine) : engine_(engine) {}
+            DecoderStep(DecoderEngine* engine, const ImageFeatures* image, int beam_size) : engine_(engine) {
+                Reset(image, beam_size);
+            }
+
+            void Reset(const ImageFeatures* image, int beam_size) {
+                const int D = engine_->dims().decoder_dim;
+                images_.assign(beam_size, image);
+                h_.resize(static_cast<size_t>(beam_size) * D);
+                c_.resize(h_.size());
+                h_next_.resize(h_.size());
+                c_next_.resize(c_.size());
+                for (int r = 0; r < beam_size; r++) {
+                    std::copy(image->h0.begin(), image->h0.end(), h_.begin() + static_cast<size_t>(r) * D);
+                    std::copy(image->c0.begin(), image->c0.end(), c_.begin() + static_cast<size_t>(r) * D);
+                }
+            }
+
+            int vocab_size() const override {
+                return engine_->dims().vocab_size;
+            }
+
+            void Step(const int* words, int rows, float* log_probs) override {
+                engine_->Step(images_.data(), words, h_.data(), c_.data(), rows, h_next_.data(), c_next_.data(), log_probs);
+            }
+
+            bool StepTopK(const int* words, int rows, int k, Candidate* candidates) override {
+                engine_->StepTopK(images_.data(), words, h_.data(), c_.data(), rows, h_next_.data(), c_next_.data(), k,
+                                  candidates);
+                return true;
+            }
+
+            void Reorder(const int* sources, int rows) override {
+                const int D = engine_->dims().decoder_dim;
+                GatherRows(h_next_.data(), h_.data(), D, sources, rows);
+                GatherRows(c_next_.data(), c_.data(), D, sources, rows);
+            }
+
+        private:
+            DecoderEngine* engine_;
+            std::vector<const ImageFeatures*> images_;
+            std::vector<float> h_;
+            std::vector<float> c_;
+            std::vector<float> h_next_;
+            std::vector<float> c_next_;
+    };
+}
+
+#endif
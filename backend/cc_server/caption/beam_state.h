@@ -0,0 +1,181 @@
+#ifndef CAPTION_BEAM_STATE_H_
+#define CAPTION_BEAM_STATE_H_
+
+#include <cmath>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+namespace caption {
+
+    // Beam search bookkeeping for native decoders, the same layout as AI_module/beam_state.py:
+    // - tokens_ and backpointers_ are [beam_size, max_steps + 1], decode step t only writes column t
+    // - live beams are compacted to the first live() rows after every step
+    // - a finished sequence is recovered by following the backpointers from its last column
+    // - every finished sequence takes a live beam with it, so at most beam_size of them are kept
+    class BeamState {
+        public:
+            BeamState(int beam_size, int max_steps, int start_word, int end_word) : beam_size_(beam_size),
+                                                                                    max_steps_(max_steps),
+                                                                                    start_word_(start_word),
+                                                                                    end_word_(end_word),
+                                                                                    tokens_(beam_size * (max_steps + 1)),
+                                                                                    backpointers_(beam_size * (max_steps + 1)),
+                                                                                    live_rows_(beam_size),
+                                                                                    words_(beam_size),
+                                                                                    scores_(beam_size),
+                                                                                    survivors_(beam_size),
+                                                                                    complete_(beam_size) { Reset(); }
+            ~BeamState() = default;
+
+            // Starts a new search with other settings, the buffers only grow
+            void Reset(int beam_size, int max_steps, int start_word, int end_word) {
+                beam_size_ = beam_size;
+                max_steps_ = max_steps;
+                start_word_ = start_word;
+                end_word_ = end_word;
+                tokens_.resize(static_cast<size_t>(beam_size) * (max_steps + 1));
+                backpointers_.resize(tokens_.size());
+                live_rows_.resize(beam_size);
+                words_.resize(beam_size);
+                scores_.resize(beam_size);
+                survivors_.resize(beam_size);
+                complete_.resize(beam_size);
+                Reset();
+            }
+
+            // Starts a new search without touching the allocator
+            void Reset() {
+                live_ = beam_size_;
+                step_ = 0;
+                done_ = false;
+                num_complete_ = 0;
+                for (int i = 0; i < beam_size_; i++) {
+                    tokens_[Index(i, 0)] = start_word_;
+                    backpointers_[Index(i, 0)] = 0;
+                    live_rows_[i] = i;
+                    words_[i] = start_word_;
+                    scores_[i] = 0.0f;
+                }
+            }
+
+            // Records the n candidates chosen at one decode step.
+            // prev[i] is the live beam candidate i extends, next[i] the word it appends and score[i] its
+            // accumulated log-probability. Returns the number of surviving beams; sources() then holds the
+            // live beam each survivor continues from, to compact the decoder state with GatherRows.
+            int Advance(const float* score, const int* prev, const int* next, int n) {
+                int t = step_ + 1;
+                int survivors = 0;
+
+                for (int i = 0; i < n; i++) {
+                    tokens_[Index(i, t)] = next[i];
+                    backpointers_[Index(i, t)] = live_rows_[prev[i]];
+                }
+                step_ = t;
+
+                for (int i = 0; i < n; i++) {
+                    if (next[i] == end_word_) {
+                        complete_[num_complete_++] = Complete{score[i], t, i};
+                    } else {
+                        // survivors never outrun i, so the compaction can run in place
+                        live_rows_[survivors] = i;
+                        words_[survivors] = next[i];
+                        scores_[survivors] = score[i];
+                        survivors_[survivors] = prev[i];
+                        survivors++;
+                    }
+                }
+
+                if (survivors == 0 || t == max_steps_) {
+                    // Nothing finished before the cap, fall back to the running sequences
+                    if (num_complete_ == 0) {
+                        for (int j = 0; j < survivors; j++) {
+                            complete_[num_complete_++] = Complete{scores_[j], t, live_rows_[j]};
+                        }
+                    }
+                    survivors = 0;
+                    done_ = true;
+                }
+
+                live_ = survivors;
+                return survivors;
+            }
+
+            // Backtraces the finished sequence with the highest score, <start> and <end> included.
+            // With length_norm > 0 the score of a sequence of n words is divided by n^length_norm,
+            // 0 compares raw log-probabilities like demo.py. Returns the (normalized) score.
+            float Best(std::vector<int>* seq, float length_norm = 0.0f) const {
+                if (num_complete_ == 0) {
+                    seq->clear();
+                    return 0.0f;
+                }
+
+                const Complete* best = nullptr;
+                float best_score = 0.0f;
+                for (int i = 0; i < num_complete_; i++) {
+                    const Complete& c = complete_[i];
+                    float score = length_norm > 0.0f ? c.score / std::pow(static_cast<float>(c.step), length_norm) : c.score;
+                    if (!best || score > best_score) {
+                        best = &c;
+                        best_score = score;
+                    }
+                }
+
+                seq->resize(best->step + 1);
+                int row = best->row;
+                for (int u = best->step; u > 0; u--) {
+                    (*seq)[u] = tokens_[Index(row, u)];
+                    row = backpointers_[Index(row, u)];
+                }
+                (*seq)[0] = tokens_[Index(row, 0)];
+                return best_score;
+            }
+
+            int beam_size() const { return beam_size_; }
+            int max_steps() const { return max_steps_; }
+            int live() const { return live_; }
+            int step() const { return step_; }
+            bool done() const { return done_; }
+            const int* words() const { return words_.data(); }
+            const float* scores() const { return scores_.data(); }
+            const int* sources() const { return survivors_.data(); }
+
+        private:
+            struct Complete {
+                float score;
+                int step;
+                int row;
+            };
+
+            int beam_size_;
+            int max_steps_;
+            int start_word_;
+            int end_word_;
+            int live_;
+            int step_;
+            bool done_;
+            std::vector<int> tokens_;
+            std::vector<int> backpointers_;
+            std::vector<int> live_rows_;
+            std::vector<int> words_;
+            std::vector<float> scores_;
+            std::vector<int> survivors_;
+            std::vector<Complete> complete_;
+            int num_complete_;
+
+            int Index(int row, int step) const {
+                return row * (max_steps_ + 1) + step;
+            }
+    };
+
+    // Compacts per-beam decoder state (h, c, ...) after BeamState::Advance: dst row j = src row sources[j].
+    // Two beams may continue from the same source row, so src and dst must be different buffers.
+    inline void GatherRows(const float* src, float* dst, int width, const int* sources, int n) {
+        for (int j = 0; j < n; j++) {
+            std::memcpy(dst + static_cast<size_t>(j) * width, src + static_cast<size_t>(sources[j]) * width,
+                        sizeof(float) * width);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,269 @@
+// C interface of the native decoder and image preprocessing, built as a shared library so that Python
+// (AI_module/native_decoder.py) can drive and validate them:
+//   g++ -O2 -march=native -shared caption/capi.cc -o caption/caption.dll -ljpeg -lpng
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include "decoder.h"
+#include "preprocess.h"
+#include "beam_search.h"
+
+#ifdef _WIN32
+#define CAPTION_API extern "C" __declspec(dllexport)
+#else
+#define CAPTION_API extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace {
+    struct NativeDecoder {
+        NativeDecoder(const char* path, const caption::WeightFileOptions& file, const caption::DecoderOptions& options)
+            : weights(path, file), engine(weights, options), step(&engine) {}
+        caption::WeightFile weights;
+        caption::DecoderEngine engine;
+        // buffers of the entry points, a decoder is used by one thread at a time like its engine
+        std::vector<const caption::ImageFeatures*> images;
+        std::vector<caption::Candidate> candidates;
+        caption::DecoderStep step;
+        caption::BeamSearchScratch search;
+        std::vector<int> words;
+    };
+
+    thread_local std::string last_error;
+
+    // The engine indexes its tables with what callers pass in, the entry points check it first
+    void CheckPixels(int num_pixels) {
+        if (num_pixels < 1) {
+            throw std::invalid_argument("An image needs num_pixels >= 1");
+        }
+    }
+
+    void CheckWords(const caption::DecoderEngine& engine, const int* words, int rows) {
+        if (rows < 1) {
+            throw std::invalid_argument("A decode step needs rows >= 1");
+        }
+        const int V = engine.dims().vocab_size;
+        for (int r = 0; r < rows; r++) {
+            if (words[r] < 0 || words[r] >= V) {
+                throw std::invalid_argument("Word id " + std::to_string(words[r]) + " out of the vocabulary");
+            }
+        }
+    }
+}
+
+// Message of the last failed call on this thread
+CAPTION_API const char* caption_last_error() {
+    return last_error.c_str();
+}
+
+// Flags of caption_decoder_open, see caption::WeightFileOptions
+#define CAPTION_WEIGHTS_POPULATE 1
+#define CAPTION_WEIGHTS_LOCK 2
+
+// gate_table: 0 = off, 1 = float32, 2 = float16, see caption::GateTable; flags: CAPTION_WEIGHTS_*.
+// Returns null on failure, see caption_last_error
+CAPTION_API void* caption_decoder_open(const char* path, int gate_table, int flags) {
+    try {
+        if (gate_table < 0 || gate_table > static_cast<int>(caption::GateTable::F16)) {
+            throw std::invalid_argument("Unknown gate table mode");
+        }
+        caption::WeightFileOptions file;
+        file.populate = (flags & CAPTION_WEIGHTS_POPULATE) != 0;
+        file.lock = (flags & CAPTION_WEIGHTS_LOCK) != 0;
+        caption::DecoderOptions options;
+        options.gate_table = static_cast<caption::GateTable>(gate_table);
+        return new NativeDecoder(path, file, options);
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return nullptr;
+    }
+}
+
+// caption_decoder_open without flags
+CAPTION_API void* caption_decoder_load_with(const char* path, int gate_table) {
+    return caption_decoder_open(path, gate_table, 0);
+}
+
+// Default options, returns null on failure
+CAPTION_API void* caption_decoder_load(const char* path) {
+    return caption_decoder_load_with(path, static_cast<int>(caption::DecoderOptions().gate_table));
+}
+
+CAPTION_API void caption_decoder_free(void* decoder) {
+    delete static_cast<NativeDecoder*>(decoder);
+}
+
+// dims = {encoder_dim, attention_dim, embed_dim, decoder_dim, vocab_size}
+CAPTION_API void caption_decoder_dims(void* decoder, int* dims) {
+    const caption::DecoderDims& d = static_cast<NativeDecoder*>(decoder)->engine.dims();
+    dims[0] = d.encoder_dim;
+    dims[1] = d.attention_dim;
+    dims[2] = d.embed_dim;
+    dims[3] = d.decoder_dim;
+    dims[4] = d.vocab_size;
+}
+
+// Vocabulary shortlist of the images prepared from now on, see caption::ShortlistOptions. mode: 0 = off,
+// 1 = approx, 2 = guarded; words (n) are always in the shortlist. Returns 0 on success.
+CAPTION_API int caption_decoder_shortlist(void* decoder, int mode, int image_words, int frequent_words, float tolerance,
+                                          const int* words, int n) {
+    try {
+        if (mode < 0 || mode > static_cast<int>(caption::ShortlistMode::Guarded)) {
+            throw std::invalid_argument("Unknown shortlist mode");
+        }
+        caption::ShortlistOptions options;
+        options.mode = static_cast<caption::ShortlistMode>(mode);
+        options.image_words = image_words;
+        options.frequent_words = frequent_words;
+        options.tolerance = tolerance;
+        options.words.assign(words, words + n);
+        static_cast<NativeDecoder*>(decoder)->engine.SetShortlist(options);
+        return 0;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+// stats = {rows decoded over a shortlist, rows of them redone over the whole vocabulary, words outside the
+// shortlist the guard scored one by one}
+CAPTION_API void caption_decoder_shortlist_stats(void* decoder, long long* stats) {
+    const caption::ShortlistStats& s = static_cast<NativeDecoder*>(decoder)->engine.shortlist_stats();
+    stats[0] = s.rows;
+    stats[1] = s.fallbacks;
+    stats[2] = s.exact_words;
+}
+
+// memory = {bytes of the activation arena, the peak activation memory of the decoder, and bytes of the same
+// buffers without sharing}, see caption::DecoderEngine::activation_bytes
+CAPTION_API void caption_decoder_memory(void* decoder, long long* memory) {
+    const caption::DecoderEngine& engine = static_cast<NativeDecoder*>(decoder)->engine;
+    memory[0] = static_cast<long long>(engine.activation_bytes());
+    memory[1] = static_cast<long long>(engine.unshared_activation_bytes());
+}
+
+// encoder_out is (num_pixels, encoder_dim); returns null on failure
+CAPTION_API void* caption_image_prepare(void* decoder, const float* encoder_out, int num_pixels) {
+    try {
+        CheckPixels(num_pixels);
+        std::unique_ptr<caption::ImageFeatures> image(new caption::ImageFeatures());
+        static_cast<NativeDecoder*>(decoder)->engine.PrepareImage(encoder_out, num_pixels, image.get());
+        return image.release();
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return nullptr;
+    }
+}
+
+// Prepares the next image into an image of caption_image_prepare, reusing its buffers; 0 on success
+CAPTION_API int caption_image_prepare_into(void* decoder, void* image, const float* encoder_out, int num_pixels) {
+    try {
+        CheckPixels(num_pixels);
+        static_cast<NativeDecoder*>(decoder)->engine.PrepareImage(encoder_out, num_pixels,
+                                                                  static_cast<caption::ImageFeatures*>(image));
+        return 0;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+CAPTION_API void caption_image_free(void* image) {
+    delete static_cast<caption::ImageFeatures*>(image);
+}
+
+// Initial LSTM state of the image, h and c are (decoder_dim)
+CAPTION_API void caption_image_state(void* image, float* h, float* c) {
+    const caption::ImageFeatures* features = static_cast<caption::ImageFeatures*>(image);
+    std::copy(features->h0.begin(), features->h0.end(), h);
+    std::copy(features->c0.begin(), features->c0.end(), c);
+}
+
+// One decode step of `rows` beams of one image, see caption::DecoderEngine::Step. Returns 0 on success.
+CAPTION_API int caption_decoder_step(void* decoder, void* image, int rows, const int* words, const float* h,
+                                     const float* c, float* h_out, float* c_out, float* log_probs, float* alpha) {
+    try {
+        NativeDecoder* native = static_cast<NativeDecoder*>(decoder);
+        CheckWords(native->engine, words, rows);
+        native->images.assign(rows, static_cast<caption::ImageFeatures*>(image));
+        native->engine.Step(native->images.data(), words, h, c, rows, h_out, c_out, log_probs, alpha);
+        return 0;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+// One decode step that only keeps the k most likely next words of every row, see caption::DecoderEngine::StepTopK.
+// next_words and next_log_probs are (rows, k), best first. Returns 0 on success.
+CAPTION_API int caption_decoder_step_topk(void* decoder, void* image, int rows, const int* words, const float* h,
+                                          const float* c, float* h_out, float* c_out, int k, int* next_words,
+                                          float* next_log_probs) {
+    try {
+        NativeDecoder* native = static_cast<NativeDecoder*>(decoder);
+        CheckWords(native->engine, words, rows);
+        native->images.assign(rows, static_cast<caption::ImageFeatures*>(image));
+        native->candidates.resize(static_cast<size_t>(rows) * k);
+        native->engine.StepTopK(native->images.data(), words, h, c, rows, h_out, c_out, k, native->candidates.data());
+        for (size_t i = 0; i < native->candidates.size(); i++) {
+            next_words[i] = native->candidates[i].index;
+            next_log_probs[i] = native->candidates[i].score;
+        }
+        return 0;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+// Full beam search of one image, see caption::BeamSearch. Writes at most max_len words to seq and
+// returns the caption length (<start> and <end> included), or -1 on failure.
+CAPTION_API int caption_beam_search(void* decoder, void* image, int beam_size, int max_steps, float length_norm,
+                                    int start_word, int end_word, int* seq, int max_len) {
+    try {
+        caption::BeamSearchOptions options;
+        options.beam_size = beam_size;
+        options.max_steps = max_steps;
+        options.length_norm = length_norm;
+        NativeDecoder* native = static_cast<NativeDecoder*>(decoder);
+        const int ends[] = {start_word, end_word};
+        CheckWords(native->engine, ends, 2);
+        if (beam_size < 1) {
+            throw std::invalid_argument("A beam search needs beam_size >= 1");
+        }
+
+        native->step.Reset(static_cast<caption::ImageFeatures*>(image), beam_size);
+        caption::BeamSearch(&native->step, options, start_word, end_word, &native->words, &native->search);
+
+        const std::vector<int>& words = native->words;
+        int n = std::min(static_cast<int>(words.size()), max_len);
+        std::copy(words.begin(), words.begin() + n, seq);
+        return static_cast<int>(words.size());
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+// read_image of demo.py on a JPEG or PNG file in memory, see caption::PreprocessImage. image is
+// (3, 256, 256); jpeg_scaling: see caption::PreprocessOptions. Returns 0 on success.
+CAPTION_API int caption_preprocess_image_with(const unsigned char* data, long long size, int jpeg_scaling, float* image) {
+    try {
+        caption::PreprocessOptions options;
+        options.jpeg_scaling = jpeg_scaling != 0;
+        caption::PreprocessImage(data, static_cast<size_t>(size), image, options);
+        return 0;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return -1;
+    }
+}
+
+// Default options
+CAPTION_API int caption_preprocess_image(const unsigned char* data, long long size, float* image) {
+    return caption_preprocess_image_with(data, size, static_cast<int>(caption::PreprocessOptions().jpeg_scaling), image);
+}
@@ -0,0 +1,749 @@
+#ifndef CAPTION_CAPTION_STORE_H_
+#define CAPTION_CAPTION_STORE_H_
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "hash.h"
+#include "backend.h"
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/file.h>
+#endif
+
+namespace caption {
+
+    // A caption depends on the image file and on the model and decode settings, hashed into params
+    struct CaptionKey {
+        // XXH64 and length of the file
+        std::uint64_t image = 0;
+        std::uint64_t size = 0;
+        std::uint64_t params = 0;
+        bool attention_maps = false;
+
+        bool operator==(const CaptionKey& other) const {
+            return image == other.image && size == other.size && params == other.params &&
+                   attention_maps == other.attention_maps;
+        }
+    };
+
+    struct CaptionKeyHash {
+        size_t operator()(const CaptionKey& key) const {
+            return static_cast<size_t>(key.image ^ key.params ^ key.attention_maps);
+        }
+    };
+
+    struct CaptionStoreStats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        // misses answered by the bloom filter alone
+        std::uint64_t bloom_rejects = 0;
+        std::uint64_t insertions = 0;
+        // in the log but not in the index, which could not grow (Windows, while mapped by another process);
+        // the writer keeps up to kMaxUnindexed of them in memory, the next start sizes the index for all of them
+        std::uint64_t unindexed = 0;
+        size_t entries = 0;
+        size_t capacity = 0;
+    };
+
+    // File layout of CaptionStore
+    namespace store {
+        constexpr std::uint64_t kIndexMagic = 0x3158444958504143ULL;  // "CAPXIDX1"
+        constexpr std::uint32_t kRecordMagic = 0x31524143;             // "CAR1"
+        constexpr std::uint32_t kVersion = 1;
+        constexpr size_t kHeaderSize = 4096;
+        constexpr size_t kSlotSize = 256;
+        constexpr size_t kBloomBlockSize = 64;
+        constexpr int kBloomProbes = 6;
+        // the index is rebuilt larger rather than filled beyond this
+        constexpr double kMaxLoad = 0.75;
+        // records larger than this are taken for a torn write
+        constexpr std::uint32_t kMaxPayload = 64u << 20;
+        // records the writer keeps in memory while the index cannot grow, later ones are only in the log
+        constexpr size_t kMaxUnindexed = 4096;
+#ifdef _WIN32
+        // Windows cannot replace a file this process maps: growing unmaps the writer's index, lookups wait
+        constexpr bool kUnmapToGrow = true;
+#else
+        constexpr bool kUnmapToGrow = false;
+#endif
+
+        constexpr std::uint32_t kSlotFull = 1;
+        constexpr std::uint32_t kSlotAttention = 2;
+
+        // First page of the index file
+        struct IndexHeader {
+            std::uint64_t magic;
+            std::uint32_t version;
+            std::uint32_t slot_size;
+            std::uint64_t capacity;
+            std::uint64_t bloom_blocks;
+            std::uint64_t entries;
+            // bytes of the log the index covers
+            std::uint64_t log_length;
+            // 1 when the writer closed it; a crash leaves 0 and the next writer rebuilds it from the log
+            std::uint32_t clean;
+            // 1 once the writer grew the index into a new file, which readers map instead
+            std::uint32_t replaced;
+        };
+
+        // One entry of the open-addressing table, with the caption inline when it fits so a hit reads no
+        // further. state is stored last, so readers in other processes see a slot whole or empty.
+        struct Slot {
+            std::uint64_t image;
+            std::uint64_t size;
+            std::uint64_t params;
+            // of the record in the log
+            std::uint64_t log_offset;
+            std::uint32_t state;
+            std::int32_t attention_size;
+            std::uint32_t caption_length;
+            std::uint32_t maps_length;
+            char caption[kSlotSize - 48];
+        };
+        static_assert(sizeof(Slot) == kSlotSize, "Slot must fill kSlotSize");
+
+        // A log record is RecordHeader, RecordFields, the caption, the attention maps and the XXH64 of all
+        // but the header
+        struct RecordHeader {
+            std::uint32_t magic;
+            std::uint32_t payload_length;
+        };
+
+        struct RecordFields {
+            std::uint64_t image;
+            std::uint64_t size;
+            std::uint64_t params;
+            std::int32_t attention_size;
+            std::uint32_t attention_maps;
+            std::uint32_t caption_length;
+            std::uint32_t maps_length;
+        };
+
+        inline std::uint64_t KeyHash(const CaptionKey& key) {
+            const std::uint64_t words[4] = {key.image, key.size, key.params, key.attention_maps};
+            return XXHash64(words, sizeof(words));
+        }
+
+        inline void TruncateFile(const std::string& path, std::uint64_t length) {
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            LARGE_INTEGER end;
+            end.QuadPart = static_cast<LONGLONG>(length);
+            const bool ok = file != INVALID_HANDLE_VALUE && SetFilePointerEx(file, end, nullptr, FILE_BEGIN) &&
+                            SetEndOfFile(file);
+            if (file != INVALID_HANDLE_VALUE) {
+                CloseHandle(file);
+            }
+#else
+            const bool ok = ::truncate(path.c_str(), static_cast<off_t>(length)) == 0;
+#endif
+            if (!ok) {
+                throw std::runtime_error("Failed to truncate " + path);
+            }
+        }
+
+        // Takes the writer's lock on its open log, false when another writer holds it. The lock goes with the
+        // log when it is closed, or when the process dies. Windows locks are mandatory, so there it is one byte
+        // far past the end of the log, where readers never read.
+        inline bool LockLog(std::FILE* log) {
+#ifdef _WIN32
+            HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(log)));
+            OVERLAPPED at;
+            std::memset(&at, 0, sizeof(at));
+            at.Offset = 0xFFFFFFFF;
+            at.OffsetHigh = 0x7FFFFFFF;
+            return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &at) != 0;
+#else
+            return ::flock(fileno(log), LOCK_EX | LOCK_NB) == 0;
+#endif
+        }
+
+        // Readers that still map the old file keep reading it (POSIX); Windows refuses while one maps it
+        inline void ReplaceFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+            const bool ok = MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            const bool ok = std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+            if (!ok) {
+                throw std::runtime_error("Failed to replace " + to + " (mapped by another process?)");
+            }
+        }
+    }
+
+    // Thrown by a CaptionStore opened for writing while another writer, in this process or another, has it open
+    class StoreLocked : public std::runtime_error {
+        public:
+            explicit StoreLocked(const std::string& what) : std::runtime_error(what) {}
+    };
+
+    // Captions on disk that survive restarts: path + ".log", an append-only log of checksummed records, and
+    // path + ".index", a memory-mapped open-addressing table over it with a blocked bloom filter in front.
+    // A miss usually costs one 64-byte block of the bloom filter; a hit that block and the slot, which holds
+    // captions up to 208 bytes inline; only results with attention maps read their record from the log.
+    // The log is the truth: a writer that finds the index unclean (a crash), behind the log or too small for
+    // it, replays the log, drops a torn record at its end and writes a new index. One process opens the store
+    // for writing, it holds a lock on the log (StoreLocked for a second writer); any number open it read-only,
+    // map the index and see new entries as they are published.
+    // A writer whose index reaches kMaxLoad writes one twice as large and switches to it; readers follow when
+    // they see the old one marked replaced.
+    class CaptionStore {
+        public:
+            // capacity: slots of a new index; an existing log gets at least twice its entries
+            CaptionStore(const std::string& path, bool read_only, size_t capacity = 1 << 16)
+                : log_path_(path + ".log"), index_path_(path + ".index"), read_only_(read_only) {
+                if (read_only_) {
+                    Remap();
+                } else {
+                    OpenWriter(capacity);
+                }
+            }
+
+            ~CaptionStore() {
+                if (!writers_.empty()) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (log_ != nullptr) {
+                        std::fclose(log_);
+                    }
+                    // with records left out of the index, stay unclean so the next writer rebuilds it larger
+                    Header()->clean = unindexed_ == 0 ? 1 : 0;
+                    try {
+                        writers_.back()->Flush();
+                    } catch (const std::exception&) {
+                    }
+                }
+            }
+
+            CaptionStore(const CaptionStore&) = delete;
+            CaptionStore& operator=(const CaptionStore&) = delete;
+
+            bool read_only() const { return read_only_; }
+
+            // The stored caption, or null; safe to call from any thread and while the writer inserts
+            std::shared_ptr<const CaptionResult> Lookup(const CaptionKey& key) {
+                const std::uint64_t hash = store::KeyHash(key);
+                {
+                    std::shared_lock<std::shared_mutex> mapped = HoldIndex();
+                    const View* view = view_.load(std::memory_order_acquire);
+                    if (read_only_ && __atomic_load_n(&view->Header()->replaced, __ATOMIC_ACQUIRE) != 0) {
+                        view = Remap();
+                    }
+                    if (!BloomContains(*view, hash)) {
+                        if (unindexed_ == 0) {
+                            bloom_rejects_++;
+                            misses_++;
+                            return nullptr;
+                        }
+                    } else if (const store::Slot* slot = Find(*view, key, hash)) {
+                        std::shared_ptr<CaptionResult> result(new CaptionResult());
+                        result->attention_size = slot->attention_size;
+                        if (slot->caption_length <= sizeof(slot->caption) && slot->maps_length == 0) {
+                            result->caption.assign(slot->caption, slot->caption_length);
+                        } else if (!ReadRecord(slot->log_offset, key, result.get())) {
+                            misses_++;
+                            return nullptr;
+                        }
+                        hits_++;
+                        return result;
+                    }
+                }
+                // without the index held: Insert takes mutex_ before it grows the index
+                return LookupUnindexed(key);
+            }
+
+            // Appends the caption to the log and publishes it in the index; a key already stored keeps its
+            // first caption
+            void Insert(const CaptionKey& key, const CaptionResult& result) {
+                if (read_only_) {
+                    throw std::logic_error("Caption store opened read-only");
+                }
+                const std::uint64_t hash = store::KeyHash(key);
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (Find(*Current(), key, hash) != nullptr ||
+                    unindexed_records_.count(key) != 0) {
+                    return;
+                }
+                if (Header()->entries + 1 > static_cast<std::uint64_t>(Current()->capacity * store::kMaxLoad) &&
+                    !grow_failed_) {
+                    try {
+                        Grow();
+                    } catch (const std::exception&) {
+                        // Windows cannot replace an index another process maps
+                        grow_failed_ = true;
+                    }
+                }
+                const std::uint64_t offset = log_length_;
+                AppendRecord(key, result);
+                insertions_++;
+
+                const struct View& view = *Current();
+                store::IndexHeader* header = Header();
+                if (header->entries + 1 > static_cast<std::uint64_t>(view.capacity * store::kMaxLoad)) {
+                    // kept in memory up to kMaxUnindexed, the next start rebuilds the index large enough for all
+                    if (unindexed_records_.size() < store::kMaxUnindexed) {
+                        unindexed_records_.emplace(key, std::make_shared<const CaptionResult>(result));
+                    }
+                    unindexed_++;
+                    return;
+                }
+                store::Slot* slot = EmptySlot(view, hash);
+                Fill(slot, key, result, offset);
+                BloomAdd(view, hash);
+                __atomic_store_n(&slot->state, store::kSlotFull | (key.attention_maps ? store::kSlotAttention : 0),
+                                 __ATOMIC_RELEASE);
+                __atomic_store_n(&header->entries, header->entries + 1, __ATOMIC_RELAXED);
+                header->log_length = log_length_;
+            }
+
+            CaptionStoreStats stats() const {
+                const struct View* view = view_.load(std::memory_order_acquire);
+                CaptionStoreStats stats;
+                stats.hits = hits_;
+                stats.misses = misses_;
+                stats.bloom_rejects = bloom_rejects_;
+                stats.insertions = insertions_;
+                stats.unindexed = unindexed_;
+                stats.entries = static_cast<size_t>(__atomic_load_n(&view->Header()->entries, __ATOMIC_RELAXED));
+                stats.capacity = view->capacity;
+                return stats;
+            }
+
+        private:
+            // One mapping of the index. A grown index gets a new View; the old ones stay mapped until the store
+            // is closed, lookups on other threads may still be reading them.
+            struct View {
+                char* index;
+                store::Slot* slots;
+                size_t capacity;
+                size_t bloom_blocks;
+
+                store::IndexHeader* Header() const {
+                    return reinterpret_cast<store::IndexHeader*>(index);
+                }
+            };
+
+            std::string log_path_;
+            std::string index_path_;
+            bool read_only_;
+            std::atomic<const struct View*> view_{nullptr};
+            std::vector<std::unique_ptr<struct View>> views_;
+            // the mappings of views_, of the reader or of the writer
+            std::vector<std::unique_ptr<MappedFile>> readers_;
+            std::vector<std::unique_ptr<WritableMappedFile>> writers_;
+            std::mutex remap_mutex_;
+            // held shared by the lookups of a writer that unmaps its index to grow it, see store::kUnmapToGrow
+            std::shared_mutex index_mutex_;
+
+            // writer only, under mutex_
+            std::mutex mutex_;
+            std::FILE* log_ = nullptr;
+            std::uint64_t log_length_ = 0;
+            bool grow_failed_ = false;
+            std::unordered_map<CaptionKey, std::shared_ptr<const CaptionResult>, CaptionKeyHash> unindexed_records_;
+
+            std::atomic<std::uint64_t> hits_{0};
+            std::atomic<std::uint64_t> misses_{0};
+            std::atomic<std::uint64_t> bloom_rejects_{0};
+            std::atomic<std::uint64_t> insertions_{0};
+            std::atomic<std::uint64_t> unindexed_{0};
+
+            // A stored record, as replayed from the log
+            struct Replayed {
+                CaptionKey key;
+                std::uint64_t offset;
+                CaptionResult result;
+            };
+
+            // Locked only where growing unmaps the index
+            std::shared_lock<std::shared_mutex> HoldIndex() {
+                if (store::kUnmapToGrow && !read_only_) {
+                    return std::shared_lock<std::shared_mutex>(index_mutex_);
+                }
+                return std::shared_lock<std::shared_mutex>();
+            }
+
+            // writer only
+            const struct View* Current() const {
+                return view_.load(std::memory_order_relaxed);
+            }
+
+            store::IndexHeader* Header() {
+                return Current()->Header();
+            }
+
+            static size_t IndexSize(size_t capacity, size_t bloom_blocks) {
+                return store::kHeaderSize + bloom_blocks * store::kBloomBlockSize + capacity * store::kSlotSize;
+            }
+
+            struct View MakeView(const char* data, size_t size) const {
+                const store::IndexHeader* header = reinterpret_cast<const store::IndexHeader*>(data);
+                if (size < store::kHeaderSize || header->magic != store::kIndexMagic ||
+                    header->version != store::kVersion || header->slot_size != store::kSlotSize ||
+                    header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+                    header->bloom_blocks == 0 || (header->bloom_blocks & (header->bloom_blocks - 1)) != 0 ||
+                    size != IndexSize(header->capacity, header->bloom_blocks)) {
+                    throw std::runtime_error("Not a caption store index: " + index_path_);
+                }
+                struct View view;
+                view.index = const_cast<char*>(data);
+                view.capacity = static_cast<size_t>(header->capacity);
+                view.bloom_blocks = static_cast<size_t>(header->bloom_blocks);
+                view.slots = reinterpret_cast<store::Slot*>(view.index + store::kHeaderSize +
+                                                            view.bloom_blocks * store::kBloomBlockSize);
+                return view;
+            }
+
+            const struct View* Publish(const struct View& view) {
+                views_.emplace_back(new struct View(view));
+                view_.store(views_.back().get(), std::memory_order_release);
+                return views_.back().get();
+            }
+
+            // Maps the current index file; a reader calls it again once the writer replaced the file
+            const struct View* Remap() {
+                std::lock_guard<std::mutex> lock(remap_mutex_);
+                const struct View* view = view_.load(std::memory_order_acquire);
+                if (view != nullptr && __atomic_load_n(&view->Header()->replaced, __ATOMIC_ACQUIRE) == 0) {
+                    return view;
+                }
+                std::unique_ptr<MappedFile> reader(new MappedFile(index_path_, false, false));
+                const struct View mapped = MakeView(reader->data(), reader->size());
+                readers_.push_back(std::move(reader));
+                return Publish(mapped);
+            }
+
+            std::shared_ptr<const CaptionResult> LookupUnindexed(const CaptionKey& key) {
+                if (unindexed_ > 0) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = unindexed_records_.find(key);
+                    if (it != unindexed_records_.end()) {
+                        hits_++;
+                        return it->second;
+                    }
+                }
+                misses_++;
+                return nullptr;
+            }
+
+            static const std::uint64_t* BloomBlock(const struct View& view, std::uint64_t hash) {
+                const size_t block = static_cast<size_t>(hash >> 40) & (view.bloom_blocks - 1);
+                return reinterpret_cast<const std::uint64_t*>(view.index + store::kHeaderSize + block * store::kBloomBlockSize);
+            }
+
+            // kBloomProbes bits of one 512-bit block, so a lookup touches one cache line of the filter
+            static bool BloomContains(const struct View& view, std::uint64_t hash) {
+                const std::uint64_t* block = BloomBlock(view, hash);
+                std::uint64_t bits = hash * 0x9E3779B97F4A7C15ULL;
+                for (int i = 0; i < store::kBloomProbes; i++, bits >>= 9) {
+                    const unsigned bit = bits & 511;
+                    if ((__atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED) & (std::uint64_t(1) << (bit % 64))) == 0) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            static void BloomAdd(const struct View& view, std::uint64_t hash) {
+                std::uint64_t* block = const_cast<std::uint64_t*>(BloomBlock(view, hash));
+                std::uint64_t bits = hash * 0x9E3779B97F4A7C15ULL;
+                for (int i = 0; i < store::kBloomProbes; i++, bits >>= 9) {
+                    const unsigned bit = bits & 511;
+                    __atomic_fetch_or(&block[bit / 64], std::uint64_t(1) << (bit % 64), __ATOMIC_RELAXED);
+                }
+            }
+
+            // Linear probing up to the first empty slot; the load stays below kMaxLoad, so there is one
+            static const store::Slot* Find(const struct View& view, const CaptionKey& key, std::uint64_t hash) {
+                const std::uint32_t wanted = store::kSlotFull | (key.attention_maps ? store::kSlotAttention : 0);
+                for (size_t i = hash & (view.capacity - 1);; i = (i + 1) & (view.capacity - 1)) {
+                    const store::Slot* slot = view.slots + i;
+                    const std::uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+                    if (state == 0) {
+                        return nullptr;
+                    }
+                    if (state == wanted && slot->image == key.image && slot->size == key.size &&
+                        slot->params == key.params) {
+                        return slot;
+                    }
+                }
+            }
+
+            static store::Slot* EmptySlot(const struct View& view, std::uint64_t hash) {
+                size_t i = hash & (view.capacity - 1);
+                while (__atomic_load_n(&view.slots[i].state, __ATOMIC_ACQUIRE) != 0) {
+                    i = (i + 1) & (view.capacity - 1);
+                }
+                return view.slots + i;
+            }
+
+            static void Fill(store::Slot* slot, const CaptionKey& key, const CaptionResult& result, std::uint64_t offset) {
+                slot->image = key.image;
+                slot->size = key.size;
+                slot->params = key.params;
+                slot->log_offset = offset;
+                slot->attention_size = result.attention_size;
+                slot->caption_length = static_cast<std::uint32_t>(result.caption.size());
+                slot->maps_length = static_cast<std::uint32_t>(result.attention_maps.size());
+                if (result.caption.size() <= sizeof(slot->caption)) {
+                    std::memcpy(slot->caption, result.caption.data(), result.caption.size());
+                }
+            }
+
+            static std::string Serialize(const CaptionKey& key, const CaptionResult& result) {
+                store::RecordFields fields;
+                std::memset(&fields, 0, sizeof(fields));
+                fields.image = key.image;
+                fields.size = key.size;
+                fields.params = key.params;
+                fields.attention_size = result.attention_size;
+                fields.attention_maps = key.attention_maps ? 1 : 0;
+                fields.caption_length = static_cast<std::uint32_t>(result.caption.size());
+                fields.maps_length = static_cast<std::uint32_t>(result.attention_maps.size());
+
+                store::RecordHeader header;
+                header.magic = store::kRecordMagic;
+                header.payload_length = static_cast<std::uint32_t>(sizeof(fields) + result.caption.size() +
+                                                                   result.attention_maps.size());
+                std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+                record.append(reinterpret_cast<const char*>(&fields), sizeof(fields));
+                record += result.caption;
+                record += result.attention_maps;
+                const std::uint64_t checksum = XXHash64(record.data() + sizeof(header), record.size() - sizeof(header));
+                record.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+                return record;
+            }
+
+            // Reads one record at *offset and advances it; false at the end of the log or at a torn record
+            static bool ReadNext(std::istream& log, std::uint64_t* offset, Replayed* replayed) {
+                store::RecordHeader header;
+                if (!log.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != store::kRecordMagic ||
+                    header.payload_length < sizeof(store::RecordFields) || header.payload_length > store::kMaxPayload) {
+                    return false;
+                }
+                std::string payload(header.payload_length, '\0');
+                std::uint64_t checksum;
+                if (!log.read(&payload[0], payload.size()) ||
+                    !log.read(reinterpret_cast<char*>(&checksum), sizeof(checksum)) ||
+                    XXHash64(payload.data(), payload.size()) != checksum) {
+                    return false;
+                }
+                store::RecordFields fields;
+                std::memcpy(&fields, payload.data(), sizeof(fields));
+                if (sizeof(fields) + static_cast<std::uint64_t>(fields.caption_length) + fields.maps_length != payload.size()) {
+                    return false;
+                }
+                replayed->key.image = fields.image;
+                replayed->key.size = fields.size;
+                replayed->key.params = fields.params;
+                replayed->key.attention_maps = fields.attention_maps != 0;
+                replayed->offset = *offset;
+                replayed->result.attention_size = fields.attention_size;
+                replayed->result.caption.assign(payload.data() + sizeof(fields), fields.caption_length);
+                replayed->result.attention_maps.assign(payload.data() + sizeof(fields) + fields.caption_length,
+                                                       fields.maps_length);
+                *offset += sizeof(header) + payload.size() + sizeof(checksum);
+                return true;
+            }
+
+            bool ReadRecord(std::uint64_t offset, const CaptionKey& key, CaptionResult* result) const {
+                std::ifstream log(log_path_, std::ios::binary);
+                if (!log.seekg(static_cast<std::streamoff>(offset))) {
+                    return false;
+                }
+                Replayed replayed;
+                if (!ReadNext(log, &offset, &replayed) || !(replayed.key == key)) {
+                    return false;
+                }
+                *result = std::move(replayed.result);
+                return true;
+            }
+
+            void AppendRecord(const CaptionKey& key, const CaptionResult& result) {
+                const std::string record = Serialize(key, result);
+                if (std::fwrite(record.data(), 1, record.size(), log_) != record.size() || std::fflush(log_) != 0) {
+                    throw std::runtime_error("Failed to append to " + log_path_);
+                }
+                log_length_ += record.size();
+            }
+
+            static std::uint64_t FileLength(const std::string& path) {
+                std::ifstream file(path, std::ios::binary | std::ios::ate);
+                return file.is_open() ? static_cast<std::uint64_t>(file.tellg()) : 0;
+            }
+
+            // The existing index if a clean writer left it covering the whole log, else one rebuilt from the log.
+            // The log is opened and locked first, so a second writer fails before it touches either file.
+            void OpenWriter(size_t capacity) {
+                log_ = std::fopen(log_path_.c_str(), "ab");
+                if (log_ == nullptr) {
+                    throw std::runtime_error("Failed to open " + log_path_);
+                }
+                if (!store::LockLog(log_)) {
+                    std::fclose(log_);
+                    throw StoreLocked("Caption store " + log_path_ + " is open for writing by another process");
+                }
+                try {
+                    OpenIndex(capacity);
+                } catch (...) {
+                    std::fclose(log_);
+                    writers_.clear();
+                    throw;
+                }
+            }
+
+            void OpenIndex(size_t capacity) {
+                log_length_ = FileLength(log_path_);
+                store::IndexHeader header;
+                std::memset(&header, 0, sizeof(header));
+                const std::uint64_t index_length = FileLength(index_path_);
+                {
+                    std::ifstream index(index_path_, std::ios::binary);
+                    index.read(reinterpret_cast<char*>(&header), sizeof(header));
+                }
+                const bool reusable = header.magic == store::kIndexMagic && header.version == store::kVersion &&
+                                      header.slot_size == store::kSlotSize && header.clean == 1 &&
+                                      header.replaced == 0 && header.log_length == log_length_ &&
+                                      header.capacity > 0 && header.bloom_blocks > 0 &&
+                                      index_length == IndexSize(header.capacity, header.bloom_blocks);
+                if (reusable) {
+                    writers_.emplace_back(new WritableMappedFile(index_path_, static_cast<size_t>(index_length)));
+                } else {
+                    Rebuild(capacity);
+                }
+                Publish(MakeView(writers_.back()->data(), writers_.back()->size()));
+                // until closed, a crash must leave the index for a rebuild
+                Header()->clean = 0;
+                writers_.back()->Flush();
+            }
+
+            void Rebuild(size_t capacity) {
+                // the first record of every key, in log order, as Insert keeps it
+                std::vector<Replayed> records;
+                std::unordered_map<CaptionKey, size_t, CaptionKeyHash> first;
+                std::uint64_t valid = 0;
+                {
+                    std::ifstream log(log_path_, std::ios::binary);
+                    Replayed replayed;
+                    while (log.is_open() && ReadNext(log, &valid, &replayed)) {
+                        if (first.emplace(replayed.key, records.size()).second) {
+                            records.push_back(std::move(replayed));
+                        }
+                    }
+                }
+                if (valid < log_length_) {
+                    // a record cut short by a crash; appending after it would hide every later record
+                    store::TruncateFile(log_path_, valid);
+                    log_length_ = valid;
+                }
+
+                size_t slots = 64;
+                while (slots < capacity || slots < records.size() * 2) {
+                    slots *= 2;
+                }
+                const size_t size = WriteIndex(slots, [&records](const struct View& view) {
+                    for (const Replayed& record : records) {
+                        const std::uint64_t hash = store::KeyHash(record.key);
+                        store::Slot* slot = EmptySlot(view, hash);
+                        Fill(slot, record.key, record.result, record.offset);
+                        slot->state = store::kSlotFull | (record.key.attention_maps ? store::kSlotAttention : 0);
+                        BloomAdd(view, hash);
+                    }
+                    return static_cast<std::uint64_t>(records.size());
+                });
+                store::ReplaceFile(index_path_ + ".tmp", index_path_);
+                writers_.emplace_back(new WritableMappedFile(index_path_, size));
+            }
+
+            // Doubles the index: the slots of the current one are placed again in a new file, which the lookups
+            // of this process switch to, and the old file is marked replaced for the readers of other processes.
+            // On Windows the writer's own mapping is closed around the replace; a reader process still mapping
+            // the index makes the replace fail, the old index is mapped again and the error is thrown.
+            void Grow() {
+                const struct View& old = *Current();
+                const size_t old_size = writers_.back()->size();
+                const size_t size = WriteIndex(old.capacity * 2, [&old](const struct View& view) {
+                    std::uint64_t entries = 0;
+                    for (size_t i = 0; i < old.capacity; i++) {
+                        const store::Slot& slot = old.slots[i];
+                        if (slot.state == 0) {
+                            continue;
+                        }
+                        CaptionKey key;
+                        key.image = slot.image;
+                        key.size = slot.size;
+                        key.params = slot.params;
+                        key.attention_maps = (slot.state & store::kSlotAttention) != 0;
+                        const std::uint64_t hash = store::KeyHash(key);
+                        std::memcpy(EmptySlot(view, hash), &slot, sizeof(slot));
+                        BloomAdd(view, hash);
+                        entries++;
+                    }
+                    return entries;
+                });
+                const std::string building = index_path_ + ".tmp";
+                if (!store::kUnmapToGrow) {
+                    store::ReplaceFile(building, index_path_);
+                    writers_.emplace_back(new WritableMappedFile(index_path_, size));
+                    store::IndexHeader* old_header = old.Header();
+                    Publish(MakeView(writers_.back()->data(), writers_.back()->size()));
+                    __atomic_store_n(&old_header->replaced, 1u, __ATOMIC_RELEASE);
+                    return;
+                }
+
+                // no lookup reads the views while they are unmapped; no other process maps the index once the
+                // replace succeeded, so nobody needs the old one marked replaced
+                std::unique_lock<std::shared_mutex> unmapped(index_mutex_);
+                writers_.clear();
+                try {
+                    store::ReplaceFile(building, index_path_);
+                } catch (const std::exception&) {
+                    std::remove(building.c_str());
+                    writers_.emplace_back(new WritableMappedFile(index_path_, old_size));
+                    Publish(MakeView(writers_.back()->data(), writers_.back()->size()));
+                    throw;
+                }
+                writers_.emplace_back(new WritableMappedFile(index_path_, size));
+                Publish(MakeView(writers_.back()->data(), writers_.back()->size()));
+            }
+
+            // Writes an index of `slots` slots over log_length_ bytes of log to index_path_ + ".tmp", with the
+            // entries add(view) places and counts; returns its size
+            template <typename AddEntries>
+            size_t WriteIndex(size_t slots, AddEntries add) {
+                // about 21 bits of filter per entry at kMaxLoad
+                const size_t bloom_blocks = slots / 32 < 64 ? 64 : slots / 32;
+                const std::string building = index_path_ + ".tmp";
+                {
+                    WritableMappedFile index(building, IndexSize(slots, bloom_blocks));
+                    std::memset(index.data(), 0, index.size());
+                    store::IndexHeader* header = reinterpret_cast<store::IndexHeader*>(index.data());
+                    header->magic = store::kIndexMagic;
+                    header->version = store::kVersion;
+                    header->slot_size = store::kSlotSize;
+                    header->capacity = slots;
+                    header->bloom_blocks = bloom_blocks;
+                    header->log_length = log_length_;
+                    header->entries = add(MakeView(index.data(), index.size()));
+                    index.Flush();
+                }
+                return IndexSize(slots, bloom_blocks);
+            }
+    };
+}
+
+#endif
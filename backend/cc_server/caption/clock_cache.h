@@ -0,0 +1,172 @@
+#ifndef CAPTION_CLOCK_CACHE_H_
+#define CAPTION_CLOCK_CACHE_H_
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+namespace caption {
+
+    struct CacheStats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t insertions = 0;
+        std::uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t budget = 0;
+    };
+
+    // Cache of immutable values under a byte budget, split in shards by the hash of the key so threads looking
+    // up different keys rarely wait on the same mutex. Each shard evicts with CLOCK: a hit only sets a bit of
+    // the entry, and the hand sweeping the slots for a victim clears the bits it passes and takes the first
+    // entry without one, which approximates LRU without reordering a list on every hit. Values are shared, a
+    // lookup costs a reference count, not a copy, and an evicted value lives on as long as a reader holds it.
+    template <typename Key, typename Value, typename KeyHash = std::hash<Key>>
+    class ClockCache {
+        public:
+            // budget: bytes of all shards together, as counted by the callers of Insert
+            explicit ClockCache(size_t budget, int shards = 16) : budget_(budget) {
+                shards = shards < 1 ? 1 : shards;
+                for (int i = 0; i < shards; i++) {
+                    shards_.emplace_back(new Shard());
+                }
+                shard_budget_ = budget / shards;
+            }
+
+            // The value of key, or null
+            std::shared_ptr<const Value> Lookup(const Key& key) {
+                Shard& shard = ShardOf(key);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.index.find(key);
+                if (it == shard.index.end()) {
+                    shard.misses++;
+                    return nullptr;
+                }
+                shard.hits++;
+                Slot& slot = shard.slots[it->second];
+                slot.referenced = true;
+                return slot.value;
+            }
+
+            // Replaces the value of key, evicting until its shard is within budget; values larger than a
+            // shard's budget are not kept
+            void Insert(const Key& key, std::shared_ptr<const Value> value, size_t bytes) {
+                Shard& shard = ShardOf(key);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.index.find(key);
+                if (it != shard.index.end()) {
+                    Remove(shard, it->second);
+                }
+                if (bytes > shard_budget_) {
+                    return;
+                }
+                while (shard.bytes + bytes > shard_budget_) {
+                    EvictOne(shard);
+                }
+
+                size_t index;
+                if (shard.free.empty()) {
+                    index = shard.slots.size();
+                    shard.slots.emplace_back();
+                } else {
+                    index = shard.free.back();
+                    shard.free.pop_back();
+                }
+                Slot& slot = shard.slots[index];
+                slot.key = key;
+                slot.value = std::move(value);
+                slot.bytes = bytes;
+                slot.used = true;
+                // a new entry has to be hit once before it survives a sweep of the hand
+                slot.referenced = false;
+                shard.index.emplace(key, index);
+                shard.bytes += bytes;
+                shard.insertions++;
+            }
+
+            CacheStats stats() const {
+                CacheStats stats;
+                stats.budget = budget_;
+                for (const auto& shard : shards_) {
+                    std::lock_guard<std::mutex> lock(shard->mutex);
+                    stats.hits += shard->hits;
+                    stats.misses += shard->misses;
+                    stats.insertions += shard->insertions;
+                    stats.evictions += shard->evictions;
+                    stats.entries += shard->index.size();
+                    stats.bytes += shard->bytes;
+                }
+                return stats;
+            }
+
+        private:
+            struct Slot {
+                Key key{};
+                std::shared_ptr<const Value> value;
+                size_t bytes = 0;
+                bool used = false;
+                bool referenced = false;
+            };
+
+            struct Shard {
+                mutable std::mutex mutex;
+                std::unordered_map<Key, size_t, KeyHash> index;
+                // the clock: entries never move, freed slots are reused before the ring grows
+                std::vector<Slot> slots;
+                std::vector<size_t> free;
+                size_t hand = 0;
+                size_t bytes = 0;
+                std::uint64_t hits = 0;
+                std::uint64_t misses = 0;
+                std::uint64_t insertions = 0;
+                std::uint64_t evictions = 0;
+            };
+
+            size_t budget_;
+            size_t shard_budget_;
+            KeyHash hash_;
+            std::vector<std::unique_ptr<Shard>> shards_;
+
+            Shard& ShardOf(const Key& key) {
+                // the high bits, the unordered_map of the shard buckets by the low ones
+                std::uint64_t h = static_cast<std::uint64_t>(hash_(key)) * 0x9E3779B97F4A7C15ULL;
+                return *shards_[(h >> 32) % shards_.size()];
+            }
+
+            void Remove(Shard& shard, size_t index) {
+                Slot& slot = shard.slots[index];
+                shard.index.erase(slot.key);
+                shard.bytes -= slot.bytes;
+                slot.value.reset();
+                slot.bytes = 0;
+                slot.used = false;
+                shard.free.push_back(index);
+            }
+
+            // Only called with entries in the shard, so the hand finds a victim within two turns
+            void EvictOne(Shard& shard) {
+                for (;;) {
+                    size_t index = shard.hand;
+                    shard.hand = (shard.hand + 1) % shard.slots.size();
+                    Slot& slot = shard.slots[index];
+                    if (!slot.used) {
+                        continue;
+                    }
+                    if (slot.referenced) {
+                        slot.referenced = false;
+                        continue;
+                    }
+                    Remove(shard, index);
+                    shard.evictions++;
+                    return;
+                }
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef CAPTION_DECODE_SCHEDULER_H_
+#define CAPTION_DECODE_SCHEDULER_H_
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "topk.h"
+#include "beam_state.h"
+#include "beam_search.h"
+#include "decoder.h"
+
+namespace caption {
+
+    // Iteration-level batching of beam search on the native decoder, the C++ side of
+    // AI_module/decode_scheduler.py: one thread owns a DecoderEngine and runs the live beams of every caption
+    // in flight as one StepTopK, each row attending to its own image. A caption joins at the next step once
+    // submitted and leaves as soon as its beams finish, so a long caption does not hold the others back.
+    // Captions are the ones of BeamSearch, the engine computes every row on its own.
+    class DecodeScheduler {
+        public:
+            // max_rows: beams of one step, a caption waits for room unless nothing else is in flight
+            DecodeScheduler(const WeightFile& weights, const DecoderOptions& options, int start_word, int end_word)
+                : engine_(weights, options), start_word_(start_word), end_word_(end_word),
+                  max_rows_(std::max(1, options.max_rows)), thread_(&DecodeScheduler::Run, this) {}
+
+            ~DecodeScheduler() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stop_ = true;
+                }
+                wake_.notify_all();
+                thread_.join();
+            }
+
+            DecodeScheduler(const DecodeScheduler&) = delete;
+            DecodeScheduler& operator=(const DecodeScheduler&) = delete;
+
+            const DecoderDims& dims() const { return engine_.dims(); }
+
+            // Beam search of one encoded image (num_pixels, encoder_dim) together with the other callers.
+            // Blocks until the caption is decoded; writes it to seq like BeamSearch and returns its score.
+            float Caption(const float* encoder_out, int num_pixels, const BeamSearchOptions& options,
+                          std::vector<int>* seq) {
+                if (options.beam_size < 1 || options.max_steps < 1 || num_pixels < 1) {
+                    throw std::invalid_argument("beam search needs beam_size >= 1, max_steps >= 1 and num_pixels >= 1");
+                }
+                // the caller waits for its request, so the request of its last caption is free again
+                thread_local Request request;
+                request.encoder_out = encoder_out;
+                request.num_pixels = num_pixels;
+                request.options = options;
+                request.seq = seq;
+                request.done = false;
+                request.error = nullptr;
+
+                Request* mine = &request;
+                std::unique_lock<std::mutex> lock(mutex_);
+                pending_.push_back(mine);
+                wake_.notify_all();
+                finished_.wait(lock, [mine]() { return mine->done; });
+                if (request.error) {
+                    std::rethrow_exception(request.error);
+                }
+                return request.score;
+            }
+
+        private:
+            // One caption in flight: its image, its beams and their decoder state
+            struct Request {
+                Request() : beams(1, 1, 0, 0) {}
+
+                const float* encoder_out = nullptr;
+                int num_pixels = 0;
+                BeamSearchOptions options;
+                std::vector<int>* seq = nullptr;
+                ImageFeatures image;
+                BeamState beams;
+                std::vector<float> h;
+                std::vector<float> c;
+                // first row of the request in the batch of the current step
+                int row = 0;
+                float score = 0.0f;
+                bool done = false;
+                std::exception_ptr error;
+            };
+
+            DecoderEngine engine_;
+            const int start_word_;
+            const int end_word_;
+            const int max_rows_;
+
+            std::mutex mutex_;
+            std::condition_variable wake_;
+            std::condition_variable finished_;
+            std::deque<Request*> pending_;
+            bool stop_ = false;
+
+            // state of the scheduler thread, the buffers only grow
+            std::vector<Request*> active_;
+            std::vector<Request*> joined_;
+            std::vector<const ImageFeatures*> images_;
+            std::vector<int> words_;
+            std::vector<float> h_;
+            std::vector<float> c_;
+            std::vector<float> h_next_;
+            std::vector<float> c_next_;
+            std::vector<Candidate> candidates_;
+            std::vector<Candidate> best_;
+            std::vector<float> score_;
+            std::vector<int> prev_;
+            std::vector<int> next_;
+            TopK topk_;
+
+            // started last, after every member it uses
+            std::thread thread_;
+
+            void Run() {
+                for (;;) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex_);
+                        wake_.wait(lock, [this]() { return stop_ || !pending_.empty() || !active_.empty(); });
+                        if (stop_ && active_.empty()) {
+                            for (Request* request : pending_) {
+                                Finish(request, std::make_exception_ptr(std::runtime_error("The decode scheduler stopped")));
+                            }
+                            pending_.clear();
+                            finished_.notify_all();
+                            return;
+                        }
+                        Admit();
+                    }
+
+                    try {
+                        Join();
+                        Step();
+                    } catch (...) {
+                        // the engine failed, every caption of this step fails with it
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        for (Request* request : active_) {
+                            Finish(request, std::current_exception());
+                        }
+                        active_.clear();
+                        finished_.notify_all();
+                        continue;
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    std::vector<Request*>::iterator live = std::partition(active_.begin(), active_.end(),
+                                                                          [](const Request* r) { return !r->beams.done(); });
+                    for (std::vector<Request*>::iterator r = live; r != active_.end(); ++r) {
+                        (*r)->score = (*r)->beams.Best((*r)->seq, (*r)->options.length_norm);
+                        Finish(*r, nullptr);
+                    }
+                    if (live != active_.end()) {
+                        active_.erase(live, active_.end());
+                        finished_.notify_all();
+                    }
+                }
+            }
+
+            // Moves pending captions into the batch while their beams fit, under mutex_
+            void Admit() {
+                int rows = 0;
+                for (const Request* request : active_) {
+                    rows += request->beams.live();
+                }
+                joined_.clear();
+                while (!pending_.empty() && (active_.empty() || rows + pending_.front()->options.beam_size <= max_rows_)) {
+                    Request* request = pending_.front();
+                    pending_.pop_front();
+                    rows += request->options.beam_size;
+                    active_.push_back(request);
+                    joined_.push_back(request);
+                }
+            }
+
+            // Prepares the images of the captions that just joined, their beams start from h0 and c0
+            void Join() {
+                const int D = engine_.dims().decoder_dim;
+                for (Request* request : joined_) {
+                    const int k = request->options.beam_size;
+                    engine_.PrepareImage(request->encoder_out, request->num_pixels, &request->image);
+                    request->beams.Reset(k, request->options.max_steps, start_word_, end_word_);
+                    request->h.resize(static_cast<size_t>(k) * D);
+                    request->c.resize(request->h.size());
+                    for (int r = 0; r < k; r++) {
+                        std::copy(request->image.h0.begin(), request->image.h0.end(), request->h.begin() + static_cast<size_t>(r) * D);
+                        std::copy(request->image.c0.begin(), request->image.c0.end(), request->c.begin() + static_cast<size_t>(r) * D);
+                    }
+                }
+            }
+
+            // One decode step of the live beams of every active caption, then the search step of each
+            void Step() {
+                const int D = engine_.dims().decoder_dim;
+                const int V = engine_.dims().vocab_size;
+                int rows = 0;
+                int k = 1;
+                for (Request* request : active_) {
+                    request->row = rows;
+                    rows += request->beams.live();
+                    k = std::max(k, request->options.beam_size);
+                }
+                images_.resize(rows);
+                words_.resize(rows);
+                h_.resize(static_cast<size_t>(rows) * D);
+                c_.resize(h_.size());
+                h_next_.resize(h_.size());
+                c_next_.resize(c_.size());
+                candidates_.resize(static_cast<size_t>(rows) * k);
+                for (const Request* request : active_) {
+                    const int live = request->beams.live();
+                    const size_t offset = static_cast<size_t>(request->row) * D;
+                    std::fill(images_.begin() + request->row, images_.begin() + request->row + live, &request->image);
+                    std::copy(request->beams.words(), request->beams.words() + live, words_.begin() + request->row);
+                    std::copy(request->h.begin(), request->h.begin() + static_cast<size_t>(live) * D, h_.begin() + offset);
+                    std::copy(request->c.begin(), request->c.begin() + static_cast<size_t>(live) * D, c_.begin() + offset);
+                }
+
+                engine_.StepTopK(images_.data(), words_.data(), h_.data(), c_.data(), rows, h_next_.data(), c_next_.data(),
+                                 k, candidates_.data());
+
+                // the search step of BeamSearch on the request's rows, the best beam_size of each row's k
+                for (Request* request : active_) {
+                    BeamState& beams = request->beams;
+                    const int live = beams.live();
+                    const int beam_size = request->options.beam_size;
+                    // At the first step all beams are <start> with the same state, only the first one is searched
+                    const int search_rows = beams.step() == 0 ? 1 : live;
+                    topk_.Reset(live);
+                    for (int r = 0; r < search_rows; r++) {
+                        const Candidate* row = candidates_.data() + static_cast<size_t>(request->row + r) * k;
+                        for (int j = 0; j < beam_size; j++) {
+                            topk_.Push(beams.scores()[r] + row[j].score, r * V + row[j].index);
+                        }
+                    }
+
+                    best_.resize(live);
+                    score_.resize(live);
+                    prev_.resize(live);
+                    next_.resize(live);
+                    int n = topk_.Sorted(best_.data());
+                    for (int i = 0; i < n; i++) {
+                        score_[i] = best_[i].score;
+                        prev_[i] = best_[i].index / V;
+                        next_[i] = best_[i].index % V;
+                    }
+
+                    int survivors = beams.Advance(score_.data(), prev_.data(), next_.data(), n);
+                    if (survivors > 0) {
+                        const size_t offset = static_cast<size_t>(request->row) * D;
+                        GatherRows(h_next_.data() + offset, request->h.data(), D, beams.sources(), survivors);
+                        GatherRows(c_next_.data() + offset, request->c.data(), D, beams.sources(), survivors);
+                    }
+                }
+            }
+
+            // under mutex_
+            static void Finish(Request* request, std::exception_ptr error) {
+                request->error = error;
+                request->done = true;
+            }
+    };
+}
+
+#endif
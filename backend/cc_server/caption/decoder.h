@@ -0,0 +1,631 @@
+#ifndef CAPTION_DECODER_H_
+#define CAPTION_DECODER_H_
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "topk.h"
+#include "arena.h"
+#include "weights.h"
+#include "kernels.h"
+#include "quantize.h"
+#include "attention.h"
+#include "shortlist.h"
+#include "output_topk.h"
+
+namespace caption {
+
+    struct DecoderDims {
+        int encoder_dim;
+        int attention_dim;
+        int embed_dim;
+        int decoder_dim;
+        int vocab_size;
+    };
+
+    // Decoder inputs that only depend on the image, computed once when it is encoded. They are the caller's:
+    // an ImageFeatures prepared again for the next image keeps its buffers, so once they have grown to the
+    // largest image and shortlist seen, PrepareImage does not allocate.
+    struct ImageFeatures {
+        int num_pixels = 0;
+        std::vector<float> encoder_out;  // (num_pixels, encoder_dim)
+        std::vector<float> att1;         // attention.encoder_att(encoder_out), (num_pixels, attention_dim)
+        std::vector<float> h0;           // init_h(mean(encoder_out)), (decoder_dim)
+        std::vector<float> c0;           // init_c(mean(encoder_out)), (decoder_dim)
+        Shortlist shortlist;             // words StepTopK scores, empty without a shortlist
+    };
+
+    // Precomputed embedding part of the LSTMCell input: for every word, W_ih[:, :embed_dim] * embedding(word)
+    // plus both LSTM biases, (vocab_size, 4 * decoder_dim). A decode step then gathers one row per beam instead
+    // of multiplying the embeddings; F16 halves the table (about 40 MB for the 9534 word vocabulary).
+    enum class GateTable {
+        Off,
+        F32,
+        F16,
+    };
+
+    struct DecoderOptions {
+        GateTable gate_table = GateTable::F32;
+        ShortlistOptions shortlist;
+        // beams per step, and k of StepTopK, the activation arena is planned for at load; a larger step
+        // plans it again once
+        int max_rows = 5;
+    };
+
+    // Native DecoderWithAttention (AI_module/models.py) for inference, one decode step at a time:
+    // embedding -> attention -> f_beta gate -> LSTMCell -> fc -> log_softmax.
+    // The weights are shared and read-only; the engine owns its activations, one arena laid out by a liveness
+    // plan at load so that a step does not allocate, so use one engine per thread. PrepareImage writes the
+    // per-image buffers (encoder_out, att1, h0, c0, the shortlist) into the caller's ImageFeatures; they only
+    // allocate while that ImageFeatures grows, see ImageFeatures.
+    // decoder_att, f_beta, LSTMCell, init_h/init_c and fc run in INT8 when the weight file has them in
+    // INT8 (export_weights.py --int8), with their inputs quantized per row at every step.
+    class DecoderEngine {
+        public:
+            explicit DecoderEngine(const WeightFile& weights, const DecoderOptions& options = DecoderOptions())
+                : options_(options) {
+                Bind(weights);
+                const int rows = std::max(1, options.max_rows);
+                PlanMemory(rows, std::min(rows, dims_.vocab_size));
+            }
+            ~DecoderEngine() = default;
+
+            const DecoderDims& dims() const { return dims_; }
+            const DecoderOptions& options() const { return options_; }
+            const ShortlistStats& shortlist_stats() const { return shortlist_stats_; }
+
+            // Peak activation memory of the engine: bytes of its arena, and of the same buffers without sharing
+            size_t activation_bytes() const { return plan_.size(); }
+            size_t unshared_activation_bytes() const { return plan_.unshared(); }
+
+            // Applies to the images prepared from now on, and resets the statistics
+            void SetShortlist(const ShortlistOptions& options) {
+                const int V = dims_.vocab_size;
+                if (options.image_words < 0 || options.frequent_words < 0 || !(options.tolerance >= 0.0f)) {
+                    throw std::invalid_argument("Shortlist sizes and tolerance must not be negative");
+                }
+                for (int w : options.words) {
+                    if (w < 0 || w >= V) {
+                        throw std::invalid_argument("Shortlist word out of the vocabulary");
+                    }
+                }
+                options_.shortlist = options;
+                shortlist_stats_ = ShortlistStats();
+
+                // the fc bias is the log-prior of every word
+                BestWords(fc_b_, std::min(options.frequent_words, V), &frequent_);
+                // the clusters of the guard only depend on fc, built the first time they are needed
+                if (options.mode == ShortlistMode::Guarded && clusters_.empty()) {
+                    clusters_.Build(fc_, V, dims_.decoder_dim, WordClusters::DefaultCount(V));
+                }
+                // the shortlist of an image is at most its best words, the words of the options and frequent_
+                shortlist_words_.reserve(std::min(options.image_words, V) + options.words.size() + frequent_.size());
+            }
+
+            void PrepareImage(const float* encoder_out, int num_pixels, ImageFeatures* image) {
+                const int E = dims_.encoder_dim;
+                const int D = dims_.decoder_dim;
+
+                image->num_pixels = num_pixels;
+                image->encoder_out.assign(encoder_out, encoder_out + static_cast<size_t>(num_pixels) * E);
+
+                // encoder_att only depends on the image, every beam of every step reuses it
+                image->att1.resize(static_cast<size_t>(num_pixels) * dims_.attention_dim);
+                Linear(encoder_out, num_pixels, E, encoder_att_w_, encoder_att_b_, dims_.attention_dim, image->att1.data());
+
+                float* mean = mean_;
+                std::fill(mean, mean + E, 0.0f);
+                for (int p = 0; p < num_pixels; p++) {
+                    const float* row = encoder_out + static_cast<size_t>(p) * E;
+                    for (int e = 0; e < E; e++) {
+                        mean[e] += row[e];
+                    }
+                }
+                for (int e = 0; e < E; e++) {
+                    mean[e] /= num_pixels;
+                }
+                image->h0.resize(D);
+                image->c0.resize(D);
+                in_.Set(mean, 1, E, init_h_.quantized() || init_c_.quantized(), prepare_q_, prepare_scale_);
+                MatMul(in_, init_h_, init_h_b_, D, image->h0.data());
+                MatMul(in_, init_c_, init_c_b_, D, image->c0.data());
+
+                if (options_.shortlist.mode != ShortlistMode::Off) {
+                    BuildShortlist(image);
+                }
+            }
+
+            // One decode step for `rows` beams, row r continues words[r] with state (h[r], c[r]) and attends
+            // to images[r]. Writes the new state, log_softmax over the vocabulary and, if alpha is not null,
+            // the attention weights (rows, num_pixels). Output buffers must not alias the inputs.
+            void Step(const ImageFeatures* const* images, const int* words, const float* h, const float* c, int rows,
+                      float* h_out, float* c_out, float* log_probs, float* alpha = nullptr) {
+                Reserve(rows, 1);
+                UpdateState(images, words, h, c, rows, h_out, c_out, alpha);
+
+                // scores over the vocabulary
+                out_.Set(h_out, rows, dims_.decoder_dim, fc_.quantized(), out_q_, out_scale_);
+                MatMul(out_, fc_, fc_b_, dims_.vocab_size, log_probs);
+                for (int r = 0; r < rows; r++) {
+                    LogSoftmax(log_probs + static_cast<size_t>(r) * dims_.vocab_size, dims_.vocab_size);
+                }
+            }
+
+            // Step for beam search: instead of the whole log_softmax, writes the k most likely next words of
+            // every row to candidates (rows, k), best first, with index = word and score = log-probability.
+            // fc, log_softmax and the selection run fused, see OutputTopK.
+            void StepTopK(const ImageFeatures* const* images, const int* words, const float* h, const float* c, int rows,
+                          float* h_out, float* c_out, int k, Candidate* candidates) {
+                if (k < 1 || k > dims_.vocab_size) {
+                    throw std::invalid_argument("StepTopK needs 1 <= k <= vocab_size");
+                }
+                Reserve(rows, k);
+                UpdateState(images, words, h, c, rows, h_out, c_out, nullptr);
+                if (options_.shortlist.mode == ShortlistMode::Off) {
+                    out_.Set(h_out, rows, dims_.decoder_dim, fc_.quantized(), out_q_, out_scale_);
+                    output_.Run(out_, fc_, fc_b_, dims_.vocab_size, k, candidates);
+                    return;
+                }
+
+                // consecutive rows of the same image share its shortlist
+                for (int r = 0; r < rows;) {
+                    int n = 1;
+                    while (r + n < rows && images[r + n] == images[r]) {
+                        n++;
+                    }
+                    ShortlistTopK(images[r]->shortlist, h_out + static_cast<size_t>(r) * dims_.decoder_dim, n, k,
+                                  candidates + static_cast<size_t>(r) * k);
+                    r += n;
+                }
+            }
+
+        private:
+            DecoderOptions options_;
+            DecoderDims dims_;
+            const float* embedding_;
+            const float* encoder_att_w_;
+            const float* encoder_att_b_;
+            const float* full_att_w_;
+            float full_att_b_;
+            Matrix w_ih_;
+            std::vector<float> lstm_bias_;
+            std::vector<float> gate_table_;
+            std::vector<uint16_t> gate_table_half_;
+            Matrix init_h_;
+            const float* init_h_b_;
+            Matrix init_c_;
+            const float* init_c_b_;
+            // everything that reads h before the update, packed at load time:
+            // rows [decoder_att (A); f_beta (E); W_hh (4D)] of a (A + E + 4D, D) matrix
+            Matrix hidden_w_;
+            std::vector<float> hidden_f32_;
+            std::vector<std::int8_t> hidden_i8_;
+            std::vector<float> hidden_scale_;
+            std::vector<float> hidden_b_;
+            Matrix fc_;
+            const float* fc_b_;
+            WordClusters clusters_;
+            std::vector<int> frequent_;
+            ShortlistStats shortlist_stats_;
+            // scratch of BuildShortlist
+            TopK best_words_;
+            std::vector<Candidate> best_candidates_;
+            std::vector<int> shortlist_words_;
+
+            // Phases of the activations: PrepareImage, then the parts of a decode step in order
+            enum Phase {
+                kPrepare,
+                kEmbed,
+                kHidden,
+                kAttend,
+                kLstmInput,
+                kCell,
+                kOutput,
+            };
+
+            // activations, carved from arena_ by PlanMemory
+            int capacity_rows_ = 0;
+            int capacity_k_ = 0;
+            MemoryPlan plan_;
+            Arena arena_;
+            float* mean_;
+            std::int8_t* prepare_q_;
+            float* prepare_scale_;
+            float* prior_;
+            float* embed_;
+            std::int8_t* embed_q_;
+            float* embed_scale_;
+            float* gates_;
+            std::int8_t* h_q_;
+            float* h_scale_;
+            float* hidden_;
+            float* context_;
+            std::int8_t* context_q_;
+            float* context_scale_;
+            float* gates_context_;
+            std::int8_t* out_q_;
+            float* out_scale_;
+            int* fallback_rows_;
+            float* fallback_h_;
+            Candidate* fallback_candidates_;
+            float* guard_h_;
+            float* guard_bounds_;
+            Activations in_;
+            Activations out_;
+            OutputTopK output_;
+
+            // Attention and LSTMCell of a decode step, everything up to the new state
+            void UpdateState(const ImageFeatures* const* images, const int* words, const float* h, const float* c,
+                             int rows, float* h_out, float* c_out, float* alpha) {
+                const int E = dims_.encoder_dim;
+                const int A = dims_.attention_dim;
+                const int M = dims_.embed_dim;
+                const int D = dims_.decoder_dim;
+
+                // LSTM input is [embedding(word), gate * attention weighted encoding], the embedding part of
+                // the gates comes from the table when there is one
+                for (int r = 0; r < rows; r++) {
+                    float* gates = gates_ + static_cast<size_t>(r) * 4 * D;
+                    const size_t word = static_cast<size_t>(words[r]);
+                    switch (options_.gate_table) {
+                        case GateTable::F32:
+                            std::memcpy(gates, gate_table_.data() + word * 4 * D, sizeof(float) * 4 * D);
+                            break;
+                        case GateTable::F16:
+                            HalfToFloat(gate_table_half_.data() + word * 4 * D, 4 * D, gates);
+                            break;
+                        default:
+                            std::memcpy(embed_ + static_cast<size_t>(r) * M, embedding_ + word * M, sizeof(float) * M);
+                            break;
+                    }
+                }
+                if (options_.gate_table == GateTable::Off) {
+                    in_.Set(embed_, rows, M, w_ih_.quantized(), embed_q_, embed_scale_);
+                    MatMul(in_, w_ih_, lstm_bias_.data(), 4 * D, gates_);
+                }
+
+                // one pass over h for att2 = decoder_att(h), f_beta(h) and W_hh h
+                const int H = A + E + 4 * D;
+                in_.Set(h, rows, D, hidden_w_.quantized(), h_q_, h_scale_);
+                MatMul(in_, hidden_w_, hidden_b_.data(), H, hidden_);
+
+                for (int r = 0; r < rows; r++) {
+                    const ImageFeatures& image = *images[r];
+                    const int P = image.num_pixels;
+
+                    // attention weighted encoding, fused: full_att(relu(att1 + att2)) -> softmax -> weighted sum
+                    float* awe = context_ + static_cast<size_t>(r) * E;
+                    Attend(image.encoder_out.data(), image.att1.data(), P, E, A, hidden_ + static_cast<size_t>(r) * H,
+                           full_att_w_, full_att_b_, awe, alpha ? alpha + static_cast<size_t>(r) * P : nullptr);
+
+                    // gate = sigmoid(f_beta(h))
+                    const float* gate = hidden_ + static_cast<size_t>(r) * H + A;
+                    for (int e = 0; e < E; e++) {
+                        awe[e] *= Sigmoid(gate[e]);
+                    }
+                }
+
+                // LSTMCell, gates in PyTorch order (input, forget, cell, output)
+                in_.Set(context_, rows, E, w_ih_.quantized(), context_q_, context_scale_);
+                MatMul(in_, w_ih_.Columns(M), nullptr, 4 * D, gates_context_);
+                for (int r = 0; r < rows; r++) {
+                    float* gx = gates_ + static_cast<size_t>(r) * 4 * D;
+                    const float* gc = gates_context_ + static_cast<size_t>(r) * 4 * D;
+                    const float* gh = hidden_ + static_cast<size_t>(r) * H + A + E;
+                    for (int j = 0; j < 4 * D; j++) {
+                        gx[j] += gc[j] + gh[j];
+                    }
+                    const float* c_prev = c + static_cast<size_t>(r) * D;
+                    float* c_next = c_out + static_cast<size_t>(r) * D;
+                    float* h_next = h_out + static_cast<size_t>(r) * D;
+                    for (int d = 0; d < D; d++) {
+                        float i = Sigmoid(gx[d]);
+                        float f = Sigmoid(gx[D + d]);
+                        float g = std::tanh(gx[2 * D + d]);
+                        float o = Sigmoid(gx[3 * D + d]);
+                        c_next[d] = f * c_prev[d] + i * g;
+                        h_next[d] = o * std::tanh(c_next[d]);
+                    }
+                }
+            }
+
+            void Bind(const WeightFile& weights) {
+                const Tensor& embedding = weights.Get("embedding.weight");
+                const Tensor& encoder_att = weights.Get("attention.encoder_att.weight");
+                const Tensor& fc = weights.Get("fc.weight");
+                if (embedding.dims.size() != 2 || encoder_att.dims.size() != 2 || fc.dims.size() != 2) {
+                    throw std::runtime_error("Unexpected decoder weight shapes");
+                }
+                dims_.vocab_size = embedding.dims[0];
+                dims_.embed_dim = embedding.dims[1];
+                dims_.attention_dim = encoder_att.dims[0];
+                dims_.encoder_dim = encoder_att.dims[1];
+                dims_.decoder_dim = fc.dims[1];
+
+                const int E = dims_.encoder_dim;
+                const int A = dims_.attention_dim;
+                const int M = dims_.embed_dim;
+                const int D = dims_.decoder_dim;
+                const int V = dims_.vocab_size;
+
+                embedding_ = embedding.f32();
+                encoder_att_w_ = encoder_att.f32();
+                encoder_att_b_ = weights.Get("attention.encoder_att.bias", {A}).f32();
+                const Matrix decoder_att_w = GetMatrix(weights, "attention.decoder_att.weight", A, D);
+                const float* decoder_att_b = weights.Get("attention.decoder_att.bias", {A}).f32();
+                full_att_w_ = weights.Get("attention.full_att.weight", {1, A}).f32();
+                full_att_b_ = weights.Get("attention.full_att.bias", {1}).f32()[0];
+                w_ih_ = GetMatrix(weights, "decode_step.weight_ih", 4 * D, M + E);
+                const Matrix w_hh = GetMatrix(weights, "decode_step.weight_hh", 4 * D, D);
+                const float* b_ih = weights.Get("decode_step.bias_ih", {4 * D}).f32();
+                const float* b_hh = weights.Get("decode_step.bias_hh", {4 * D}).f32();
+                init_h_ = GetMatrix(weights, "init_h.weight", D, E);
+                init_h_b_ = weights.Get("init_h.bias", {D}).f32();
+                init_c_ = GetMatrix(weights, "init_c.weight", D, E);
+                init_c_b_ = weights.Get("init_c.bias", {D}).f32();
+                const Matrix f_beta_w = GetMatrix(weights, "f_beta.weight", E, D);
+                const float* f_beta_b = weights.Get("f_beta.bias", {E}).f32();
+                if (fc.dims[0] != V) {
+                    throw std::runtime_error("Vocabulary size of fc and embedding differ");
+                }
+                fc_ = GetMatrix(weights, "fc.weight", V, D);
+                fc_b_ = weights.Get("fc.bias", {V}).f32();
+
+                // both LSTMCell biases are added to the same gates
+                lstm_bias_.resize(4 * D);
+                for (int i = 0; i < 4 * D; i++) {
+                    lstm_bias_[i] = b_ih[i] + b_hh[i];
+                }
+
+                // W_hh has no bias of its own here, b_hh is in lstm_bias_
+                PackHidden({decoder_att_w, f_beta_w, w_hh}, {A, E, 4 * D});
+                hidden_b_.assign(A + E + 4 * D, 0.0f);
+                std::copy(decoder_att_b, decoder_att_b + A, hidden_b_.begin());
+                std::copy(f_beta_b, f_beta_b + E, hidden_b_.begin() + A);
+
+                BuildGateTable();
+                SetShortlist(options_.shortlist);
+            }
+
+            // Image prior fc(init_h(mean(encoder_out))) = fc(h0): its best words, the frequent words and the
+            // words of the options
+            void BuildShortlist(ImageFeatures* image) {
+                const ShortlistOptions& options = options_.shortlist;
+                const int V = dims_.vocab_size;
+                const int n = std::min(options.image_words, V);
+                out_.Set(image->h0.data(), 1, dims_.decoder_dim, fc_.quantized(), prepare_q_, prepare_scale_);
+                MatMul(out_, fc_, fc_b_, V, prior_);
+                std::vector<int>& words = shortlist_words_;
+                BestWords(prior_, n, &words);
+                words.insert(words.end(), options.words.begin(), options.words.end());
+                words.insert(words.end(), frequent_.begin(), frequent_.end());
+                std::sort(words.begin(), words.end());
+                words.erase(std::unique(words.begin(), words.end()), words.end());
+                image->shortlist.Build(fc_, fc_b_, options.mode == ShortlistMode::Guarded ? &clusters_ : nullptr, V,
+                                       dims_.decoder_dim, words);
+            }
+
+            // The n words of the highest scores, in the reused best_words_ and best_candidates_
+            void BestWords(const float* scores, int n, std::vector<int>* words) {
+                words->clear();
+                if (n <= 0) {
+                    return;
+                }
+                best_words_.Reset(n);
+                best_words_.Scan(scores, dims_.vocab_size, 0.0f, 0);
+                best_candidates_.resize(n);
+                words->resize(best_words_.Sorted(best_candidates_.data()));
+                for (size_t i = 0; i < words->size(); i++) {
+                    (*words)[i] = best_candidates_[i].index;
+                }
+            }
+
+            // StepTopK output of `rows` rows of one image over its shortlist; Guarded redoes the rows the
+            // shortlist cannot vouch for over the whole vocabulary
+            void ShortlistTopK(const Shortlist& shortlist, const float* h, int rows, int k, Candidate* candidates) {
+                const int D = dims_.decoder_dim;
+                const int V = dims_.vocab_size;
+                out_.Set(h, rows, D, fc_.quantized(), out_q_, out_scale_);
+                if (shortlist.empty() || k > shortlist.size()) {
+                    output_.Run(out_, fc_, fc_b_, V, k, candidates);
+                    return;
+                }
+                output_.Run(out_, shortlist.weight(), shortlist.bias(), shortlist.size(), k, candidates, shortlist.words());
+                shortlist_stats_.rows += rows;
+                if (options_.shortlist.mode != ShortlistMode::Guarded) {
+                    return;
+                }
+
+                int n = 0;
+                for (int r = 0; r < rows; r++) {
+                    const float* hr = h + static_cast<size_t>(r) * D;
+                    const std::int8_t* qr = out_q_ + static_cast<size_t>(r) * D;
+                    // the guard bounds the logits fc computes, from the quantized row for INT8 weights
+                    if (fc_.quantized()) {
+                        for (int i = 0; i < D; i++) {
+                            guard_h_[i] = out_scale_[r] * qr[i];
+                        }
+                        hr = guard_h_;
+                    }
+                    auto logit = [&](int w) {
+                        const size_t row = static_cast<size_t>(w) * fc_.ld;
+                        return fc_.quantized() ? DotI8(fc_.i8 + row, qr, D) * out_scale_[r] * fc_.scale[w]
+                                               : Dot(fc_.f32 + row, hr, D);
+                    };
+                    const float lse = output_.lse(r);
+                    const float last = candidates[static_cast<size_t>(r) * k + k - 1].score + lse;
+                    if (!shortlist.Covers(clusters_, hr, lse, last, options_.shortlist.tolerance, V / kGuardBudgetDivisor,
+                                          guard_bounds_, logit, &shortlist_stats_.exact_words)) {
+                        fallback_rows_[n++] = r;
+                    }
+                }
+                if (n == 0) {
+                    return;
+                }
+                shortlist_stats_.fallbacks += n;
+                for (int j = 0; j < n; j++) {
+                    std::memcpy(fallback_h_ + static_cast<size_t>(j) * D, h + static_cast<size_t>(fallback_rows_[j]) * D,
+                                sizeof(float) * D);
+                }
+                out_.Set(fallback_h_, n, D, fc_.quantized(), out_q_, out_scale_);
+                output_.Run(out_, fc_, fc_b_, V, k, fallback_candidates_);
+                for (int j = 0; j < n; j++) {
+                    std::copy(fallback_candidates_ + static_cast<size_t>(j) * k,
+                              fallback_candidates_ + static_cast<size_t>(j + 1) * k,
+                              candidates + static_cast<size_t>(fallback_rows_[j]) * k);
+                }
+            }
+
+            // A Linear weight (out, in), float32 or INT8 with its per-channel scales
+            static Matrix GetMatrix(const WeightFile& weights, const std::string& name, int out, int in) {
+                Matrix m;
+                m.ld = in;
+                if (weights.Get(name).dtype == DType::I8) {
+                    m.i8 = weights.Get(name, {out, in}, DType::I8).i8();
+                    m.scale = weights.Get(name + ".scale", {out}).f32();
+                } else {
+                    m.f32 = weights.Get(name, {out, in}).f32();
+                }
+                return m;
+            }
+
+            // Stacks the rows of weights with the same input size into hidden_w_, all float32 or all INT8
+            void PackHidden(std::initializer_list<Matrix> parts, std::initializer_list<int> rows) {
+                const int D = dims_.decoder_dim;
+                const bool quantized = parts.begin()->quantized();
+                auto r = rows.begin();
+                for (const Matrix& part : parts) {
+                    if (part.quantized() != quantized) {
+                        throw std::runtime_error("decoder_att, f_beta and W_hh must all be float32 or all INT8");
+                    }
+                    const size_t n = static_cast<size_t>(*r++);
+                    if (quantized) {
+                        hidden_i8_.insert(hidden_i8_.end(), part.i8, part.i8 + n * D);
+                        hidden_scale_.insert(hidden_scale_.end(), part.scale, part.scale + n);
+                    } else {
+                        hidden_f32_.insert(hidden_f32_.end(), part.f32, part.f32 + n * D);
+                    }
+                }
+                hidden_w_ = Matrix();
+                hidden_w_.ld = D;
+                if (quantized) {
+                    hidden_w_.i8 = hidden_i8_.data();
+                    hidden_w_.scale = hidden_scale_.data();
+                } else {
+                    hidden_w_.f32 = hidden_f32_.data();
+                }
+            }
+
+            void BuildGateTable() {
+                const int M = dims_.embed_dim;
+                const int G = 4 * dims_.decoder_dim;
+                const int V = dims_.vocab_size;
+                if (options_.gate_table == GateTable::Off) {
+                    return;
+                }
+
+                // a block of words at a time, the float16 table goes through a float buffer
+                const int block = 256;
+                std::vector<float> rows;
+                if (options_.gate_table == GateTable::F32) {
+                    gate_table_.resize(static_cast<size_t>(V) * G);
+                } else {
+                    rows.resize(static_cast<size_t>(block) * G);
+                    gate_table_half_.resize(static_cast<size_t>(V) * G);
+                }
+                Activations x;
+                for (int w = 0; w < V; w += block) {
+                    const int n = std::min(block, V - w);
+                    float* y = options_.gate_table == GateTable::F32 ? gate_table_.data() + static_cast<size_t>(w) * G : rows.data();
+                    x.Set(embedding_ + static_cast<size_t>(w) * M, n, M, w_ih_.quantized());
+                    MatMul(x, w_ih_, lstm_bias_.data(), G, y);
+                    if (options_.gate_table == GateTable::F16) {
+                        for (size_t i = 0; i < static_cast<size_t>(n) * G; i++) {
+                            gate_table_half_[static_cast<size_t>(w) * G + i] = FloatToHalf(rows[i]);
+                        }
+                    }
+                }
+            }
+
+            void Reserve(int rows, int k) {
+                if (rows > capacity_rows_ || k > capacity_k_) {
+                    PlanMemory(std::max(rows, capacity_rows_), std::max(k, capacity_k_));
+                }
+            }
+
+            // Lays out every activation of PrepareImage and of a step of `rows` rows with k candidates in one
+            // arena: each buffer is live over a range of phases, the buffers of disjoint ranges share memory
+            void PlanMemory(int rows, int k) {
+                const size_t R = static_cast<size_t>(rows);
+                const size_t E = dims_.encoder_dim;
+                const size_t D = dims_.decoder_dim;
+                const size_t M = dims_.embed_dim;
+                const size_t H = dims_.attention_dim + E + 4 * D;
+                const size_t V = dims_.vocab_size;
+                const bool embed = options_.gate_table == GateTable::Off;
+                const bool prepare_i8 = init_h_.quantized() || init_c_.quantized() || fc_.quantized();
+                // quantized inputs only for INT8 weights
+                auto q = [](bool quantized, size_t n) { return quantized ? n : 0; };
+                const size_t f = sizeof(float);
+
+                plan_ = MemoryPlan();
+                const int mean = plan_.Add(f * E, kPrepare, kPrepare);
+                const int prepare_q = plan_.Add(q(prepare_i8, std::max(E, D)), kPrepare, kPrepare);
+                const int prepare_scale = plan_.Add(q(prepare_i8, f), kPrepare, kPrepare);
+                const int prior = plan_.Add(f * V, kPrepare, kPrepare);
+                const int embed_x = plan_.Add(embed ? f * R * M : 0, kEmbed, kEmbed);
+                const int embed_q = plan_.Add(embed ? q(w_ih_.quantized(), R * M) : 0, kEmbed, kEmbed);
+                const int embed_scale = plan_.Add(embed ? q(w_ih_.quantized(), f * R) : 0, kEmbed, kEmbed);
+                const int gates = plan_.Add(f * R * 4 * D, kEmbed, kCell);
+                const int h_q = plan_.Add(q(hidden_w_.quantized(), R * D), kHidden, kHidden);
+                const int h_scale = plan_.Add(q(hidden_w_.quantized(), f * R), kHidden, kHidden);
+                const int hidden = plan_.Add(f * R * H, kHidden, kCell);
+                const int context = plan_.Add(f * R * E, kAttend, kLstmInput);
+                const int context_q = plan_.Add(q(w_ih_.quantized(), R * E), kLstmInput, kLstmInput);
+                const int context_scale = plan_.Add(q(w_ih_.quantized(), f * R), kLstmInput, kLstmInput);
+                const int gates_context = plan_.Add(f * R * 4 * D, kLstmInput, kCell);
+                const int out_q = plan_.Add(q(fc_.quantized(), R * D), kOutput, kOutput);
+                const int out_scale = plan_.Add(q(fc_.quantized(), f * R), kOutput, kOutput);
+                const int chunk = plan_.Add(f * R * kOutputChunk, kOutput, kOutput);
+                const int fallback_rows = plan_.Add(sizeof(int) * R, kOutput, kOutput);
+                const int fallback_h = plan_.Add(f * R * D, kOutput, kOutput);
+                const int fallback_candidates = plan_.Add(sizeof(Candidate) * R * k, kOutput, kOutput);
+                const int guard_h = plan_.Add(f * D, kOutput, kOutput);
+                const int guard_bounds = plan_.Add(f * WordClusters::DefaultCount(dims_.vocab_size), kOutput, kOutput);
+                plan_.Plan();
+                arena_.Allocate(plan_);
+
+                mean_ = arena_.get<float>(mean);
+                prepare_q_ = arena_.get<std::int8_t>(prepare_q);
+                prepare_scale_ = arena_.get<float>(prepare_scale);
+                prior_ = arena_.get<float>(prior);
+                embed_ = arena_.get<float>(embed_x);
+                embed_q_ = arena_.get<std::int8_t>(embed_q);
+                embed_scale_ = arena_.get<float>(embed_scale);
+                gates_ = arena_.get<float>(gates);
+                h_q_ = arena_.get<std::int8_t>(h_q);
+                h_scale_ = arena_.get<float>(h_scale);
+                hidden_ = arena_.get<float>(hidden);
+                context_ = arena_.get<float>(context);
+                context_q_ = arena_.get<std::int8_t>(context_q);
+                context_scale_ = arena_.get<float>(context_scale);
+                gates_context_ = arena_.get<float>(gates_context);
+                out_q_ = arena_.get<std::int8_t>(out_q);
+                out_scale_ = arena_.get<float>(out_scale);
+                fallback_rows_ = arena_.get<int>(fallback_rows);
+                fallback_h_ = arena_.get<float>(fallback_h);
+                fallback_candidates_ = arena_.get<Candidate>(fallback_candidates);
+                guard_h_ = arena_.get<float>(guard_h);
+                guard_bounds_ = arena_.get<float>(guard_bounds);
+                output_.Reserve(rows, k, arena_.get<float>(chunk));
+                capacity_rows_ = rows;
+                capacity_k_ = k;
+            }
+    };
+}
+
+#endif
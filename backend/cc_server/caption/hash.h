@@ -0,0 +1,104 @@
+#ifndef CAPTION_HASH_H_
+#define CAPTION_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace caption {
+
+    namespace detail {
+        constexpr std::uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+        constexpr std::uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+        constexpr std::uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+        constexpr std::uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+        constexpr std::uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+        inline std::uint64_t RotateLeft(std::uint64_t x, int r) {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        inline std::uint64_t Read64(const std::uint8_t* p) {
+            std::uint64_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline std::uint32_t Read32(const std::uint8_t* p) {
+            std::uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline std::uint64_t XXHRound(std::uint64_t acc, std::uint64_t input) {
+            acc += input * kPrime64_2;
+            acc = RotateLeft(acc, 31);
+            return acc * kPrime64_1;
+        }
+
+        inline std::uint64_t XXHMerge(std::uint64_t acc, std::uint64_t value) {
+            acc ^= XXHRound(0, value);
+            return acc * kPrime64_1 + kPrime64_4;
+        }
+    }
+
+    // XXH64 of Yann Collet's xxHash (little-endian hosts): four independent lanes of 8 bytes, so it runs at
+    // memory speed, with good enough dispersion to key caches by the content of multi-MB files
+    inline std::uint64_t XXHash64(const void* data, size_t size, std::uint64_t seed = 0) {
+        using namespace detail;
+        const std::uint8_t* p = static_cast<const std::uint8_t*>(data);
+        const std::uint8_t* end = p + size;
+        std::uint64_t h;
+
+        if (size >= 32) {
+            std::uint64_t v1 = seed + kPrime64_1 + kPrime64_2;
+            std::uint64_t v2 = seed + kPrime64_2;
+            std::uint64_t v3 = seed;
+            std::uint64_t v4 = seed - kPrime64_1;
+            const std::uint8_t* limit = end - 32;
+            do {
+                v1 = XXHRound(v1, Read64(p));
+                v2 = XXHRound(v2, Read64(p + 8));
+                v3 = XXHRound(v3, Read64(p + 16));
+                v4 = XXHRound(v4, Read64(p + 24));
+                p += 32;
+            } while (p <= limit);
+            h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+            h = XXHMerge(h, v1);
+            h = XXHMerge(h, v2);
+            h = XXHMerge(h, v3);
+            h = XXHMerge(h, v4);
+        } else {
+            h = seed + kPrime64_5;
+        }
+        h += static_cast<std::uint64_t>(size);
+
+        for (; p + 8 <= end; p += 8) {
+            h ^= XXHRound(0, Read64(p));
+            h = RotateLeft(h, 27) * kPrime64_1 + kPrime64_4;
+        }
+        if (p + 4 <= end) {
+            h ^= static_cast<std::uint64_t>(Read32(p)) * kPrime64_1;
+            h = RotateLeft(h, 23) * kPrime64_2 + kPrime64_3;
+            p += 4;
+        }
+        for (; p < end; p++) {
+            h ^= (*p) * kPrime64_5;
+            h = RotateLeft(h, 11) * kPrime64_1;
+        }
+
+        h ^= h >> 33;
+        h *= kPrime64_2;
+        h ^= h >> 29;
+        h *= kPrime64_3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    inline std::uint64_t XXHash64(const std::string& s, std::uint64_t seed = 0) {
+        return XXHash64(s.data(), s.size(), seed);
+    }
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef CAPTION_IMAGE_DECODE_H_
+#define CAPTION_IMAGE_DECODE_H_
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "image_header.h"
+
+namespace caption {
+
+    // 8-bit RGB pixels, rows of width * 3 bytes
+    struct Image {
+        int width = 0;
+        int height = 0;
+        // decoded at 1 / reduction of the size of the file
+        int reduction = 1;
+        std::vector<std::uint8_t> pixels;
+    };
+
+    namespace detail {
+        // libjpeg reports errors through error_exit, which must not return: jump back to DecodeJpeg
+        struct JpegError {
+            jpeg_error_mgr manager;
+            std::jmp_buf jump;
+            char message[JMSG_LENGTH_MAX];
+        };
+
+        inline void JpegErrorExit(j_common_ptr cinfo) {
+            JpegError* error = reinterpret_cast<JpegError*>(cinfo->err);
+            (*cinfo->err->format_message)(cinfo, error->message);
+            std::longjmp(error->jump, 1);
+        }
+
+        inline void JpegOutputMessage(j_common_ptr /*cinfo*/) {}
+    }
+
+    // Grayscale and YCbCr JPEGs come out as RGB, like imageio's imread of demo.py; the EXIF orientation is
+    // ignored there too. With min_side > 0, large images are decoded at 1/2, 1/4 or 1/8 scale, the smallest
+    // that keeps the short side at least min_side: libjpeg then runs a reduced IDCT on every block and skips
+    // most of the work of a full decode.
+    inline void DecodeJpeg(const std::uint8_t* data, size_t size, Image* image, int min_side = 0) {
+        jpeg_decompress_struct cinfo;
+        detail::JpegError error;
+        cinfo.err = jpeg_std_error(&error.manager);
+        error.manager.error_exit = detail::JpegErrorExit;
+        error.manager.output_message = detail::JpegOutputMessage;
+        if (setjmp(error.jump)) {
+            jpeg_destroy_decompress(&cinfo);
+            throw std::runtime_error(std::string("JPEG decode failed: ") + error.message);
+        }
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), static_cast<unsigned long>(size));
+        jpeg_read_header(&cinfo, TRUE);
+        if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+            jpeg_destroy_decompress(&cinfo);
+            throw std::runtime_error("CMYK JPEGs are not supported");
+        }
+        cinfo.out_color_space = JCS_RGB;
+        if (min_side > 0) {
+            const unsigned int side = std::min(cinfo.image_width, cinfo.image_height);
+            cinfo.scale_num = 1;
+            cinfo.scale_denom = 1;
+            for (unsigned int denom = 8; denom > 1; denom /= 2) {
+                if ((side + denom - 1) / denom >= static_cast<unsigned int>(min_side)) {
+                    cinfo.scale_denom = denom;
+                    break;
+                }
+            }
+        }
+        jpeg_start_decompress(&cinfo);
+
+        image->reduction = static_cast<int>(cinfo.scale_denom / cinfo.scale_num);
+        image->width = static_cast<int>(cinfo.output_width);
+        image->height = static_cast<int>(cinfo.output_height);
+        image->pixels.resize(static_cast<size_t>(image->width) * image->height * 3);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JSAMPROW row = image->pixels.data() + static_cast<size_t>(cinfo.output_scanline) * image->width * 3;
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+    }
+
+    namespace detail {
+        struct PngSource {
+            const std::uint8_t* data;
+            size_t size;
+            size_t offset;
+            char message[128];
+        };
+
+        inline void PngRead(png_structp png, png_bytep out, png_size_t n) {
+            PngSource* source = static_cast<PngSource*>(png_get_io_ptr(png));
+            if (n > source->size - source->offset) {
+                png_error(png, "truncated file");
+            }
+            std::memcpy(out, source->data + source->offset, n);
+            source->offset += n;
+        }
+
+        inline void PngError(png_structp png, png_const_charp message) {
+            PngSource* source = static_cast<PngSource*>(png_get_error_ptr(png));
+            std::snprintf(source->message, sizeof(source->message), "%s", message);
+            png_longjmp(png, 1);
+        }
+
+        inline void PngWarning(png_structp /*png*/, png_const_charp /*message*/) {}
+    }
+
+    // Palette, grayscale and 16-bit PNGs come out as 8-bit RGB without gamma correction, the alpha channel
+    // is dropped
+    inline void DecodePng(const std::uint8_t* data, size_t size, Image* image) {
+        detail::PngSource source = {data, size, 0, ""};
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &source, detail::PngError, detail::PngWarning);
+        png_infop info = png ? png_create_info_struct(png) : nullptr;
+        if (!info) {
+            png_destroy_read_struct(&png, nullptr, nullptr);
+            throw std::runtime_error("PNG decode failed: out of memory");
+        }
+        std::vector<png_bytep> rows;
+        if (setjmp(png_jmpbuf(png))) {
+            png_destroy_read_struct(&png, &info, nullptr);
+            throw std::runtime_error(std::string("PNG decode failed: ") + source.message);
+        }
+
+        png_set_read_fn(png, &source, detail::PngRead);
+        png_read_info(png, info);
+        png_set_expand(png);
+        png_set_scale_16(png);
+        png_set_strip_alpha(png);
+        png_set_gray_to_rgb(png);
+        png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+
+        image->reduction = 1;
+        image->width = static_cast<int>(png_get_image_width(png, info));
+        image->height = static_cast<int>(png_get_image_height(png, info));
+        image->pixels.resize(static_cast<size_t>(image->width) * image->height * 3);
+        rows.resize(image->height);
+        for (int y = 0; y < image->height; y++) {
+            rows[y] = image->pixels.data() + static_cast<size_t>(y) * image->width * 3;
+        }
+        png_read_image(png, rows.data());
+        png_read_end(png, nullptr);
+        png_destroy_read_struct(&png, &info, nullptr);
+    }
+
+    // JPEG or PNG file in memory to RGB; throws std::runtime_error for anything else or beyond limits, checked
+    // on the header before any pixel is allocated. min_side: see DecodeJpeg
+    inline void DecodeImage(const std::uint8_t* data, size_t size, Image* image, int min_side = 0,
+                            const ImageLimits& limits = ImageLimits()) {
+        ImageHeader header;
+        const HeaderStatus status = CheckImageHeader(data, size, limits, &header);
+        if (status != HeaderStatus::Ok) {
+            throw std::runtime_error(HeaderMessage(status));
+        }
+        if (header.format == ImageFormat::Jpeg) {
+            DecodeJpeg(data, size, image, min_side);
+        } else {
+            DecodePng(data, size, image);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef CAPTION_IMAGE_HEADER_H_
+#define CAPTION_IMAGE_HEADER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+namespace caption {
+
+    enum class ImageFormat {
+        Unknown,
+        Jpeg,
+        Png,
+    };
+
+    // Format from the signature of the file
+    inline ImageFormat SniffFormat(const std::uint8_t* data, size_t size) {
+        static const std::uint8_t png[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        if (size >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff) {
+            return ImageFormat::Jpeg;
+        }
+        if (size >= 8 && std::equal(png, png + 8, data)) {
+            return ImageFormat::Png;
+        }
+        return ImageFormat::Unknown;
+    }
+
+    // What the container header says, without decoding any pixel
+    struct ImageHeader {
+        ImageFormat format = ImageFormat::Unknown;
+        int width = 0;
+        int height = 0;
+        // color channels stored in the file, alpha included
+        int channels = 0;
+    };
+
+    // Largest image accepted for captioning. Every upload is shrunk to 256 x 256, so these only have to
+    // cover real photos; a file of a few kilobytes can declare billions of pixels (a decompression bomb),
+    // which would only be found out after allocating them.
+    struct ImageLimits {
+        // about a 60 megapixel camera, 180 MB of RGB once decoded
+        long long max_pixels = 60000000;
+        int max_side = 16384;
+        // size of the file itself
+        size_t max_bytes = 32 * 1024 * 1024;
+    };
+
+    enum class HeaderStatus {
+        Ok,
+        // neither a JPEG nor a PNG
+        UnknownFormat,
+        // a JPEG or PNG the decoders do not read: lossless, hierarchical or 12-bit JPEG, CMYK
+        UnsupportedEncoding,
+        // the file ends before the header does
+        Truncated,
+        // the header is inconsistent or declares an empty image
+        Malformed,
+        // beyond ImageLimits
+        TooLarge,
+    };
+
+    inline const char* HeaderMessage(HeaderStatus status) {
+        switch (status) {
+            case HeaderStatus::Ok:
+                return "OK";
+            case HeaderStatus::UnknownFormat:
+                return "Not a JPEG or PNG image";
+            case HeaderStatus::UnsupportedEncoding:
+                return "Unsupported JPEG or PNG encoding";
+            case HeaderStatus::Truncated:
+                return "Truncated image header";
+            case HeaderStatus::Malformed:
+                return "Malformed image header";
+            case HeaderStatus::TooLarge:
+                return "Image too large";
+            default:
+                return "";
+        }
+    }
+
+    namespace detail {
+        inline std::uint32_t ReadBigEndian16(const std::uint8_t* p) {
+            return (static_cast<std::uint32_t>(p[0]) << 8) | p[1];
+        }
+
+        inline std::uint32_t ReadBigEndian32(const std::uint8_t* p) {
+            return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+                   (static_cast<std::uint32_t>(p[2]) << 8) | p[3];
+        }
+
+        // CRC-32 of PNG chunks, bit by bit: it only ever covers the 17 bytes of IHDR here
+        inline std::uint32_t Crc32(const std::uint8_t* data, size_t size) {
+            std::uint32_t crc = 0xffffffffu;
+            for (size_t i = 0; i < size; i++) {
+                crc ^= data[i];
+                for (int k = 0; k < 8; k++) {
+                    crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+                }
+            }
+            return crc ^ 0xffffffffu;
+        }
+
+        // Walks the marker segments up to the frame header (SOFn). Only the segment lengths are read, the
+        // entropy-coded data starts after SOS, which must not come first.
+        inline HeaderStatus ReadJpegHeader(const std::uint8_t* data, size_t size, ImageHeader* header) {
+            size_t i = 2;
+            while (true) {
+                if (i >= size) {
+                    return HeaderStatus::Truncated;
+                }
+                if (data[i] != 0xff) {
+                    return HeaderStatus::Malformed;
+                }
+                // markers may be padded with any number of 0xff
+                while (i < size && data[i] == 0xff) {
+                    i++;
+                }
+                if (i >= size) {
+                    return HeaderStatus::Truncated;
+                }
+                const std::uint8_t marker = data[i++];
+                if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+                    // TEM and RSTn stand alone
+                    continue;
+                }
+                if (marker == 0x00 || marker == 0xd8 || marker == 0xd9 || marker == 0xda) {
+                    // stuffed byte, second SOI, EOI or scan data before any frame header
+                    return HeaderStatus::Malformed;
+                }
+                if (i + 2 > size) {
+                    return HeaderStatus::Truncated;
+                }
+                const size_t length = ReadBigEndian16(data + i);
+                if (length < 2) {
+                    return HeaderStatus::Malformed;
+                }
+
+                // SOF0..SOF15 except DHT (c4), JPG (c8) and DAC (cc)
+                const bool frame = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+                if (frame) {
+                    if (length < 8) {
+                        return HeaderStatus::Malformed;
+                    }
+                    if (i + 8 > size) {
+                        return HeaderStatus::Truncated;
+                    }
+                    const std::uint8_t* sof = data + i + 2;
+                    header->format = ImageFormat::Jpeg;
+                    header->height = static_cast<int>(ReadBigEndian16(sof + 1));
+                    header->width = static_cast<int>(ReadBigEndian16(sof + 3));
+                    header->channels = sof[5];
+                    if (length != 8 + 3 * static_cast<size_t>(header->channels)) {
+                        return HeaderStatus::Malformed;
+                    }
+                    // sequential and progressive DCT, Huffman or arithmetic coded, with 8-bit samples; gray or
+                    // YCbCr, as DecodeJpeg and imageio read them. Lossless and hierarchical frames are not read.
+                    // A height of 0 defers it to a DNL marker, which libjpeg rejects.
+                    const bool dct = marker <= 0xc2 || (marker >= 0xc9 && marker <= 0xca);
+                    if (!dct || sof[0] != 8 || (header->channels != 1 && header->channels != 3)) {
+                        return HeaderStatus::UnsupportedEncoding;
+                    }
+                    if (header->width == 0 || header->height == 0) {
+                        return HeaderStatus::Malformed;
+                    }
+                    return HeaderStatus::Ok;
+                }
+                i += length;
+            }
+        }
+
+        // The IHDR chunk has to come right after the signature
+        inline HeaderStatus ReadPngHeader(const std::uint8_t* data, size_t size, ImageHeader* header) {
+            // signature, chunk length and type, 13 bytes of IHDR and its CRC
+            if (size < 33) {
+                return HeaderStatus::Truncated;
+            }
+            const std::uint8_t* chunk = data + 8;
+            if (ReadBigEndian32(chunk) != 13 || !std::equal(chunk + 4, chunk + 8, "IHDR")) {
+                return HeaderStatus::Malformed;
+            }
+            if (Crc32(chunk + 4, 17) != ReadBigEndian32(chunk + 21)) {
+                return HeaderStatus::Malformed;
+            }
+            const std::uint8_t* ihdr = chunk + 8;
+            const std::uint32_t width = ReadBigEndian32(ihdr);
+            const std::uint32_t height = ReadBigEndian32(ihdr + 4);
+            const int depth = ihdr[8];
+            const int color = ihdr[9];
+            if (width == 0 || height == 0 || width > 0x7fffffffu || height > 0x7fffffffu) {
+                return HeaderStatus::Malformed;
+            }
+
+            // bit depths allowed for each color type
+            bool valid = false;
+            switch (color) {
+                case 0:
+                    header->channels = 1;
+                    valid = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+                    break;
+                case 3:
+                    header->channels = 1;
+                    valid = depth == 1 || depth == 2 || depth == 4 || depth == 8;
+                    break;
+                case 2:
+                case 4:
+                case 6:
+                    header->channels = color == 2 ? 3 : (color == 4 ? 2 : 4);
+                    valid = depth == 8 || depth == 16;
+                    break;
+                default:
+                    break;
+            }
+            if (!valid || ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] > 1) {
+                return HeaderStatus::Malformed;
+            }
+            header->format = ImageFormat::Png;
+            header->width = static_cast<int>(width);
+            header->height = static_cast<int>(height);
+            return HeaderStatus::Ok;
+        }
+    }
+
+    // Format and size of a JPEG or PNG file from its header alone; reads a few hundred bytes at most, past
+    // the JPEG segments before the frame header
+    inline HeaderStatus ReadImageHeader(const std::uint8_t* data, size_t size, ImageHeader* header) {
+        *header = ImageHeader();
+        switch (SniffFormat(data, size)) {
+            case ImageFormat::Jpeg:
+                return detail::ReadJpegHeader(data, size, header);
+            case ImageFormat::Png:
+                return detail::ReadPngHeader(data, size, header);
+            default:
+                return HeaderStatus::UnknownFormat;
+        }
+    }
+
+    // ReadImageHeader, then the limits on the file and the pixels it declares
+    inline HeaderStatus CheckImageHeader(const std::uint8_t* data, size_t size, const ImageLimits& limits,
+                                         ImageHeader* header) {
+        if (size > limits.max_bytes) {
+            *header = ImageHeader();
+            return HeaderStatus::TooLarge;
+        }
+        const HeaderStatus status = ReadImageHeader(data, size, header);
+        if (status != HeaderStatus::Ok) {
+            return status;
+        }
+        if (header->width > limits.max_side || header->height > limits.max_side ||
+            static_cast<long long>(header->width) * header->height > limits.max_pixels) {
+            return HeaderStatus::TooLarge;
+        }
+        return HeaderStatus::Ok;
+    }
+}
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef CAPTION_KERNELS_H_
+#define CAPTION_KERNELS_H_
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__AVX512F__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace caption {
+
+    // CPU kernels of the native decoder. The SIMD path is picked at compile time (-mavx2 -mfma,
+    // -mavx512f or -march=native), the scalar loops are the reference and the fallback. The float AVX2
+    // loops need FMA as well, -mavx2 alone keeps them scalar.
+
+    // Output rows of the weight matrix processed together; with up to kRowTile batch rows that tile
+    // (kWeightTile x in floats) stays in L1/L2 and is reused by every batch row before moving on,
+    // so each weight is read from memory once per decode step however many beams there are.
+    constexpr int kWeightTile = 4;
+    constexpr int kRowTile = 2;
+
+#if defined(__AVX512F__)
+    inline float HorizontalSum(__m512 v) {
+        return _mm512_reduce_add_ps(v);
+    }
+#endif
+
+#if defined(__AVX2__)
+    inline float HorizontalSum(__m256 v) {
+        __m128 lo = _mm256_castps256_ps128(v);
+        __m128 hi = _mm256_extractf128_ps(v, 1);
+        lo = _mm_add_ps(lo, hi);
+        lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+        lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+        return _mm_cvtss_f32(lo);
+    }
+#endif
+
+    inline float Dot(const float* a, const float* b, int n) {
+        int i = 0;
+        float sum = 0.0f;
+#if defined(__AVX512F__)
+        __m512 acc = _mm512_setzero_ps();
+        for (; i + 16 <= n; i += 16) {
+            acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc);
+        }
+        sum = HorizontalSum(acc);
+#elif defined(__AVX2__) && defined(__FMA__)
+        __m256 acc = _mm256_setzero_ps();
+        for (; i + 8 <= n; i += 8) {
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+        }
+        sum = HorizontalSum(acc);
+#endif
+        for (; i < n; i++) {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    // 4 weight rows (ldw floats apart) x 2 batch rows of dot products sharing every load
+    inline void DotTile(const float* w, int ldw, int in, const float* x0, const float* x1, float* out0, float* out1) {
+        const float* w0 = w;
+        const float* w1 = w + ldw;
+        const float* w2 = w + 2 * static_cast<size_t>(ldw);
+        const float* w3 = w + 3 * static_cast<size_t>(ldw);
+        int i = 0;
+        float s[2][kWeightTile] = {{0.0f}};
+#if defined(__AVX512F__)
+        __m512 a00 = _mm512_setzero_ps(), a01 = _mm512_setzero_ps(), a02 = _mm512_setzero_ps(), a03 = _mm512_setzero_ps();
+        __m512 a10 = _mm512_setzero_ps(), a11 = _mm512_setzero_ps(), a12 = _mm512_setzero_ps(), a13 = _mm512_setzero_ps();
+        for (; i + 16 <= in; i += 16) {
+            __m512 v0 = _mm512_loadu_ps(x0 + i);
+            __m512 v1 = _mm512_loadu_ps(x1 + i);
+            __m512 r = _mm512_loadu_ps(w0 + i);
+            a00 = _mm512_fmadd_ps(r, v0, a00);
+            a10 = _mm512_fmadd_ps(r, v1, a10);
+            r = _mm512_loadu_ps(w1 + i);
+            a01 = _mm512_fmadd_ps(r, v0, a01);
+            a11 = _mm512_fmadd_ps(r, v1, a11);
+            r = _mm512_loadu_ps(w2 + i);
+            a02 = _mm512_fmadd_ps(r, v0, a02);
+            a12 = _mm512_fmadd_ps(r, v1, a12);
+            r = _mm512_loadu_ps(w3 + i);
+            a03 = _mm512_fmadd_ps(r, v0, a03);
+            a13 = _mm512_fmadd_ps(r, v1, a13);
+        }
+        s[0][0] = HorizontalSum(a00); s[0][1] = HorizontalSum(a01); s[0][2] = HorizontalSum(a02); s[0][3] = HorizontalSum(a03);
+        s[1][0] = HorizontalSum(a10); s[1][1] = HorizontalSum(a11); s[1][2] = HorizontalSum(a12); s[1][3] = HorizontalSum(a13);
+#elif defined(__AVX2__) && defined(__FMA__)
+        __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps(), a02 = _mm256_setzero_ps(), a03 = _mm256_setzero_ps();
+        __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps(), a12 = _mm256_setzero_ps(), a13 = _mm256_setzero_ps();
+        for (; i + 8 <= in; i += 8) {
+            __m256 v0 = _mm256_loadu_ps(x0 + i);
+            __m256 v1 = _mm256_loadu_ps(x1 + i);
+            __m256 r = _mm256_loadu_ps(w0 + i);
+            a00 = _mm256_fmadd_ps(r, v0, a00);
+            a10 = _mm256_fmadd_ps(r, v1, a10);
+            r = _mm256_loadu_ps(w1 + i);
+            a01 = _mm256_fmadd_ps(r, v0, a01);
+            a11 = _mm256_fmadd_ps(r, v1, a11);
+            r = _mm256_loadu_ps(w2 + i);
+            a02 = _mm256_fmadd_ps(r, v0, a02);
+            a12 = _mm256_fmadd_ps(r, v1, a12);
+            r = _mm256_loadu_ps(w3 + i);
+            a03 = _mm256_fmadd_ps(r, v0, a03);
+            a13 = _mm256_fmadd_ps(r, v1, a13);
+        }
+        s[0][0] = HorizontalSum(a00); s[0][1] = HorizontalSum(a01); s[0][2] = HorizontalSum(a02); s[0][3] = HorizontalSum(a03);
+        s[1][0] = HorizontalSum(a10); s[1][1] = HorizontalSum(a11); s[1][2] = HorizontalSum(a12); s[1][3] = HorizontalSum(a13);
+#endif
+        for (; i < in; i++) {
+            s[0][0] += w0[i] * x0[i]; s[0][1] += w1[i] * x0[i]; s[0][2] += w2[i] * x0[i]; s[0][3] += w3[i] * x0[i];
+            s[1][0] += w0[i] * x1[i]; s[1][1] += w1[i] * x1[i]; s[1][2] += w2[i] * x1[i]; s[1][3] += w3[i] * x1[i];
+        }
+        for (int j = 0; j < kWeightTile; j++) {
+            out0[j] = s[0][j];
+            out1[j] = s[1][j];
+        }
+    }
+
+    // y[r, o] = bias[o] + sum_i weight[o, i] * x[r, i] for r < rows, the nn.Linear layout:
+    // weight is [out, in] row-major with row stride ldw (a column slice of a wider matrix when ldw > in),
+    // x is [rows, in] and y is [rows, out] with row stride ldy
+    inline void Linear(const float* x, int rows, int in, const float* weight, int ldw, const float* bias, int out,
+                       float* y, int ldy) {
+        float tile[kRowTile][kWeightTile];
+        int o = 0;
+        for (; o + kWeightTile <= out; o += kWeightTile) {
+            const float* w = weight + static_cast<size_t>(o) * ldw;
+            int r = 0;
+            for (; r + kRowTile <= rows; r += kRowTile) {
+                DotTile(w, ldw, in, x + static_cast<size_t>(r) * in, x + static_cast<size_t>(r + 1) * in, tile[0], tile[1]);
+                for (int j = 0; j < kWeightTile; j++) {
+                    float b = bias ? bias[o + j] : 0.0f;
+                    y[static_cast<size_t>(r) * ldy + o + j] = tile[0][j] + b;
+                    y[static_cast<size_t>(r + 1) * ldy + o + j] = tile[1][j] + b;
+                }
+            }
+            if (r < rows) {
+                // odd batch row: run the tile with the row twice and keep one result
+                const float* xr = x + static_cast<size_t>(r) * in;
+                DotTile(w, ldw, in, xr, xr, tile[0], tile[1]);
+                for (int j = 0; j < kWeightTile; j++) {
+                    y[static_cast<size_t>(r) * ldy + o + j] = tile[0][j] + (bias ? bias[o + j] : 0.0f);
+                }
+            }
+        }
+        for (; o < out; o++) {
+            const float* w = weight + static_cast<size_t>(o) * ldw;
+            for (int r = 0; r < rows; r++) {
+                y[static_cast<size_t>(r) * ldy + o] = Dot(w, x + static_cast<size_t>(r) * in, in) + (bias ? bias[o] : 0.0f);
+            }
+        }
+    }
+
+    inline void Linear(const float* x, int rows, int in, const float* weight, const float* bias, int out,
+                       float* y, int ldy) {
+        Linear(x, rows, in, weight, in, bias, out, y, ldy);
+    }
+
+    inline void Linear(const float* x, int rows, int in, const float* weight, const float* bias, int out, float* y) {
+        Linear(x, rows, in, weight, in, bias, out, y, out);
+    }
+
+    // sum_i w[i] * max(a[i] + b[i], 0)
+    inline float ReluDot(const float* a, const float* b, const float* w, int n) {
+        int i = 0;
+        float sum = 0.0f;
+#if defined(__AVX512F__)
+        __m512 acc = _mm512_setzero_ps();
+        const __m512 zero = _mm512_setzero_ps();
+        for (; i + 16 <= n; i += 16) {
+            __m512 v = _mm512_max_ps(_mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)), zero);
+            acc = _mm512_fmadd_ps(_mm512_loadu_ps(w + i), v, acc);
+        }
+        sum = HorizontalSum(acc);
+#elif defined(__AVX2__) && defined(__FMA__)
+        __m256 acc = _mm256_setzero_ps();
+        const __m256 zero = _mm256_setzero_ps();
+        for (; i + 8 <= n; i += 8) {
+            __m256 v = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), zero);
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(w + i), v, acc);
+        }
+        sum = HorizontalSum(acc);
+#endif
+        for (; i < n; i++) {
+            sum += w[i] * std::max(a[i] + b[i], 0.0f);
+        }
+        return sum;
+    }
+
+    // y = scale * y + alpha * x
+    inline void ScaleAxpy(float scale, float alpha, const float* x, float* y, int n) {
+        int i = 0;
+#if defined(__AVX512F__)
+        const __m512 s = _mm512_set1_ps(scale);
+        const __m512 a = _mm512_set1_ps(alpha);
+        for (; i + 16 <= n; i += 16) {
+            _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_mul_ps(s, _mm512_loadu_ps(y + i))));
+        }
+#elif defined(__AVX2__) && defined(__FMA__)
+        const __m256 s = _mm256_set1_ps(scale);
+        const __m256 a = _mm256_set1_ps(alpha);
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_mul_ps(s, _mm256_loadu_ps(y + i))));
+        }
+#endif
+        for (; i < n; i++) {
+            y[i] = scale * y[i] + alpha * x[i];
+        }
+    }
+
+    // y += alpha * x
+    inline void Axpy(float alpha, const float* x, float* y, int n) {
+        int i = 0;
+#if defined(__AVX512F__)
+        const __m512 a = _mm512_set1_ps(alpha);
+        for (; i + 16 <= n; i += 16) {
+            _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+        }
+#elif defined(__AVX2__) && defined(__FMA__)
+        const __m256 a = _mm256_set1_ps(alpha);
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        }
+#endif
+        for (; i < n; i++) {
+            y[i] += alpha * x[i];
+        }
+    }
+
+    // IEEE half precision storage for tables that are read far more often than they are written.
+    // F16C converts in hardware, the scalar versions round to nearest even the same way.
+    inline uint16_t FloatToHalf(float value) {
+#if defined(__F16C__)
+        return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+        uint32_t x;
+        std::memcpy(&x, &value, sizeof(x));
+        const uint32_t sign = (x >> 16) & 0x8000;
+        const uint32_t abs = x & 0x7fffffff;
+        if (abs >= 0x7f800000) {
+            // inf stays inf, NaN stays a quiet NaN
+            return static_cast<uint16_t>(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+        }
+        if (abs >= 0x477ff000) {
+            // rounds above 65504
+            return static_cast<uint16_t>(sign | 0x7c00);
+        }
+        if (abs < 0x38800000) {
+            // below 2^-14: subnormal half, or zero below 2^-25
+            if (abs < 0x33000000) {
+                return static_cast<uint16_t>(sign);
+            }
+            const uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+            const int shift = 126 - static_cast<int>(abs >> 23);
+            uint32_t m = mantissa >> shift;
+            const uint32_t rest = mantissa & ((1u << shift) - 1);
+            const uint32_t halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (m & 1))) {
+                m++;
+            }
+            return static_cast<uint16_t>(sign | m);
+        }
+        // rebias the exponent (127 -> 15) and round the 13 dropped mantissa bits
+        uint32_t m = abs - 0x38000000;
+        m += 0xfff + ((m >> 13) & 1);
+        return static_cast<uint16_t>(sign | (m >> 13));
+#endif
+    }
+
+    inline float HalfToFloat(uint16_t value) {
+#if defined(__F16C__)
+        return _cvtsh_ss(value);
+#else
+        const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+        const uint32_t exponent = (value >> 10) & 0x1f;
+        const uint32_t mantissa = value & 0x3ff;
+        uint32_t x;
+        if (exponent == 0) {
+            float f = mantissa * (1.0f / 16777216.0f);
+            return sign ? -f : f;
+        } else if (exponent == 31) {
+            x = sign | 0x7f800000 | (mantissa << 13);
+        } else {
+            x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+#endif
+    }
+
+    // y[i] = float(x[i]) for i < n
+    inline void HalfToFloat(const uint16_t* x, int n, float* y) {
+        int i = 0;
+#if defined(__F16C__)
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i))));
+        }
+#endif
+        for (; i < n; i++) {
+            y[i] = HalfToFloat(x[i]);
+        }
+    }
+
+    inline float Sigmoid(float x) {
+        return 1.0f / (1.0f + std::exp(-x));
+    }
+
+    // In-place softmax over n values
+    inline void Softmax(float* x, int n) {
+        float max = *std::max_element(x, x + n);
+        float sum = 0.0f;
+        for (int i = 0; i < n; i++) {
+            x[i] = std::exp(x[i] - max);
+            sum += x[i];
+        }
+        float inv = 1.0f / sum;
+        for (int i = 0; i < n; i++) {
+            x[i] *= inv;
+        }
+    }
+
+    // In-place log_softmax over n values
+    inline void LogSoftmax(float* x, int n) {
+        float max = *std::max_element(x, x + n);
+        float sum = 0.0f;
+        for (int i = 0; i < n; i++) {
+            sum += std::exp(x[i] - max);
+        }
+        float lse = max + std::log(sum);
+        for (int i = 0; i < n; i++) {
+            x[i] -= lse;
+        }
+    }
+}
+
+#endif
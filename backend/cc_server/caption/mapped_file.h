@@ -0,0 +1,250 @@
+#ifndef CAPTION_MAPPED_FILE_H_
+#define CAPTION_MAPPED_FILE_H_
+
+#include <string>
+#include <cstddef>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace caption {
+
+    // Read-only shared mapping of a whole file. Every process mapping the same file reads the same pages of
+    // the page cache, so N workers hold one copy of it. populate reads the file in when it is mapped instead
+    // of on first touch; lock keeps it resident (mlock / VirtualLock, which can need a higher memory lock
+    // limit or working set).
+    class MappedFile {
+        public:
+            MappedFile(const std::string& path, bool populate, bool lock) { Map(path, populate, lock); }
+            ~MappedFile() { Unmap(); }
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            const char* data() const { return static_cast<const char*>(data_); }
+            size_t size() const { return size_; }
+
+        private:
+            void* data_ = nullptr;
+            size_t size_ = 0;
+            bool locked_ = false;
+
+#ifdef _WIN32
+            void Map(const std::string& path, bool populate, bool lock) {
+                // FILE_SHARE_WRITE: the file may be open for writing in another process (WritableMappedFile)
+                HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file == INVALID_HANDLE_VALUE) {
+                    throw std::runtime_error("Failed to open " + path);
+                }
+                LARGE_INTEGER size;
+                if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+                    CloseHandle(file);
+                    throw std::runtime_error("Empty or unreadable file " + path);
+                }
+                size_ = static_cast<size_t>(size.QuadPart);
+                HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                CloseHandle(file);
+                if (mapping == nullptr) {
+                    throw std::runtime_error("Failed to map " + path);
+                }
+                data_ = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+                if (data_ == nullptr) {
+                    throw std::runtime_error("Failed to map " + path);
+                }
+
+                if (populate) {
+                    // one read per page faults the whole file in now
+                    SYSTEM_INFO info;
+                    GetSystemInfo(&info);
+                    volatile char sink = 0;
+                    for (size_t i = 0; i < size_; i += info.dwPageSize) {
+                        sink = sink + data()[i];
+                    }
+                }
+                if (lock) {
+                    // locked pages count against the working set, grow it by the size of the file first
+                    SIZE_T min_size = 0;
+                    SIZE_T max_size = 0;
+                    HANDLE process = GetCurrentProcess();
+                    if (!GetProcessWorkingSetSize(process, &min_size, &max_size) ||
+                        !SetProcessWorkingSetSize(process, min_size + size_, max_size + size_) || !VirtualLock(data_, size_)) {
+                        Unmap();
+                        throw std::runtime_error("Failed to lock " + path + " in memory");
+                    }
+                    locked_ = true;
+                }
+            }
+
+            void Unmap() {
+                if (data_ != nullptr) {
+                    if (locked_) {
+                        VirtualUnlock(data_, size_);
+                    }
+                    UnmapViewOfFile(data_);
+                    data_ = nullptr;
+                }
+            }
+#else
+            void Map(const std::string& path, bool populate, bool lock) {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) {
+                    throw std::runtime_error("Failed to open " + path);
+                }
+                struct stat st;
+                if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+                    ::close(fd);
+                    throw std::runtime_error("Empty or unreadable file " + path);
+                }
+                size_ = static_cast<size_t>(st.st_size);
+
+                int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+                if (populate) {
+                    flags |= MAP_POPULATE;
+                }
+#endif
+                void* data = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+                ::close(fd);
+                if (data == MAP_FAILED) {
+                    throw std::runtime_error("Failed to map " + path);
+                }
+                data_ = data;
+#ifndef MAP_POPULATE
+                if (populate) {
+                    ::madvise(data_, size_, MADV_WILLNEED);
+                }
+#endif
+                if (lock) {
+                    if (::mlock(data_, size_) != 0) {
+                        Unmap();
+                        throw std::runtime_error("Failed to lock " + path + " in memory (RLIMIT_MEMLOCK)");
+                    }
+                    locked_ = true;
+                }
+            }
+
+            void Unmap() {
+                if (data_ != nullptr) {
+                    if (locked_) {
+                        ::munlock(data_, size_);
+                    }
+                    ::munmap(data_, size_);
+                    data_ = nullptr;
+                }
+            }
+#endif
+    };
+
+    // Read-write shared mapping of a whole file, created or resized to size. Stores reach the page cache at
+    // once, so processes mapping the same file read-only (MappedFile) see them; Flush writes them to disk.
+    // Contents beyond the old end of the file are unspecified on Windows, clear them before relying on zeros.
+    class WritableMappedFile {
+        public:
+            WritableMappedFile(const std::string& path, size_t size) { Map(path, size); }
+            ~WritableMappedFile() { Unmap(); }
+            WritableMappedFile(const WritableMappedFile&) = delete;
+            WritableMappedFile& operator=(const WritableMappedFile&) = delete;
+
+            char* data() { return static_cast<char*>(data_); }
+            const char* data() const { return static_cast<const char*>(data_); }
+            size_t size() const { return size_; }
+
+#ifdef _WIN32
+            void Flush() {
+                if (!FlushViewOfFile(data_, 0) || !FlushFileBuffers(file_)) {
+                    throw std::runtime_error("Failed to flush a mapped file");
+                }
+            }
+
+        private:
+            void* data_ = nullptr;
+            size_t size_ = 0;
+            HANDLE file_ = INVALID_HANDLE_VALUE;
+
+            void Map(const std::string& path, size_t size) {
+                file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                    nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file_ == INVALID_HANDLE_VALUE) {
+                    throw std::runtime_error("Failed to open " + path);
+                }
+                size_ = size;
+                LARGE_INTEGER end;
+                end.QuadPart = static_cast<LONGLONG>(size);
+                if (!SetFilePointerEx(file_, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file_)) {
+                    Unmap();
+                    throw std::runtime_error("Failed to resize " + path);
+                }
+                HANDLE mapping = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+                if (mapping == nullptr) {
+                    Unmap();
+                    throw std::runtime_error("Failed to map " + path);
+                }
+                data_ = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+                CloseHandle(mapping);
+                if (data_ == nullptr) {
+                    Unmap();
+                    throw std::runtime_error("Failed to map " + path);
+                }
+            }
+
+            void Unmap() {
+                if (data_ != nullptr) {
+                    UnmapViewOfFile(data_);
+                    data_ = nullptr;
+                }
+                if (file_ != INVALID_HANDLE_VALUE) {
+                    CloseHandle(file_);
+                    file_ = INVALID_HANDLE_VALUE;
+                }
+            }
+#else
+            void Flush() {
+                if (::msync(data_, size_, MS_SYNC) != 0) {
+                    throw std::runtime_error("Failed to flush a mapped file");
+                }
+            }
+
+        private:
+            void* data_ = nullptr;
+            size_t size_ = 0;
+
+            void Map(const std::string& path, size_t size) {
+                int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+                if (fd < 0) {
+                    throw std::runtime_error("Failed to open " + path);
+                }
+                if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                    ::close(fd);
+                    throw std::runtime_error("Failed to resize " + path);
+                }
+                size_ = size;
+                void* data = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (data == MAP_FAILED) {
+                    throw std::runtime_error("Failed to map " + path);
+                }
+                data_ = data;
+            }
+
+            void Unmap() {
+                if (data_ != nullptr) {
+                    ::munmap(data_, size_);
+                    data_ = nullptr;
+                }
+            }
+#endif
+    };
+}
+
+#endif
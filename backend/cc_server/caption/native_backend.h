@@ -0,0 +1,102 @@
+#ifndef CAPTION_NATIVE_BACKEND_H_
+#define CAPTION_NATIVE_BACKEND_H_
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+#include "onnx_backend.h"
+#include "weights.h"
+#include "decoder.h"
+#include "beam_search.h"
+#include "decode_scheduler.h"
+
+namespace caption {
+
+    // The encoder from encoder.onnx and the decoder natively (DecoderEngine) on the weight file of
+    // AI_module/export_weights.py. The weight file has no ResNet, so the encoder stays on ONNX Runtime and
+    // this backend is built with -DCAPTION_WITH_ONNXRUNTIME like the onnx one.
+    // The weights are mapped once and shared. Captions go through one DecodeScheduler, which decodes the beams
+    // of every caption in flight as one batch; with batch_rows 0 every server thread decodes with its own
+    // engine instead, built at its first caption (ThreadDecoder).
+    class NativeBackend : public OnnxBackend {
+        public:
+            const char* name() const override { return "native"; }
+
+            StepFunction* ThreadDecoder(const float* encoder_out, int beam_size) override {
+                thread_local std::unique_ptr<ThreadState> state;
+                if (!state || state->backend_id != id_) {
+                    state.reset(new ThreadState(id_, *weights_, options_));
+                }
+                state->engine.PrepareImage(encoder_out, static_cast<int>(num_pixels_), &state->image);
+                state->step.Reset(&state->image, beam_size);
+                return &state->step;
+            }
+
+            CaptionResult CaptionFeatures(const float* encoder_out, const BeamSearchOptions& options) override {
+                if (!scheduler_) {
+                    return OnnxBackend::CaptionFeatures(encoder_out, options);
+                }
+                thread_local std::vector<int> seq;
+                scheduler_->Caption(encoder_out, static_cast<int>(num_pixels_), options, &seq);
+
+                CaptionResult result;
+                result.caption = word_map_->Join(seq);
+                return result;
+            }
+
+        protected:
+            void LoadModel(const BackendConfig& config) override {
+                scheduler_.reset();
+                LoadEncoder(config, SessionOptions(config));
+                weights_.reset(new WeightFile(config.model_dir + config.weights));
+                options_ = DecoderOptions();
+                options_.max_rows = config.beam_size;
+
+                // the engine checks the weights against each other, the graphs and the word map against them
+                DecoderEngine engine(*weights_, options_);
+                if (engine.dims().encoder_dim != encoder_dim_) {
+                    throw std::runtime_error("encoder.onnx and " + config.weights + " disagree on encoder_dim");
+                }
+                if (engine.dims().vocab_size != word_map_->size()) {
+                    throw std::runtime_error(config.weights + " and " + config.word_map + " disagree on the vocabulary");
+                }
+                id_ = NextId();
+
+                if (config.batch_rows > 0) {
+                    DecoderOptions batch = options_;
+                    batch.max_rows = std::max(config.batch_rows, config.beam_size);
+                    scheduler_.reset(new DecodeScheduler(*weights_, batch, word_map_->id("<start>"), word_map_->id("<end>")));
+                }
+            }
+
+        private:
+            // Decoder of one thread: its engine, the features of its current image and the beams over them
+            struct ThreadState {
+                ThreadState(std::uint64_t id, const WeightFile& weights, const DecoderOptions& options)
+                    : backend_id(id), engine(weights, options), step(&engine) {}
+                std::uint64_t backend_id;
+                DecoderEngine engine;
+                ImageFeatures image;
+                DecoderStep step;
+            };
+
+            std::unique_ptr<WeightFile> weights_;
+            // declared after the weights its engine reads, so it stops first
+            std::unique_ptr<DecodeScheduler> scheduler_;
+            DecoderOptions options_;
+            // the thread decoders of another backend, or of an earlier Load, are rebuilt
+            std::uint64_t id_ = 0;
+
+            static std::uint64_t NextId() {
+                static std::atomic<std::uint64_t> next(1);
+                return next++;
+            }
+    };
+}
+
+#endif
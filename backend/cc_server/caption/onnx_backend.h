@@ -0,0 +1,192 @@
+#ifndef CAPTION_ONNX_BACKEND_H_
+#define CAPTION_ONNX_BACKEND_H_
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include <onnxruntime_cxx_api.h>
+
+#include "backend.h"
+#include "beam_state.h"
+
+namespace caption {
+
+    // The model in-process through ONNX Runtime, on the graphs written by AI_module/export_onnx.py:
+    // - encoder.onnx     : images (n, 3, 256, 256) -> encoder_out (n, num_pixels, encoder_dim)
+    // - decoder_init.onnx: encoder_out (1, num_pixels, encoder_dim) -> att1, h0 (1, decoder_dim), c0
+    // - decoder_step.onnx: encoder_out, att1, words (s) int64, h (s, decoder_dim), c -> log_probs (s, vocab), h, c
+    // Build with -DCAPTION_WITH_ONNXRUNTIME and the include and lib folders of an ONNX Runtime release.
+    class OnnxBackend : public InProcessBackend {
+        public:
+            OnnxBackend() : env_(ORT_LOGGING_LEVEL_WARNING, "caption"),
+                            memory_(Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault)) {}
+
+            const char* name() const override { return "onnx"; }
+
+            void EncodeBatch(const float* images, int batch, std::vector<float>* encoder_out) override {
+                std::array<int64_t, 4> shape = {batch, 3, kImageSize, kImageSize};
+                Ort::Value input = Input(images, shape.data(), shape.size());
+                const char* input_names[] = {"images"};
+                const char* output_names[] = {"encoder_out"};
+                std::vector<Ort::Value> outputs = encoder_->Run(Ort::RunOptions{nullptr}, input_names, &input, 1,
+                                                                output_names, 1);
+                const float* out = outputs[0].GetTensorData<float>();
+                encoder_out->assign(out, out + outputs[0].GetTensorTypeAndShapeInfo().GetElementCount());
+            }
+
+            StepFunction* ThreadDecoder(const float* encoder_out, int beam_size) override {
+                thread_local DecodeStep decoder;
+                decoder.Reset(this, encoder_out, beam_size);
+                return &decoder;
+            }
+
+        protected:
+            // num_pixels and encoder_dim of encoder.onnx
+            int64_t num_pixels_ = 0;
+            int64_t encoder_dim_ = 0;
+
+            void LoadModel(const BackendConfig& config) override {
+                const Ort::SessionOptions options = SessionOptions(config);
+                LoadEncoder(config, options);
+                init_.reset(new Ort::Session(env_, Path(config.graph_dir + "decoder_init.onnx").c_str(), options));
+                step_.reset(new Ort::Session(env_, Path(config.graph_dir + "decoder_step.onnx").c_str(), options));
+
+                // only the batch and beam dimensions of the graphs are dynamic
+                std::vector<int64_t> att1 = init_->GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
+                std::vector<int64_t> h0 = init_->GetOutputTypeInfo(1).GetTensorTypeAndShapeInfo().GetShape();
+                if (h0.back() <= 0 || att1.size() != 3 || att1[1] != num_pixels_ || att1[2] <= 0) {
+                    throw std::runtime_error("Unexpected shapes in the graphs of " + config.graph_dir);
+                }
+                attention_dim_ = att1[2];
+                decoder_dim_ = static_cast<int>(h0.back());
+            }
+
+            Ort::SessionOptions SessionOptions(const BackendConfig& config) const {
+                Ort::SessionOptions options;
+                if (config.intra_op_threads > 0) {
+                    options.SetIntraOpNumThreads(config.intra_op_threads);
+                }
+                options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+                return options;
+            }
+
+            // encoder.onnx alone, the part of the graphs the native backend runs too
+            void LoadEncoder(const BackendConfig& config, const Ort::SessionOptions& options) {
+                encoder_.reset(new Ort::Session(env_, Path(config.graph_dir + "encoder.onnx").c_str(), options));
+                std::vector<int64_t> encoder_out = encoder_->GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
+                if (encoder_out.size() != 3 || encoder_out[1] <= 0 || encoder_out[2] <= 0) {
+                    throw std::runtime_error("Unexpected shapes in " + config.graph_dir + "encoder.onnx");
+                }
+                num_pixels_ = encoder_out[1];
+                encoder_dim_ = encoder_out[2];
+            }
+
+            // ONNX Runtime takes wide paths on Windows
+            static std::basic_string<ORTCHAR_T> Path(const std::string& path) {
+                return std::basic_string<ORTCHAR_T>(path.begin(), path.end());
+            }
+
+        private:
+            // Decode steps of the beams of one image: the state of the live beams, reordered by the search.
+            // Reset moves it to the next image; the buffers only grow and the graphs write their outputs
+            // into them, so a thread keeps one for all its captions.
+            class DecodeStep : public StepFunction {
+                public:
+                    void Reset(OnnxBackend* backend, const float* encoder_out, int beam_size) {
+                        backend_ = backend;
+                        const int D = backend->decoder_dim_;
+                        encoder_shape_ = {1, backend->num_pixels_, backend->encoder_dim_};
+                        att1_shape_ = {1, backend->num_pixels_, backend->attention_dim_};
+                        encoder_out_.assign(encoder_out, encoder_out + backend->num_pixels_ * backend->encoder_dim_);
+                        att1_.resize(backend->num_pixels_ * backend->attention_dim_);
+                        ids_.resize(beam_size);
+                        h_.resize(static_cast<size_t>(beam_size) * D);
+                        c_.resize(h_.size());
+                        h_next_.resize(h_.size());
+                        c_next_.resize(c_.size());
+
+                        // h0 and c0 land in the first beam and are copied to the others
+                        std::array<int64_t, 2> state_shape = {1, D};
+                        Ort::Value input = backend_->Input(encoder_out_.data(), encoder_shape_.data(), 3);
+                        Ort::Value outputs[] = {backend_->Input(att1_.data(), att1_shape_.data(), 3),
+                                                backend_->Input(h_.data(), state_shape.data(), 2),
+                                                backend_->Input(c_.data(), state_shape.data(), 2)};
+                        const char* input_names[] = {"encoder_out"};
+                        const char* output_names[] = {"att1", "h0", "c0"};
+                        backend_->init_->Run(Ort::RunOptions{nullptr}, input_names, &input, 1, output_names, outputs, 3);
+                        for (int r = 1; r < beam_size; r++) {
+                            std::copy(h_.begin(), h_.begin() + D, h_.begin() + static_cast<size_t>(r) * D);
+                            std::copy(c_.begin(), c_.begin() + D, c_.begin() + static_cast<size_t>(r) * D);
+                        }
+                    }
+
+                    int vocab_size() const override {
+                        return backend_->word_map_->size();
+                    }
+
+                    void Step(const int* words, int rows, float* log_probs) override {
+                        const int D = backend_->decoder_dim_;
+                        std::copy(words, words + rows, ids_.begin());
+                        std::array<int64_t, 1> words_shape = {rows};
+                        std::array<int64_t, 2> state_shape = {rows, D};
+                        std::array<int64_t, 2> log_probs_shape = {rows, vocab_size()};
+
+                        Ort::Value inputs[] = {
+                            backend_->Input(encoder_out_.data(), encoder_shape_.data(), 3),
+                            backend_->Input(att1_.data(), att1_shape_.data(), 3),
+                            Ort::Value::CreateTensor<int64_t>(backend_->memory_, ids_.data(), rows, words_shape.data(), 1),
+                            backend_->Input(h_.data(), state_shape.data(), 2),
+                            backend_->Input(c_.data(), state_shape.data(), 2)};
+                        Ort::Value outputs[] = {backend_->Input(log_probs, log_probs_shape.data(), 2),
+                                                backend_->Input(h_next_.data(), state_shape.data(), 2),
+                                                backend_->Input(c_next_.data(), state_shape.data(), 2)};
+                        const char* input_names[] = {"encoder_out", "att1", "words", "h", "c"};
+                        const char* output_names[] = {"log_probs", "h_out", "c_out"};
+                        backend_->step_->Run(Ort::RunOptions{nullptr}, input_names, inputs, 5, output_names, outputs, 3);
+                    }
+
+                    void Reorder(const int* sources, int rows) override {
+                        const int D = backend_->decoder_dim_;
+                        GatherRows(h_next_.data(), h_.data(), D, sources, rows);
+                        GatherRows(c_next_.data(), c_.data(), D, sources, rows);
+                    }
+
+                private:
+                    OnnxBackend* backend_ = nullptr;
+                    std::array<int64_t, 3> encoder_shape_;
+                    std::array<int64_t, 3> att1_shape_;
+                    std::vector<float> encoder_out_;
+                    std::vector<float> att1_;
+                    std::vector<int64_t> ids_;
+                    std::vector<float> h_;
+                    std::vector<float> c_;
+                    std::vector<float> h_next_;
+                    std::vector<float> c_next_;
+            };
+
+            Ort::Env env_;
+            Ort::MemoryInfo memory_;
+            // Session::Run is thread-safe, the server threads share the sessions
+            std::unique_ptr<Ort::Session> encoder_;
+            std::unique_ptr<Ort::Session> init_;
+            std::unique_ptr<Ort::Session> step_;
+            int64_t attention_dim_ = 0;
+            int decoder_dim_ = 0;
+
+            // Tensor over a float buffer the caller keeps alive during Run, an input or an output Run writes into
+            Ort::Value Input(const float* data, const int64_t* shape, size_t dims) {
+                size_t n = 1;
+                for (size_t i = 0; i < dims; i++) {
+                    n *= static_cast<size_t>(shape[i]);
+                }
+                return Ort::Value::CreateTensor<float>(memory_, const_cast<float*>(data), n, shape, dims);
+            }
+    };
+}
+
+#endif
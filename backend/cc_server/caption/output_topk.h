@@ -0,0 +1,102 @@
+#ifndef CAPTION_OUTPUT_TOPK_H_
+#define CAPTION_OUTPUT_TOPK_H_
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "topk.h"
+#include "kernels.h"
+#include "quantize.h"
+
+namespace caption {
+
+    // Outputs of the projection computed at a time, kOutputChunk x rows logits stay in L1
+    constexpr int kOutputChunk = 64;
+
+    // Fused Linear (float32 or INT8) -> log_softmax -> top-k per row. The weights are streamed once, one chunk
+    // of output rows at a time; every chunk of logits is folded into a running max / sum of exponentials of its
+    // row and offered to the row's heap, so the (rows, out) score matrix is never written out.
+    class OutputTopK {
+        public:
+            OutputTopK() = default;
+            ~OutputTopK() = default;
+
+            // Sizes the state of every row for up to `rows` rows and k candidates, with the logits of a chunk in
+            // caller storage of rows * kOutputChunk floats, so Run does not allocate
+            void Reserve(int rows, int k, float* chunk) {
+                chunk_ = chunk;
+                rows_ = rows;
+                max_.resize(rows);
+                sum_.resize(rows);
+                lse_.resize(rows);
+                heaps_.resize(rows);
+                for (TopK& heap : heaps_) {
+                    heap.Reset(k);
+                }
+            }
+
+            // candidates is (x.rows(), k), best first: index is the output (index[output] with an index map),
+            // score its log_softmax value. Needs k <= out and x.rows() within Reserve.
+            void Run(const Activations& x, const Matrix& weight, const float* bias, int out, int k, Candidate* candidates,
+                     const int* index = nullptr) {
+                const int rows = x.rows();
+                if (rows > rows_) {
+                    throw std::logic_error("OutputTopK::Run over more rows than reserved");
+                }
+                for (int r = 0; r < rows; r++) {
+                    max_[r] = -std::numeric_limits<float>::infinity();
+                    sum_[r] = 0.0f;
+                    heaps_[r].Reset(k);
+                }
+
+                for (int o = 0; o < out; o += kOutputChunk) {
+                    const int n = std::min(kOutputChunk, out - o);
+                    MatMul(x, weight.Rows(o), bias ? bias + o : nullptr, n, chunk_, kOutputChunk);
+
+                    for (int r = 0; r < rows; r++) {
+                        const float* logits = chunk_ + static_cast<size_t>(r) * kOutputChunk;
+
+                        // online log-sum-exp: rescale the running sum only when the max moves
+                        float m = std::max(max_[r], *std::max_element(logits, logits + n));
+                        float s = m > max_[r] ? sum_[r] * std::exp(max_[r] - m) : sum_[r];
+                        for (int i = 0; i < n; i++) {
+                            s += std::exp(logits[i] - m);
+                        }
+                        max_[r] = m;
+                        sum_[r] = s;
+
+                        heaps_[r].Scan(logits, n, 0.0f, o);
+                    }
+                }
+
+                for (int r = 0; r < rows; r++) {
+                    const float lse = max_[r] + std::log(sum_[r]);
+                    lse_[r] = lse;
+                    Candidate* row = candidates + static_cast<size_t>(r) * k;
+                    const int n = heaps_[r].Sorted(row);
+                    for (int j = 0; j < n; j++) {
+                        row[j].score -= lse;
+                        if (index) {
+                            row[j].index = index[row[j].index];
+                        }
+                    }
+                }
+            }
+
+            // log-sum-exp of the logits of row r in the last Run
+            float lse(int r) const { return lse_[r]; }
+
+        private:
+            float* chunk_ = nullptr;
+            int rows_ = 0;
+            std::vector<float> max_;
+            std::vector<float> sum_;
+            std::vector<float> lse_;
+            std::vector<TopK> heaps_;
+    };
+}
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef CAPTION_PERCEPTUAL_HASH_H_
+#define CAPTION_PERCEPTUAL_HASH_H_
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "preprocess.h"
+
+namespace caption {
+
+    // dHash of a preprocessed image (3, kImageSize, kImageSize): the luminance averaged over 8 x 9 cells, one
+    // bit per pair of horizontal neighbours, set where the left cell is brighter. The same photo re-encoded,
+    // resized or stripped of its metadata preprocesses to almost the same tensor and lands a few bits away;
+    // different photos are about 32 bits apart.
+    inline std::uint64_t DifferenceHash(const float* image) {
+        constexpr int kRows = 8;
+        constexpr int kColumns = 9;
+        constexpr float kLuma[3] = {0.299f, 0.587f, 0.114f};
+        const int S = kImageSize;
+
+        // the tensor is Normalize(x) per channel; undoing the scale is enough, the mean only shifts all cells
+        float weight[3];
+        for (int c = 0; c < 3; c++) {
+            weight[c] = kLuma[c] * kImageStd[c];
+        }
+        int column_of[kImageSize];
+        int column_width[kColumns] = {};
+        for (int x = 0; x < S; x++) {
+            column_of[x] = x * kColumns / S;
+            column_width[column_of[x]]++;
+        }
+
+        double cells[kRows][kColumns] = {};
+        const size_t plane = static_cast<size_t>(S) * S;
+        for (int y = 0; y < S; y++) {
+            double* row = cells[y * kRows / S];
+            const float* r = image + static_cast<size_t>(y) * S;
+            const float* g = r + plane;
+            const float* b = g + plane;
+            for (int x = 0; x < S; x++) {
+                row[column_of[x]] += weight[0] * r[x] + weight[1] * g[x] + weight[2] * b[x];
+            }
+        }
+
+        std::uint64_t hash = 0;
+        for (int y = 0; y < kRows; y++) {
+            for (int x = 0; x + 1 < kColumns; x++) {
+                if (cells[y][x] / column_width[x] > cells[y][x + 1] / column_width[x + 1]) {
+                    hash |= std::uint64_t(1) << (y * (kColumns - 1) + x);
+                }
+            }
+        }
+        return hash;
+    }
+
+    inline int HammingDistance(std::uint64_t a, std::uint64_t b) {
+        return __builtin_popcountll(a ^ b);
+    }
+
+    // Flat images (a clear sky, a blank page, a file cut short and decoded as gray) hash to almost all zeros or
+    // ones and would match each other; hashes with fewer than this many bits on either side are not matched
+    constexpr int kMinHashContrast = 8;
+
+    inline bool Distinctive(std::uint64_t hash) {
+        const int bits = __builtin_popcountll(hash);
+        return bits >= kMinHashContrast && bits <= 64 - kMinHashContrast;
+    }
+
+    struct NearDuplicateStats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t insertions = 0;
+        std::uint64_t evictions = 0;
+        // lookups of hashes that are not Distinctive, neither hits nor misses
+        std::uint64_t skipped = 0;
+        size_t entries = 0;
+        size_t capacity = 0;
+        int max_distance = 0;
+        // hits by their distance, 0 ... max_distance, to tune it
+        std::vector<std::uint64_t> hit_distances;
+    };
+
+    // Values by 64-bit perceptual hash, found within a Hamming distance of the hash looked up, with multi-index
+    // hashing: the hash is cut into 4 chunks of 16 bits with a table each, and by pigeonhole an entry within
+    // d differs from the query by at most d / 4 bits in one of the chunks, so a lookup only visits the buckets
+    // of the chunk values that close to the query's (1 per chunk up to d = 3, 17 up to 7, 137 up to 11),
+    // each holding about entries / 65536 hashes. Entries carry a tag (the settings their value depends on)
+    // that must match too. The entries are a ring, at capacity the oldest is evicted. Hashes that are not
+    // Distinctive are neither looked up nor kept.
+    template <typename Value>
+    class NearDuplicateCache {
+        public:
+            NearDuplicateCache(int max_distance, size_t capacity)
+                : max_distance_(max_distance < 0 ? 0 : max_distance), capacity_(capacity < 1 ? 1 : capacity),
+                  heads_(static_cast<size_t>(kChunks) << kChunkBits, -1), hit_distances_(max_distance_ + 1, 0) {}
+
+            // The value of the nearest entry with the tag within max_distance, or null
+            std::shared_ptr<const Value> Lookup(std::uint64_t hash, std::uint64_t tag, int* distance = nullptr) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!Distinctive(hash)) {
+                    skipped_++;
+                    return nullptr;
+                }
+                Query query{hash, tag, -1, max_distance_ + 1};
+                for (int c = 0; c < kChunks; c++) {
+                    Probe(query, c, Chunk(hash, c), 0, max_distance_ / kChunks);
+                }
+                if (query.best < 0) {
+                    misses_++;
+                    return nullptr;
+                }
+                hits_++;
+                hit_distances_[query.best_distance]++;
+                if (distance != nullptr) {
+                    *distance = query.best_distance;
+                }
+                return entries_[query.best].value;
+            }
+
+            void Insert(std::uint64_t hash, std::uint64_t tag, std::shared_ptr<const Value> value) {
+                if (!Distinctive(hash)) {
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                insertions_++;
+                for (int i = heads_[Bucket(hash, 0)]; i >= 0; i = entries_[i].next[0]) {
+                    if (entries_[i].hash == hash && entries_[i].tag == tag) {
+                        entries_[i].value = std::move(value);
+                        return;
+                    }
+                }
+
+                const int slot = static_cast<int>(next_slot_);
+                next_slot_ = (next_slot_ + 1) % capacity_;
+                if (static_cast<size_t>(slot) < entries_.size()) {
+                    for (int c = 0; c < kChunks; c++) {
+                        Unlink(slot, c);
+                    }
+                    evictions_++;
+                } else {
+                    entries_.emplace_back();
+                }
+                Entry& entry = entries_[slot];
+                entry.hash = hash;
+                entry.tag = tag;
+                entry.value = std::move(value);
+                for (int c = 0; c < kChunks; c++) {
+                    int& head = heads_[Bucket(hash, c)];
+                    entry.next[c] = head;
+                    head = slot;
+                }
+            }
+
+            NearDuplicateStats stats() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                NearDuplicateStats stats;
+                stats.hits = hits_;
+                stats.misses = misses_;
+                stats.insertions = insertions_;
+                stats.evictions = evictions_;
+                stats.skipped = skipped_;
+                stats.entries = entries_.size();
+                stats.capacity = capacity_;
+                stats.max_distance = max_distance_;
+                stats.hit_distances = hit_distances_;
+                return stats;
+            }
+
+        private:
+            static constexpr int kChunks = 4;
+            static constexpr int kChunkBits = 16;
+
+            struct Entry {
+                std::uint64_t hash = 0;
+                std::uint64_t tag = 0;
+                std::shared_ptr<const Value> value;
+                // next entry of the same bucket of each chunk table, -1 at the end
+                int next[kChunks];
+            };
+
+            struct Query {
+                std::uint64_t hash;
+                std::uint64_t tag;
+                int best;
+                int best_distance;
+            };
+
+            const int max_distance_;
+            const size_t capacity_;
+            mutable std::mutex mutex_;
+            // first entry of every bucket, kChunks tables of 2^kChunkBits
+            std::vector<int> heads_;
+            std::vector<Entry> entries_;
+            size_t next_slot_ = 0;
+            std::uint64_t hits_ = 0;
+            std::uint64_t misses_ = 0;
+            std::uint64_t insertions_ = 0;
+            std::uint64_t evictions_ = 0;
+            std::uint64_t skipped_ = 0;
+            std::vector<std::uint64_t> hit_distances_;
+
+            static std::uint32_t Chunk(std::uint64_t hash, int c) {
+                return static_cast<std::uint32_t>(hash >> (c * kChunkBits)) & ((1u << kChunkBits) - 1);
+            }
+
+            static size_t Bucket(std::uint64_t hash, int c) {
+                return (static_cast<size_t>(c) << kChunkBits) | Chunk(hash, c);
+            }
+
+            // The bucket of value and, recursively, of every value with up to `flips` more bits flipped above bit
+            void Probe(Query& query, int c, std::uint32_t value, int bit, int flips) {
+                for (int i = heads_[(static_cast<size_t>(c) << kChunkBits) | value]; i >= 0; i = entries_[i].next[c]) {
+                    const Entry& entry = entries_[i];
+                    const int d = HammingDistance(entry.hash, query.hash);
+                    if (d < query.best_distance && entry.tag == query.tag) {
+                        query.best = i;
+                        query.best_distance = d;
+                    }
+                }
+                if (flips > 0) {
+                    for (int b = bit; b < kChunkBits; b++) {
+                        Probe(query, c, value ^ (1u << b), b + 1, flips - 1);
+                    }
+                }
+            }
+
+            void Unlink(int slot, int c) {
+                int* link = &heads_[Bucket(entries_[slot].hash, c)];
+                while (*link != slot) {
+                    link = &entries_[*link].next[c];
+                }
+                *link = entries_[slot].next[c];
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef CAPTION_PREPROCESS_H_
+#define CAPTION_PREPROCESS_H_
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "image_decode.h"
+
+namespace caption {
+
+    // Side of the square image the encoder takes, read_image of AI_module/demo.py
+    constexpr int kImageSize = 256;
+
+    // transforms.Normalize of read_image
+    constexpr float kImageMean[3] = {0.485f, 0.456f, 0.406f};
+    constexpr float kImageStd[3] = {0.229f, 0.224f, 0.225f};
+
+    struct PreprocessOptions {
+        // decode large JPEGs at a reduced scale in the IDCT, down to a short side of kImageSize, before the
+        // resize; off reproduces read_image more closely, from the full resolution
+        bool jpeg_scaling = true;
+    };
+
+    // Weights of one axis of skimage.transform.resize (order 1, mode 'reflect', anti_aliasing when shrinking):
+    // a Gaussian of sigma (scale - 1) / 2 (scipy gaussian_filter, truncate 4, 'mirror' borders), sampled
+    // bilinearly at (o + 0.5) * scale - 0.5 (scipy zoom, grid_mode). Both are linear, so every output sample
+    // is one weighted sum of a run of input samples, computed here once per image size.
+    // An image decoded at 1 / reduction (JPEG IDCT scaling) is already averaged over blocks of about
+    // reduction pixels, a box of variance (reduction^2 - 1) / 12; the Gaussian only adds what is missing
+    // to the blur of the full resolution image.
+    class AxisWeights {
+        public:
+            AxisWeights(int in, int out, int reduction = 1) { Build(in, out, reduction); }
+            ~AxisWeights() = default;
+
+            // Output o is sum of weight(o)[j] * input[first(o) + j] for j < taps(o)
+            int first(int o) const { return first_[o]; }
+            int taps(int o) const { return offset_[o + 1] - offset_[o]; }
+            const float* weight(int o) const { return weights_.data() + offset_[o]; }
+
+        private:
+            std::vector<int> first_;
+            std::vector<int> offset_;
+            std::vector<float> weights_;
+
+            // scipy 'mirror': d c b | a b c d | c b a
+            static int Mirror(int i, int n) {
+                if (n == 1) {
+                    return 0;
+                }
+                const int period = 2 * (n - 1);
+                i %= period;
+                if (i < 0) {
+                    i += period;
+                }
+                return i < n ? i : period - i;
+            }
+
+            void Build(int in, int out, int reduction) {
+                const double scale = static_cast<double>(in) / out;
+                const double full = std::max(0.0, (scale * reduction - 1.0) / 2.0);
+                const double box = (static_cast<double>(reduction) * reduction - 1.0) / 12.0;
+                const double sigma = std::sqrt(std::max(0.0, full * full - box)) / reduction;
+                const int radius = static_cast<int>(4.0 * sigma + 0.5);
+                std::vector<double> gauss(2 * radius + 1, 1.0);
+                if (radius > 0) {
+                    double sum = 0.0;
+                    for (int k = -radius; k <= radius; k++) {
+                        gauss[k + radius] = std::exp(-0.5 * k * k / (sigma * sigma));
+                        sum += gauss[k + radius];
+                    }
+                    for (double& g : gauss) {
+                        g /= sum;
+                    }
+                }
+
+                std::vector<double> row(in);
+                offset_.push_back(0);
+                for (int o = 0; o < out; o++) {
+                    // sample position, mirrored into the image like scipy does for order 1
+                    double x = (o + 0.5) * scale - 0.5;
+                    if (in > 1) {
+                        const double period = 2.0 * (in - 1);
+                        x = std::fmod(std::fabs(x), period);
+                        if (x > in - 1) {
+                            x = period - x;
+                        }
+                    } else {
+                        x = 0.0;
+                    }
+                    const int i0 = static_cast<int>(std::floor(x));
+                    const double t = x - i0;
+                    const int i1 = Mirror(i0 + 1, in);
+
+                    std::fill(row.begin(), row.end(), 0.0);
+                    for (int k = -radius; k <= radius; k++) {
+                        row[Mirror(i0 + k, in)] += (1.0 - t) * gauss[k + radius];
+                        row[Mirror(i1 + k, in)] += t * gauss[k + radius];
+                    }
+                    int lo = 0;
+                    int hi = in - 1;
+                    while (lo < hi && row[lo] == 0.0) {
+                        lo++;
+                    }
+                    while (hi > lo && row[hi] == 0.0) {
+                        hi--;
+                    }
+                    first_.push_back(lo);
+                    for (int i = lo; i <= hi; i++) {
+                        weights_.push_back(static_cast<float>(row[i]));
+                    }
+                    offset_.push_back(static_cast<int>(weights_.size()));
+                }
+            }
+    };
+
+    // acc[i] += w * src[i] for n bytes
+    inline void AccumulateRow(const std::uint8_t* src, float w, float* acc, int n) {
+        int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+        const __m256 vw = _mm256_set1_ps(w);
+        for (; i + 8 <= n; i += 8) {
+            __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i))));
+            _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(x, vw, _mm256_loadu_ps(acc + i)));
+        }
+#endif
+        for (; i < n; i++) {
+            acc[i] += w * src[i];
+        }
+    }
+
+    // read_image of demo.py on a decoded image: resize to kImageSize x kImageSize like skimage, then the same
+    // scaling and Normalize, written to out (3, kImageSize, kImageSize). Rows are resized first with SIMD over
+    // the interleaved bytes, then columns, with the HWC -> CHW transpose and the normalization in the last pass.
+    inline void PreprocessImage(const Image& image, float* out) {
+        if (image.width <= 0 || image.height <= 0) {
+            throw std::runtime_error("Empty image");
+        }
+        const int W = image.width;
+        const int S = kImageSize;
+        const AxisWeights rows(image.height, S, image.reduction);
+        const AxisWeights columns(W, S, image.reduction);
+
+        // skimage resize turns uint8 into [0, 1] and read_image divides by 255 once more; the model is
+        // trained on that scale (data_generator.py), so it is kept: x = (v / 255 / 255 - mean) / std
+        float scale[3];
+        float bias[3];
+        for (int c = 0; c < 3; c++) {
+            scale[c] = 1.0f / (255.0f * 255.0f * kImageStd[c]);
+            bias[c] = -kImageMean[c] / kImageStd[c];
+        }
+
+        std::vector<float> line(static_cast<size_t>(W) * 3);
+        for (int y = 0; y < S; y++) {
+            std::fill(line.begin(), line.end(), 0.0f);
+            const float* wy = rows.weight(y);
+            for (int j = 0; j < rows.taps(y); j++) {
+                AccumulateRow(image.pixels.data() + static_cast<size_t>(rows.first(y) + j) * W * 3, wy[j], line.data(), W * 3);
+            }
+
+            for (int x = 0; x < S; x++) {
+                const float* wx = columns.weight(x);
+                const float* src = line.data() + static_cast<size_t>(columns.first(x)) * 3;
+                float r = 0.0f;
+                float g = 0.0f;
+                float b = 0.0f;
+                for (int j = 0; j < columns.taps(x); j++) {
+                    r += wx[j] * src[j * 3];
+                    g += wx[j] * src[j * 3 + 1];
+                    b += wx[j] * src[j * 3 + 2];
+                }
+                const size_t o = static_cast<size_t>(y) * S + x;
+                out[o] = r * scale[0] + bias[0];
+                out[static_cast<size_t>(S) * S + o] = g * scale[1] + bias[1];
+                out[static_cast<size_t>(2) * S * S + o] = b * scale[2] + bias[2];
+            }
+        }
+    }
+
+    // Decodes a JPEG or PNG file in memory and preprocesses it, see PreprocessImage
+    inline void PreprocessImage(const std::uint8_t* data, size_t size, float* out,
+                                const PreprocessOptions& options = PreprocessOptions()) {
+        Image image;
+        DecodeImage(data, size, &image, options.jpeg_scaling ? kImageSize : 0);
+        PreprocessImage(image, out);
+    }
+
+    inline void PreprocessFile(const std::string& path, float* out, const PreprocessOptions& options = PreprocessOptions()) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        PreprocessImage(data.data(), data.size(), out, options);
+    }
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef CAPTION_QUANTIZE_H_
+#define CAPTION_QUANTIZE_H_
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "kernels.h"
+
+namespace caption {
+
+    // Weight matrix of a Linear layer in the nn.Linear layout [out, in] with row stride ld: float32, or INT8
+    // with one scale per output channel, w[o, i] = scale[o] * q[o, i] (export_weights.py --int8)
+    struct Matrix {
+        const float* f32 = nullptr;
+        const std::int8_t* i8 = nullptr;
+        const float* scale = nullptr;
+        int ld = 0;
+
+        bool quantized() const { return i8 != nullptr; }
+
+        // The matrix from output row `begin` on
+        Matrix Rows(int begin) const {
+            Matrix m = *this;
+            if (f32) {
+                m.f32 += static_cast<size_t>(begin) * ld;
+            }
+            if (i8) {
+                m.i8 += static_cast<size_t>(begin) * ld;
+                m.scale += begin;
+            }
+            return m;
+        }
+
+        // The matrix from input column `begin` on, the per-channel scales still apply
+        Matrix Columns(int begin) const {
+            Matrix m = *this;
+            if (f32) {
+                m.f32 += begin;
+            }
+            if (i8) {
+                m.i8 += begin;
+            }
+            return m;
+        }
+    };
+
+    // Input rows of a Linear layer. For INT8 weights every row is quantized once when it is set (symmetric,
+    // one scale per row: dynamic quantization) and reused by every block of output channels.
+    class Activations {
+        public:
+            Activations() = default;
+            ~Activations() = default;
+
+            void Set(const float* x, int rows, int in, bool quantize) {
+                if (quantize) {
+                    q_.resize(static_cast<size_t>(rows) * in);
+                    scale_.resize(rows);
+                }
+                Set(x, rows, in, quantize, q_.data(), scale_.data());
+            }
+
+            // Set with the quantized rows in caller storage of rows * in bytes and rows scales
+            void Set(const float* x, int rows, int in, bool quantize, std::int8_t* q, float* scale) {
+                x_ = x;
+                rows_ = rows;
+                in_ = in;
+                q_data_ = q;
+                scale_data_ = scale;
+                if (!quantize) {
+                    return;
+                }
+
+                for (int r = 0; r < rows; r++) {
+                    const float* row = x + static_cast<size_t>(r) * in;
+                    std::int8_t* qr = q + static_cast<size_t>(r) * in;
+                    float max = 0.0f;
+                    for (int i = 0; i < in; i++) {
+                        max = std::max(max, std::fabs(row[i]));
+                    }
+                    scale[r] = max > 0.0f ? max / 127.0f : 1.0f;
+                    const float inv = 1.0f / scale[r];
+                    for (int i = 0; i < in; i++) {
+                        qr[i] = static_cast<std::int8_t>(std::max(-127.0f, std::min(127.0f, std::nearbyint(row[i] * inv))));
+                    }
+                }
+            }
+
+            const float* x() const { return x_; }
+            const std::int8_t* q() const { return q_data_; }
+            const float* scale() const { return scale_data_; }
+            int rows() const { return rows_; }
+            int in() const { return in_; }
+
+        private:
+            const float* x_ = nullptr;
+            int rows_ = 0;
+            int in_ = 0;
+            const std::int8_t* q_data_ = nullptr;
+            const float* scale_data_ = nullptr;
+            std::vector<std::int8_t> q_;
+            std::vector<float> scale_;
+    };
+
+#if defined(__AVX2__)
+    // acc += a . b over every group of 4 bytes, signed x signed. Both are in [-127, 127], so the
+    // unsigned x signed instructions get |a| and b with the sign of a, and the 16-bit pair sums of
+    // maddubs cannot saturate. VNNI does the multiply and the accumulation in one instruction.
+    inline __m256i DotStepI8(__m256i acc, __m256i a, __m256i b) {
+        const __m256i ua = _mm256_sign_epi8(a, a);
+        const __m256i sb = _mm256_sign_epi8(b, a);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+        return _mm256_dpbusd_epi32(acc, ua, sb);
+#elif defined(__AVXVNNI__)
+        return _mm256_dpbusd_avx_epi32(acc, ua, sb);
+#else
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(ua, sb), _mm256_set1_epi16(1)));
+#endif
+    }
+
+    inline std::int32_t HorizontalSum(__m256i v) {
+        __m128i lo = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+        lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(lo);
+    }
+#endif
+
+    inline std::int32_t DotI8(const std::int8_t* a, const std::int8_t* b, int n) {
+        int i = 0;
+        std::int32_t sum = 0;
+#if defined(__AVX2__)
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 32 <= n; i += 32) {
+            acc = DotStepI8(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        }
+        sum = HorizontalSum(acc);
+#endif
+        for (; i < n; i++) {
+            sum += static_cast<std::int32_t>(a[i]) * b[i];
+        }
+        return sum;
+    }
+
+    // INT8 DotTile: 4 weight rows (ldw bytes apart) x 2 batch rows
+    inline void DotTileI8(const std::int8_t* w, int ldw, int in, const std::int8_t* x0, const std::int8_t* x1,
+                          std::int32_t* out0, std::int32_t* out1) {
+        const std::int8_t* wr[kWeightTile] = {w, w + ldw, w + 2 * static_cast<size_t>(ldw), w + 3 * static_cast<size_t>(ldw)};
+        int i = 0;
+        std::int32_t s[2][kWeightTile] = {{0}};
+#if defined(__AVX2__)
+        __m256i acc[2][kWeightTile];
+        for (int j = 0; j < kWeightTile; j++) {
+            acc[0][j] = _mm256_setzero_si256();
+            acc[1][j] = _mm256_setzero_si256();
+        }
+        for (; i + 32 <= in; i += 32) {
+            const __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x0 + i));
+            const __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x1 + i));
+            for (int j = 0; j < kWeightTile; j++) {
+                const __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(wr[j] + i));
+                acc[0][j] = DotStepI8(acc[0][j], r, v0);
+                acc[1][j] = DotStepI8(acc[1][j], r, v1);
+            }
+        }
+        for (int j = 0; j < kWeightTile; j++) {
+            s[0][j] = HorizontalSum(acc[0][j]);
+            s[1][j] = HorizontalSum(acc[1][j]);
+        }
+#endif
+        for (; i < in; i++) {
+            for (int j = 0; j < kWeightTile; j++) {
+                s[0][j] += static_cast<std::int32_t>(wr[j][i]) * x0[i];
+                s[1][j] += static_cast<std::int32_t>(wr[j][i]) * x1[i];
+            }
+        }
+        for (int j = 0; j < kWeightTile; j++) {
+            out0[j] = s[0][j];
+            out1[j] = s[1][j];
+        }
+    }
+
+    // y[r, o] = bias[o] + W[o] . x[r] for the first `out` output channels of w, see Linear.
+    // INT8 weights need activations set with quantize = true.
+    inline void MatMul(const Activations& x, const Matrix& w, const float* bias, int out, float* y, int ldy) {
+        const int rows = x.rows();
+        const int in = x.in();
+        if (!w.quantized()) {
+            Linear(x.x(), rows, in, w.f32, w.ld, bias, out, y, ldy);
+            return;
+        }
+
+        const std::int8_t* q = x.q();
+        std::int32_t tile[kRowTile][kWeightTile];
+        int o = 0;
+        for (; o + kWeightTile <= out; o += kWeightTile) {
+            const std::int8_t* wo = w.i8 + static_cast<size_t>(o) * w.ld;
+            for (int r = 0; r < rows; r += kRowTile) {
+                // odd batch row: run the tile with the row twice and keep one result
+                const int r1 = std::min(r + 1, rows - 1);
+                DotTileI8(wo, w.ld, in, q + static_cast<size_t>(r) * in, q + static_cast<size_t>(r1) * in, tile[0], tile[1]);
+                for (int j = 0; j < kWeightTile; j++) {
+                    const float b = bias ? bias[o + j] : 0.0f;
+                    y[static_cast<size_t>(r) * ldy + o + j] = tile[0][j] * x.scale()[r] * w.scale[o + j] + b;
+                    if (r1 != r) {
+                        y[static_cast<size_t>(r1) * ldy + o + j] = tile[1][j] * x.scale()[r1] * w.scale[o + j] + b;
+                    }
+                }
+            }
+        }
+        for (; o < out; o++) {
+            const std::int8_t* wo = w.i8 + static_cast<size_t>(o) * w.ld;
+            for (int r = 0; r < rows; r++) {
+                y[static_cast<size_t>(r) * ldy + o] = DotI8(wo, q + static_cast<size_t>(r) * in, in) * x.scale()[r] * w.scale[o] +
+                                                      (bias ? bias[o] : 0.0f);
+            }
+        }
+    }
+
+    inline void MatMul(const Activations& x, const Matrix& w, const float* bias, int out, float* y) {
+        MatMul(x, w, bias, out, y, out);
+    }
+}
+
+#endif
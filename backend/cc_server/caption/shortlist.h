@@ -0,0 +1,324 @@
+#ifndef CAPTION_SHORTLIST_H_
+#define CAPTION_SHORTLIST_H_
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+#include "quantize.h"
+
+namespace caption {
+
+    // Restricts fc, log_softmax and the top-k of beam search (DecoderEngine::StepTopK) to the words an image
+    // can plausibly produce. Approx normalizes over the shortlist alone. Guarded checks every row against the
+    // other words: the row keeps the shortlist result only when none of them can enter its top k and their
+    // probability mass is below `tolerance`, otherwise it is recomputed over the whole vocabulary. The other
+    // words are bounded per cluster of fc rows (WordClusters), and the clusters whose bound is not enough are
+    // checked word by word. Guarded results are the full ones within `tolerance` in log-probability.
+    enum class ShortlistMode {
+        Off,
+        Approx,
+        Guarded,
+    };
+
+    struct ShortlistOptions {
+        ShortlistMode mode = ShortlistMode::Off;
+        // best words of fc(init_h(mean encoder feature)), the image prior
+        int image_words = 1000;
+        // best words of the fc bias, the words the model says most often whatever the image
+        int frequent_words = 500;
+        // always in the shortlist, at least <end>
+        std::vector<int> words;
+        float tolerance = 1e-4f;
+    };
+
+    // The guard scores at most vocab_size / kGuardBudgetDivisor words of a row one by one before it gives
+    // the row up: a row that falls back anyway pays for them on top of the whole vocabulary
+    constexpr int kGuardBudgetDivisor = 8;
+
+    // Rows processed by the shortlist and recomputed over the whole vocabulary since the options were set,
+    // and the words outside the shortlist the guard scored one by one
+    struct ShortlistStats {
+        long long rows = 0;
+        long long fallbacks = 0;
+        long long exact_words = 0;
+    };
+
+    // fc rows grouped by k-means for the guard of the shortlist. A word w of cluster c has
+    // fc[w] . h <= centroid[c] . h + radius[c] |h|, so one dot product bounds the logits of the whole cluster.
+    class WordClusters {
+        public:
+            WordClusters() = default;
+            ~WordClusters() = default;
+
+            // 4 sqrt(vocab_size) clusters: their bounds cost a row a few percent of fc, and they are small
+            // enough for the bounds to hold
+            static int DefaultCount(int vocab_size) {
+                return std::max(1, static_cast<int>(std::lround(4.0 * std::sqrt(static_cast<double>(vocab_size)))));
+            }
+
+            bool empty() const { return radius_.empty(); }
+            int size() const { return static_cast<int>(radius_.size()); }
+            int in() const { return in_; }
+            int cluster(int w) const { return cluster_[w]; }
+            const float* centroid(int c) const { return centroids_.data() + static_cast<size_t>(c) * in_; }
+            float radius(int c) const { return radius_[c]; }
+
+            // Lloyd iterations from evenly spaced rows, on the dequantized rows of INT8 weights
+            void Build(const Matrix& fc, int vocab_size, int in, int clusters, int iterations = 8) {
+                const size_t V = static_cast<size_t>(vocab_size);
+                const int C = std::min(clusters, vocab_size);
+                in_ = in;
+                std::vector<float> rows(V * in);
+                for (size_t w = 0; w < V; w++) {
+                    for (int i = 0; i < in; i++) {
+                        rows[w * in + i] = fc.quantized() ? fc.scale[w] * fc.i8[w * fc.ld + i] : fc.f32[w * fc.ld + i];
+                    }
+                }
+
+                centroids_.resize(static_cast<size_t>(C) * in);
+                for (int c = 0; c < C; c++) {
+                    std::copy(&rows[c * V / C * in], &rows[c * V / C * in] + in, centroids_.begin() + static_cast<size_t>(c) * in);
+                }
+                cluster_.assign(V, 0);
+                std::vector<float> sums(centroids_.size());
+                std::vector<int> counts(C);
+                for (int it = 0; it < iterations; it++) {
+                    Assign(rows.data(), vocab_size, C);
+                    std::fill(sums.begin(), sums.end(), 0.0f);
+                    std::fill(counts.begin(), counts.end(), 0);
+                    for (size_t w = 0; w < V; w++) {
+                        Axpy(1.0f, &rows[w * in], &sums[static_cast<size_t>(cluster_[w]) * in], in);
+                        counts[cluster_[w]]++;
+                    }
+                    // an empty cluster keeps its centroid
+                    for (int c = 0; c < C; c++) {
+                        for (int i = 0; counts[c] > 0 && i < in; i++) {
+                            centroids_[static_cast<size_t>(c) * in + i] = sums[static_cast<size_t>(c) * in + i] / counts[c];
+                        }
+                    }
+                }
+
+                Assign(rows.data(), vocab_size, C);
+                radius_.assign(C, 0.0f);
+                for (size_t w = 0; w < V; w++) {
+                    const float* mu = centroid(cluster_[w]);
+                    float d = 0.0f;
+                    for (int i = 0; i < in; i++) {
+                        d += (rows[w * in + i] - mu[i]) * (rows[w * in + i] - mu[i]);
+                    }
+                    radius_[cluster_[w]] = std::max(radius_[cluster_[w]], std::sqrt(d));
+                }
+            }
+
+        private:
+            int in_ = 0;
+            std::vector<float> centroids_;
+            std::vector<float> radius_;
+            std::vector<int> cluster_;
+
+            // nearest centroid of every row: the largest mu . w - |mu|^2 / 2, as a Linear over blocks of rows
+            void Assign(const float* rows, int vocab_size, int clusters) {
+                const int block = 256;
+                std::vector<float> bias(clusters);
+                for (int c = 0; c < clusters; c++) {
+                    bias[c] = -0.5f * Dot(centroid(c), centroid(c), in_);
+                }
+                std::vector<float> scores(static_cast<size_t>(block) * clusters);
+                for (int w = 0; w < vocab_size; w += block) {
+                    const int n = std::min(block, vocab_size - w);
+                    Linear(rows + static_cast<size_t>(w) * in_, n, in_, centroids_.data(), bias.data(), clusters, scores.data());
+                    for (int j = 0; j < n; j++) {
+                        const float* row = scores.data() + static_cast<size_t>(j) * clusters;
+                        cluster_[w + j] = static_cast<int>(std::max_element(row, row + clusters) - row);
+                    }
+                }
+            }
+    };
+
+    // fc restricted to the shortlist of one image, with the words left out grouped by cluster for the guard
+    class Shortlist {
+        public:
+            Shortlist() = default;
+            ~Shortlist() = default;
+
+            bool empty() const { return words_.empty(); }
+            int size() const { return static_cast<int>(words_.size()); }
+            const int* words() const { return words_.data(); }
+            const float* bias() const { return bias_.data(); }
+
+            // words are sorted and unique, clusters null without the guard. A shortlist built again reuses
+            // its buffers.
+            void Build(const Matrix& fc, const float* fc_b, const WordClusters* clusters, int vocab_size, int in,
+                       const std::vector<int>& words) {
+                words_.assign(words.begin(), words.end());
+                in_ = in;
+                const size_t n = words_.size();
+                weight_f32_.clear();
+                weight_i8_.clear();
+                scale_.clear();
+                bias_.resize(n);
+                if (fc.quantized()) {
+                    weight_i8_.resize(n * in);
+                    scale_.resize(n);
+                } else {
+                    weight_f32_.resize(n * in);
+                }
+                for (size_t i = 0; i < n; i++) {
+                    const size_t w = static_cast<size_t>(words_[i]);
+                    if (fc.quantized()) {
+                        std::copy(fc.i8 + w * fc.ld, fc.i8 + w * fc.ld + in, weight_i8_.begin() + i * in);
+                        scale_[i] = fc.scale[w];
+                    } else {
+                        std::copy(fc.f32 + w * fc.ld, fc.f32 + w * fc.ld + in, weight_f32_.begin() + i * in);
+                    }
+                    bias_[i] = fc_b[w];
+                }
+
+                other_begin_.clear();
+                if (!clusters) {
+                    return;
+                }
+                // the other words by cluster, with the largest bias and the log-sum-exp of the biases of each
+                const int C = clusters->size();
+                other_begin_.assign(C + 1, 0);
+                auto next = words_.begin();
+                for (int w = 0; w < vocab_size; w++) {
+                    if (next != words_.end() && *next == w) {
+                        ++next;
+                        continue;
+                    }
+                    other_begin_[clusters->cluster(w) + 1]++;
+                }
+                for (int c = 0; c < C; c++) {
+                    other_begin_[c + 1] += other_begin_[c];
+                }
+                other_words_.resize(other_begin_[C]);
+                other_bias_.resize(other_begin_[C]);
+                other_max_bias_.assign(C, -std::numeric_limits<float>::infinity());
+                other_lse_bias_.assign(C, 0.0f);
+                other_fill_.assign(other_begin_.begin(), other_begin_.end() - 1);
+                next = words_.begin();
+                for (int w = 0; w < vocab_size; w++) {
+                    if (next != words_.end() && *next == w) {
+                        ++next;
+                        continue;
+                    }
+                    const int c = clusters->cluster(w);
+                    other_words_[other_fill_[c]] = w;
+                    other_bias_[other_fill_[c]++] = fc_b[w];
+                    other_max_bias_[c] = std::max(other_max_bias_[c], fc_b[w]);
+                }
+                for (int c = 0; c < C; c++) {
+                    float sum = 0.0f;
+                    for (int i = other_begin_[c]; i < other_begin_[c + 1]; i++) {
+                        sum += std::exp(other_bias_[i] - other_max_bias_[c]);
+                    }
+                    other_lse_bias_[c] = other_max_bias_[c] + std::log(sum);
+                }
+            }
+
+            Matrix weight() const {
+                Matrix m;
+                m.ld = in_;
+                if (!weight_i8_.empty()) {
+                    m.i8 = weight_i8_.data();
+                    m.scale = scale_.data();
+                } else {
+                    m.f32 = weight_f32_.data();
+                }
+                return m;
+            }
+
+            // Whether the shortlist result of a row stands: h is the row as fc sees it (dequantized for INT8
+            // weights), lse the log-sum-exp of the shortlist logits and last the logit of the k-th best word.
+            // logit(w) is the exact fc[w] . h without bias, for the clusters whose bound is not enough; past
+            // `budget` such words the row is given up, the whole vocabulary is cheaper by then.
+            // bounds is scratch of clusters.size() floats, exact_words counts the words it scored.
+            template <typename Logit>
+            bool Covers(const WordClusters& clusters, const float* h, float lse, float last, float tolerance,
+                        int budget, float* bounds, const Logit& logit, long long* exact_words) const {
+                const int C = clusters.size();
+                const int D = clusters.in();
+                const float h_norm = std::sqrt(Dot(h, h, D));
+                // bounds[c]: the mass bound of cluster c, -1 when one of its words may enter the top k
+                double mass = 0.0;
+                for (int c = 0; c < C; c++) {
+                    bounds[c] = 0.0f;
+                    if (other_begin_[c] == other_begin_[c + 1]) {
+                        continue;
+                    }
+                    const float top = Dot(clusters.centroid(c), h, D) + clusters.radius(c) * h_norm;
+                    if (top + other_max_bias_[c] > last) {
+                        bounds[c] = -1.0f;
+                        continue;
+                    }
+                    bounds[c] = std::exp(top + other_lse_bias_[c] - lse);
+                    mass += bounds[c];
+                }
+                for (int c = 0; c < C; c++) {
+                    if (bounds[c] < 0.0f && !Exact(c, lse, last, logit, &mass, &budget, exact_words)) {
+                        return false;
+                    }
+                }
+                // the largest bounds first until the mass fits
+                while (mass > tolerance) {
+                    int worst = -1;
+                    for (int c = 0; c < C; c++) {
+                        if (bounds[c] > 0.0f && (worst < 0 || bounds[c] > bounds[worst])) {
+                            worst = c;
+                        }
+                    }
+                    if (worst < 0) {
+                        return false;
+                    }
+                    mass -= bounds[worst];
+                    bounds[worst] = 0.0f;
+                    if (!Exact(worst, lse, last, logit, &mass, &budget, exact_words)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+        private:
+            std::vector<int> words_;
+            int in_ = 0;
+            std::vector<float> weight_f32_;
+            std::vector<std::int8_t> weight_i8_;
+            std::vector<float> scale_;
+            std::vector<float> bias_;
+            // the other words of cluster c are other_words_[other_begin_[c], other_begin_[c + 1])
+            std::vector<int> other_begin_;
+            std::vector<int> other_fill_;
+            std::vector<int> other_words_;
+            std::vector<float> other_bias_;
+            std::vector<float> other_max_bias_;
+            std::vector<float> other_lse_bias_;
+
+            // Adds the mass of the other words of cluster c; false when one of them enters the top k or the
+            // budget of words runs out
+            template <typename Logit>
+            bool Exact(int c, float lse, float last, const Logit& logit, double* mass, int* budget,
+                       long long* exact_words) const {
+                const int n = other_begin_[c + 1] - other_begin_[c];
+                if (n > *budget) {
+                    return false;
+                }
+                *budget -= n;
+                *exact_words += n;
+                for (int i = other_begin_[c]; i < other_begin_[c + 1]; i++) {
+                    const float l = logit(other_words_[i]) + other_bias_[i];
+                    if (l > last) {
+                        return false;
+                    }
+                    *mass += std::exp(l - lse);
+                }
+                return true;
+            }
+    };
+}
+
+#endif
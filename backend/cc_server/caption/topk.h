@@ -0,0 +1,118 @@
+#ifndef CAPTION_TOPK_H_
+#define CAPTION_TOPK_H_
+
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace caption {
+
+    struct Candidate {
+        float score;
+        int index;
+    };
+
+    // Partial top-k selection: keeps the k largest values seen so far in a min-heap. Values are scanned
+    // with SIMD compares against the smallest kept value, so only the few that beat it reach the heap.
+    class TopK {
+        public:
+            explicit TopK(int capacity = 0) : k_(capacity), size_(0), heap_(capacity) {}
+            ~TopK() = default;
+
+            // Starts a new selection of the k largest values, the heap only grows
+            void Reset(int k) {
+                if (k > static_cast<int>(heap_.size())) {
+                    heap_.resize(k);
+                }
+                k_ = k;
+                size_ = 0;
+            }
+
+            float threshold() const {
+                return size_ < k_ ? -std::numeric_limits<float>::infinity() : heap_[0].score;
+            }
+
+            void Push(float score, int index) {
+                if (size_ < k_) {
+                    int i = size_++;
+                    while (i > 0 && heap_[(i - 1) / 2].score > score) {
+                        heap_[i] = heap_[(i - 1) / 2];
+                        i = (i - 1) / 2;
+                    }
+                    heap_[i] = Candidate{score, index};
+                } else if (k_ > 0 && score > heap_[0].score) {
+                    SiftDown(Candidate{score, index});
+                }
+            }
+
+            // Offers offset + values[i] with index base + i, for i < n
+            void Scan(const float* values, int n, float offset, int base) {
+                int i = 0;
+#if defined(__AVX512F__)
+                for (; i + 16 <= n; i += 16) {
+                    __m512 v = _mm512_loadu_ps(values + i);
+                    __mmask16 mask = _mm512_cmp_ps_mask(v, _mm512_set1_ps(threshold() - offset), _CMP_GT_OQ);
+                    while (mask) {
+                        int j = __builtin_ctz(mask);
+                        Push(values[i + j] + offset, base + i + j);
+                        mask &= mask - 1;
+                    }
+                }
+#elif defined(__AVX2__)
+                for (; i + 8 <= n; i += 8) {
+                    __m256 v = _mm256_loadu_ps(values + i);
+                    int mask = _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(threshold() - offset), _CMP_GT_OQ));
+                    while (mask) {
+                        int j = __builtin_ctz(mask);
+                        Push(values[i + j] + offset, base + i + j);
+                        mask &= mask - 1;
+                    }
+                }
+#endif
+                for (; i < n; i++) {
+                    if (values[i] + offset > threshold()) {
+                        Push(values[i] + offset, base + i);
+                    }
+                }
+            }
+
+            // Kept candidates, best first; returns how many
+            int Sorted(Candidate* out) const {
+                std::copy(heap_.begin(), heap_.begin() + size_, out);
+                std::sort(out, out + size_, [](const Candidate& a, const Candidate& b) {
+                    return a.score > b.score || (a.score == b.score && a.index < b.index);
+                });
+                return size_;
+            }
+
+        private:
+            int k_;
+            int size_;
+            std::vector<Candidate> heap_;
+
+            void SiftDown(Candidate c) {
+                int i = 0;
+                while (true) {
+                    int child = 2 * i + 1;
+                    if (child >= size_) {
+                        break;
+                    }
+                    if (child + 1 < size_ && heap_[child + 1].score < heap_[child].score) {
+                        child++;
+                    }
+                    if (heap_[child].score >= c.score) {
+                        break;
+                    }
+                    heap_[i] = heap_[child];
+                    i = child;
+                }
+                heap_[i] = c;
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef CAPTION_WEIGHTS_H_
+#define CAPTION_WEIGHTS_H_
+
+#include <map>
+#include <climits>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "mapped_file.h"
+
+namespace caption {
+
+    // Weight file written by AI_module/export_weights.py:
+    // - header : char magic[4] = "ICWT", u32 version, u32 tensor count, u32 reserved
+    // - entries: count x { char name[96], u32 dtype, u32 ndim, u32 dims[4], u64 offset, u64 nbytes }
+    // - data   : every tensor starts at a 64-byte aligned offset from the start of the file
+    // Names are the keys of DecoderWithAttention.state_dict(), all little-endian. An INT8 weight "x.weight"
+    // (export_weights.py --int8) comes with a float32 "x.weight.scale" of one scale per output channel.
+    // With --encoder the file also holds the Encoder, "encoder." + its state_dict() keys with every BatchNorm
+    // folded into the convolution before it (AI_module/weight_pack.py loads it back into PyTorch).
+    constexpr char kWeightMagic[4] = {'I', 'C', 'W', 'T'};
+    constexpr std::uint32_t kWeightVersion = 1;
+    constexpr size_t kWeightAlignment = 64;
+    constexpr size_t kWeightNameSize = 96;
+
+    enum class DType : std::uint32_t {
+        F32 = 0,
+        I8 = 1
+    };
+
+    inline size_t ElementSize(DType dtype) {
+        switch (dtype) {
+            case DType::F32:
+                return sizeof(float);
+            case DType::I8:
+                return sizeof(std::int8_t);
+            default:
+                return 0;
+        }
+    }
+
+    struct Tensor {
+        std::string name;
+        DType dtype;
+        std::vector<int> dims;
+        const void* data;
+        size_t nbytes;
+
+        const float* f32() const { return static_cast<const float*>(data); }
+        const std::int8_t* i8() const { return static_cast<const std::int8_t*>(data); }
+
+        size_t size() const {
+            size_t n = 1;
+            for (int d : dims) {
+                n *= d;
+            }
+            return n;
+        }
+    };
+
+    // The file is mapped, not read: tensors point into the shared read-only mapping, see MappedFile
+    struct WeightFileOptions {
+        bool populate = false;
+        bool lock = false;
+    };
+
+    class WeightFile {
+        public:
+            explicit WeightFile(const std::string& path, const WeightFileOptions& options = WeightFileOptions())
+                : file_(path, options.populate, options.lock) {
+                Load(path);
+            }
+            ~WeightFile() = default;
+            WeightFile(const WeightFile&) = delete;
+            WeightFile& operator=(const WeightFile&) = delete;
+
+            bool Has(const std::string& name) const {
+                return tensors_.count(name) > 0;
+            }
+
+            const Tensor& Get(const std::string& name) const {
+                auto it = tensors_.find(name);
+                if (it == tensors_.end()) {
+                    throw std::runtime_error("Weight file has no tensor " + name);
+                }
+                return it->second;
+            }
+
+            // Same as Get, and checks the type and shape of the tensor
+            const Tensor& Get(const std::string& name, std::initializer_list<int> dims, DType dtype = DType::F32) const {
+                const Tensor& tensor = Get(name);
+                if (tensor.dtype != dtype || !std::equal(dims.begin(), dims.end(), tensor.dims.begin(), tensor.dims.end())) {
+                    throw std::runtime_error("Unexpected shape or type of tensor " + name);
+                }
+                return tensor;
+            }
+
+            const std::map<std::string, Tensor>& tensors() const { return tensors_; }
+
+        private:
+            struct Header {
+                char magic[4];
+                std::uint32_t version;
+                std::uint32_t count;
+                std::uint32_t reserved;
+            };
+
+            struct Entry {
+                char name[kWeightNameSize];
+                std::uint32_t dtype;
+                std::uint32_t ndim;
+                std::uint32_t dims[4];
+                std::uint64_t offset;
+                std::uint64_t nbytes;
+            };
+
+            MappedFile file_;
+            std::map<std::string, Tensor> tensors_;
+
+            void Load(const std::string& path) {
+                // the mapping starts on a page, so the aligned offsets are aligned addresses
+                const char* base = file_.data();
+                const size_t size = file_.size();
+
+                Header header;
+                if (size < sizeof(Header)) {
+                    throw std::runtime_error("Weight file is truncated");
+                }
+                std::memcpy(&header, base, sizeof(Header));
+                if (std::memcmp(header.magic, kWeightMagic, 4) != 0) {
+                    throw std::runtime_error("Not a weight file: " + path);
+                }
+                if (header.version != kWeightVersion) {
+                    throw std::runtime_error("Unsupported weight file version " + std::to_string(header.version));
+                }
+                if (sizeof(Header) + static_cast<size_t>(header.count) * sizeof(Entry) > size) {
+                    throw std::runtime_error("Weight file is truncated");
+                }
+
+                for (std::uint32_t i = 0; i < header.count; i++) {
+                    Entry entry;
+                    std::memcpy(&entry, base + sizeof(Header) + i * sizeof(Entry), sizeof(Entry));
+                    // written so that a crafted offset or size cannot wrap around
+                    if (entry.ndim > 4 || entry.offset % kWeightAlignment != 0 || entry.nbytes > size ||
+                        entry.offset > size - entry.nbytes) {
+                        throw std::runtime_error("Corrupt weight file entry");
+                    }
+                    // every dimension fits an int and their product fits the entry's bytes
+                    std::uint64_t elements = 1;
+                    for (std::uint32_t d = 0; d < entry.ndim; d++) {
+                        if (entry.dims[d] > static_cast<std::uint32_t>(INT_MAX) ||
+                            (entry.dims[d] > 0 && elements > entry.nbytes / entry.dims[d])) {
+                            throw std::runtime_error("Corrupt weight file entry");
+                        }
+                        elements *= entry.dims[d];
+                    }
+
+                    Tensor tensor;
+                    tensor.name.assign(entry.name, strnlen(entry.name, kWeightNameSize));
+                    tensor.dtype = static_cast<DType>(entry.dtype);
+                    tensor.dims.assign(entry.dims, entry.dims + entry.ndim);
+                    tensor.data = base + entry.offset;
+                    tensor.nbytes = entry.nbytes;
+                    if (ElementSize(tensor.dtype) == 0 || tensor.size() * ElementSize(tensor.dtype) != tensor.nbytes) {
+                        throw std::runtime_error("Corrupt weight file entry " + tensor.name);
+                    }
+                    tensors_[tensor.name] = tensor;
+                }
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef CAPTION_WORD_MAP_H_
+#define CAPTION_WORD_MAP_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace caption {
+
+    // AI_module/data/WORDMAP.json: one JSON object of word -> index, written by json.dump, so the Chinese
+    // words come as \uXXXX escapes
+    class WordMap {
+        public:
+            explicit WordMap(const std::string& path) { Load(path); }
+            ~WordMap() = default;
+
+            int size() const { return static_cast<int>(words_.size()); }
+
+            int id(const std::string& word) const {
+                auto it = ids_.find(word);
+                if (it == ids_.end()) {
+                    throw std::runtime_error("Word map has no " + word);
+                }
+                return it->second;
+            }
+
+            // The caption of a decoded sequence, without <start>, <end> and <pad>
+            std::string Join(const std::vector<int>& seq) const {
+                std::string caption;
+                for (int w : seq) {
+                    if (w == start_ || w == end_ || w == pad_ || w < 0 || w >= size()) {
+                        continue;
+                    }
+                    caption += words_[w];
+                }
+                return caption;
+            }
+
+        private:
+            std::map<std::string, int> ids_;
+            std::vector<std::string> words_;
+            int start_ = -1;
+            int end_ = -1;
+            int pad_ = -1;
+
+            void Load(const std::string& path) {
+                std::ifstream file(path, std::ios::binary);
+                if (!file.is_open()) {
+                    throw std::runtime_error("Failed to open word map " + path);
+                }
+                std::stringstream buffer;
+                buffer << file.rdbuf();
+                const std::string json = buffer.str();
+
+                size_t i = Skip(json, 0);
+                Expect(json, i++, '{');
+                while (true) {
+                    i = Skip(json, i);
+                    if (i < json.size() && json[i] == '}') {
+                        break;
+                    }
+                    std::string word = ParseString(json, &i);
+                    i = Skip(json, i);
+                    Expect(json, i++, ':');
+                    i = Skip(json, i);
+                    size_t end = i;
+                    while (end < json.size() && json[end] >= '0' && json[end] <= '9') {
+                        end++;
+                    }
+                    if (end == i) {
+                        throw std::runtime_error("Word map index is not a number");
+                    }
+                    ids_[word] = std::stoi(json.substr(i, end - i));
+                    i = Skip(json, end);
+                    if (i < json.size() && json[i] == ',') {
+                        i++;
+                    }
+                }
+
+                words_.assign(ids_.size(), std::string());
+                for (const auto& entry : ids_) {
+                    if (entry.second >= static_cast<int>(words_.size())) {
+                        throw std::runtime_error("Word map indices are not contiguous");
+                    }
+                    words_[entry.second] = entry.first;
+                }
+                start_ = id("<start>");
+                end_ = id("<end>");
+                pad_ = ids_.count("<pad>") ? id("<pad>") : -1;
+            }
+
+            static size_t Skip(const std::string& json, size_t i) {
+                while (i < json.size() && (json[i] == ' ' || json[i] == '\n' || json[i] == '\r' || json[i] == '\t')) {
+                    i++;
+                }
+                return i;
+            }
+
+            static void Expect(const std::string& json, size_t i, char c) {
+                if (i >= json.size() || json[i] != c) {
+                    throw std::runtime_error(std::string("Word map: expected ") + c);
+                }
+            }
+
+            static unsigned Hex4(const std::string& json, size_t i) {
+                if (i + 4 > json.size()) {
+                    throw std::runtime_error("Word map: truncated escape");
+                }
+                return static_cast<unsigned>(std::stoul(json.substr(i, 4), nullptr, 16));
+            }
+
+            static void AppendUtf8(unsigned code, std::string* out) {
+                if (code < 0x80) {
+                    out->push_back(static_cast<char>(code));
+                } else if (code < 0x800) {
+                    out->push_back(static_cast<char>(0xC0 | (code >> 6)));
+                    out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                } else if (code < 0x10000) {
+                    out->push_back(static_cast<char>(0xE0 | (code >> 12)));
+                    out->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                    out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                } else {
+                    out->push_back(static_cast<char>(0xF0 | (code >> 18)));
+                    out->push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+                    out->push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                    out->push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                }
+            }
+
+            static std::string ParseString(const std::string& json, size_t* pos) {
+                size_t i = *pos;
+                Expect(json, i++, '"');
+                std::string s;
+                while (i < json.size() && json[i] != '"') {
+                    if (json[i] != '\\') {
+                        s.push_back(json[i++]);
+                        continue;
+                    }
+                    if (++i >= json.size()) {
+                        break;
+                    }
+                    char c = json[i++];
+                    switch (c) {
+                        case 'n': s.push_back('\n'); break;
+                        case 't': s.push_back('\t'); break;
+                        case 'r': s.push_back('\r'); break;
+                        case 'b': s.push_back('\b'); break;
+                        case 'f': s.push_back('\f'); break;
+                        case 'u': {
+                            unsigned code = Hex4(json, i);
+                            i += 4;
+                            // UTF-16 surrogate pair
+                            if (code >= 0xD800 && code < 0xDC00 && i + 6 <= json.size() && json[i] == '\\' && json[i + 1] == 'u') {
+                                unsigned low = Hex4(json, i + 2);
+                                if (low >= 0xDC00 && low < 0xE000) {
+                                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                                    i += 6;
+                                }
+                            }
+                            AppendUtf8(code, &s);
+                            break;
+                        }
+                        default: s.push_back(c); break;
+                    }
+                }
+                Expect(json, i++, '"');
+                *pos = i;
+                return s;
+            }
+    };
+}
+
+#endif
@@ -52,6 +52,8 @@ namespace http_server {
         NotFound = 404,
         MethodNotAllowed = 405,
         RequestTimeout = 408,
+        PayloadTooLarge = 413,
+        UnsupportedMediaType = 415,
         ImATeapot = 418,
         InternalServerError = 500,
         NotImplemented = 501,
@@ -109,6 +111,8 @@ namespace http_server {
                 return "OK";
             case HttpStatusCode::Accepted:
                 return "Accepted";
+            case HttpStatusCode::NoContent:
+                return "No Content";
             case HttpStatusCode::MovedPermanently:
                 return "Moved Permanently";
             case HttpStatusCode::Found:
@@ -121,6 +125,10 @@ namespace http_server {
                 return "Not Found";
             case HttpStatusCode::MethodNotAllowed:
                 return "Method Not Allowed";
+            case HttpStatusCode::PayloadTooLarge:
+                return "Payload Too Large";
+            case HttpStatusCode::UnsupportedMediaType:
+                return "Unsupported Media Type";
             case HttpStatusCode::ImATeapot:
                 return "I'm a Teapot";
             case HttpStatusCode::InternalServerError:
@@ -285,6 +293,20 @@ namespace http_server {
             HttpStatusCode status_code_;
     };
 
+    // Takes the body of a request while it is still being received, for handlers that can start on it early.
+    // The server parses the headers, creates the reader, hands it every piece of the body and sends what
+    // Finish returns once the body is complete or Consume gives up.
+    class HttpBodyReader {
+        public:
+            virtual ~HttpBodyReader() = default;
+
+            // false stops reading: the rest of the body is not received and the connection is closed after
+            // the response
+            virtual bool Consume(const char* data, size_t size) = 0;
+
+            virtual HttpResponse Finish() = 0;
+    };
+
     std::string to_string(const HttpRequest& request) {
         std::ostringstream oss;
 
@@ -370,7 +392,10 @@ namespace http_server {
             request.SetHeader(key, value);
         }
 
-        request.SetContent(message_body);
+        // the server parses the headers alone first, their Content-Length must survive that
+        if (!message_body.empty()) {
+            request.SetContent(message_body);
+        }
         return request;
     }
     
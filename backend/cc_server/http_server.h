@@ -8,11 +8,17 @@
 
 #include <unistd.h>
 #include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include <thread>
 #include <random>
 #include <map>
 #include <cerrno>
 #include <chrono>
+#include <exception>
+#include <stdexcept>
 #include <cstring>
 
 #include "wepoll/wepoll.h"
@@ -20,18 +26,37 @@
 #include "uri.h"
 
 namespace http_server {
-    const size_t kMaxBufferSize = 0x7fffffff;
+    // Bytes read from a socket at a time, the most the headers of a request may take, and the most a body is
+    // collected up to when no body reader takes it (uploads are bounded by their reader, see ImageLimits)
+    const size_t kRecvSize = 64 * 1024;
+    const size_t kMaxHeaderSize = 64 * 1024;
+    const size_t kMaxBodySize = 64 * 1024;
 
     struct EventData {
-        EventData() : fd(0), length(0), cursor(0), buffer() {}
+        EventData() : fd(0), length(0), cursor(0), body_offset(std::string::npos), content_length(0),
+                      body_received(0), close(false) {}
         SOCKET fd;
         size_t length;
         size_t cursor;
-        char buffer[kMaxBufferSize];
+        // Request: what has been received so far, the body too unless a reader takes it. Response: the message
+        std::string buffer;
+        // Request: where the body starts in buffer once the headers are in, its Content-Length and how much of
+        // it has come
+        size_t body_offset;
+        size_t content_length;
+        size_t body_received;
+        HttpRequest head;
+        std::unique_ptr<HttpBodyReader> reader;
+        // Request: why it was rejected while it was read, answered by HandleHttpData like a handler's exception
+        std::exception_ptr error;
+        // Close the connection once the response is sent, the rest of the request was not read
+        bool close;
     };
 
     // Argument is HttpRequest and return is HttpResponse
     using HttpRequestHandler_t = std::function<HttpResponse(const HttpRequest&)>;
+    // Argument is the request without its body, return is the reader of the body
+    using HttpBodyReaderFactory_t = std::function<std::unique_ptr<HttpBodyReader>(const HttpRequest&)>;
 
     LPCWSTR ConvertToLPCWSTR(const char* str)
     {
@@ -119,6 +144,12 @@ namespace http_server {
                 Uri uri(path);
                 request_handlers_[uri].insert(std::make_pair(method, std::move(callback)));
             }
+
+            // The body of these requests goes to a reader as it is received, instead of being collected first
+            void RegisterHttpBodyReader(const std::string& path, HttpMethod method, const HttpBodyReaderFactory_t factory) {
+                Uri uri(path);
+                body_readers_[uri].insert(std::make_pair(method, std::move(factory)));
+            }
             
             std::string host() const { return host_; }
             std::uint16_t port() const { return port_; }
@@ -139,6 +170,7 @@ namespace http_server {
             HANDLE worker_epoll_fd_[kThreadPoolSize];
             epoll_event worker_events_[kThreadPoolSize][kMaxEvents];
             std::map<Uri, std::map<HttpMethod, HttpRequestHandler_t>> request_handlers_;
+            std::map<Uri, std::map<HttpMethod, HttpBodyReaderFactory_t>> body_readers_;
             std::mt19937 rng_;
             std::uniform_int_distribution<int> sleep_times_;
 
@@ -249,8 +281,14 @@ namespace http_server {
                 if (events == EPOLLIN) {
                     // Read from socket
                     request = data;
-                    ssize_t byte_count = recv(fd, request->buffer, kMaxBufferSize, 0);
+                    thread_local std::vector<char> chunk(kRecvSize);
+                    ssize_t byte_count = recv(fd, chunk.data(), kRecvSize, 0);
                     if (byte_count > 0) {
+                        if (!ReceiveHttpData(request, chunk.data(), byte_count)) {
+                            // The request is not complete yet, wait for the rest
+                            control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
+                            return;
+                        }
                         response = new EventData();
                         response->fd = fd;
                         // Process request and return response
@@ -277,13 +315,18 @@ namespace http_server {
                 } else {
                     // Write to socket
                     response = data;
-                    ssize_t byte_count = send(fd, response->buffer + response->cursor, response->length, 0);
+                    ssize_t byte_count = send(fd, response->buffer.data() + response->cursor, response->length, 0);
                     if (byte_count >= 0) {
                         if (byte_count < response->length) {  
                             // There are still bytes to write
                             response->cursor += byte_count;
                             response->length -= byte_count;
                             control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
+                        } else if (response->close) {
+                            // The request was answered before all of it was read
+                            control_epoll_event(epoll_fd, EPOLL_CTL_DEL, fd);
+                            closesocket(fd);
+                            delete response;
                         } else {  
                             // We have written the complete message, then change to receive mode
                             request = new EventData();
@@ -305,17 +348,120 @@ namespace http_server {
                 }
             }
 
+            // Adds what recv returned to the request, true once it is complete or rejected. The body goes to the
+            // reader registered for the request as it comes, otherwise it is collected up to its Content-Length.
+            bool ReceiveHttpData(EventData* request, const char* data, size_t size) {
+                if (request->body_offset == std::string::npos) {
+                    request->buffer.append(data, size);
+                    size_t end = request->buffer.find("\r\n\r\n");
+                    if (end == std::string::npos) {
+                        // what follows oversized headers cannot be told apart from the next request
+                        request->close = request->buffer.size() > kMaxHeaderSize;
+                        return request->close;
+                    }
+                    request->body_offset = end + 4;
+                    try {
+                        request->head = string_to_request(request->buffer.substr(0, request->body_offset));
+                    } catch (const std::exception&) {
+                        // HandleHttpData parses it again and answers the error, the body is not read
+                        request->close = true;
+                        return true;
+                    }
+                    std::string content_length = request->head.header("Content-Length");
+                    if (content_length.find_first_not_of("0123456789") != std::string::npos || content_length.size() > 18) {
+                        request->body_offset = std::string::npos;
+                        request->close = true;
+                        return true;
+                    }
+                    request->content_length = content_length.empty() ? 0 : std::stoull(content_length);
+
+                    HttpBodyReaderFactory_t* factory = FindBodyReader(request->head);
+                    if (factory != nullptr) {
+                        try {
+                            request->reader = (*factory)(request->head);
+                        } catch (const std::exception&) {
+                            // answered like the exception of a handler, the body is not read
+                            request->error = std::current_exception();
+                            request->close = true;
+                            return true;
+                        }
+                        std::string body = request->buffer.substr(request->body_offset);
+                        request->buffer.resize(request->body_offset);
+                        return ConsumeBody(request, body.data(), body.size());
+                    }
+                    if (request->content_length > kMaxBodySize) {
+                        request->error = std::make_exception_ptr(std::length_error("Request body too large"));
+                        request->close = true;
+                        return true;
+                    }
+                    request->body_received = request->buffer.size() - request->body_offset;
+                    return request->body_received >= request->content_length;
+                }
+
+                if (request->reader) {
+                    return ConsumeBody(request, data, size);
+                }
+                request->buffer.append(data, size);
+                request->body_received += size;
+                return request->body_received >= request->content_length;
+            }
+
+            bool ConsumeBody(EventData* request, const char* data, size_t size) {
+                size = std::min(size, request->content_length - request->body_received);
+                request->body_received += size;
+                bool more = true;
+                try {
+                    more = size == 0 || request->reader->Consume(data, size);
+                } catch (const std::exception&) {
+                    // a reader that throws (out of memory, a failed decode) is answered like a handler that throws
+                    request->error = std::current_exception();
+                    request->close = true;
+                    return true;
+                }
+                if (!more) {
+                    request->close = request->body_received < request->content_length;
+                    return true;
+                }
+                return request->body_received >= request->content_length;
+            }
+
+            HttpBodyReaderFactory_t* FindBodyReader(const HttpRequest& request) {
+                auto it = body_readers_.find(request.uri());
+                if (it == body_readers_.end()) {
+                    return nullptr;
+                }
+                auto factory_it = it->second.find(request.method());
+                return factory_it == it->second.end() ? nullptr : &factory_it->second;
+            }
+
             void HandleHttpData(const EventData& raw_request, EventData* raw_response) {
-                std::string request_string(raw_request.buffer), response_string;
+                std::string response_string;
                 HttpRequest http_request;
                 HttpResponse http_response;
 
                 try {
-                    http_request = string_to_request(request_string);
-                    http_response = HandleHttpRequest(http_request);
+                    if (raw_request.error) {
+                        // a body reader that could not be made or that threw, or a body over kMaxBodySize
+                        http_request = raw_request.head;
+                        std::rethrow_exception(raw_request.error);
+                    }
+                    if (raw_request.body_offset == std::string::npos) {
+                        // headers over kMaxHeaderSize or an invalid Content-Length
+                        throw std::invalid_argument("Invalid request header");
+                    }
+                    if (raw_request.reader) {
+                        http_request = raw_request.head;
+                        http_response = raw_request.reader->Finish();
+                    } else {
+                        http_request = string_to_request(raw_request.buffer);
+                        http_response = HandleHttpRequest(http_request);
+                    }
                 } catch (const std::invalid_argument &e) {
                     http_response = HttpResponse(HttpStatusCode::BadRequest);
                     http_response.SetContent("Bad Request.");
+                } catch (const std::length_error &e) {
+                    http_response = HttpResponse(HttpStatusCode::PayloadTooLarge);
+                    http_response.SetContent("Payload Too Large.");
                 } catch (const std::logic_error &e) {
                     http_response = HttpResponse(HttpStatusCode::HttpVersionNotSupported);
                     http_response.SetContent("Http Version Not Supported.");
@@ -325,10 +471,13 @@ namespace http_server {
                 }
 
                 // Set response to write to client
+                if (raw_request.close) {
+                    http_response.SetHeader("Connection", "close");
+                    raw_response->close = true;
+                }
                 response_string = to_string(http_response, http_request.method() != HttpMethod::HEAD);
-                int response_len = std::strlen(response_string.c_str()) > kMaxBufferSize ? kMaxBufferSize : std::strlen(response_string.c_str());
-                memcpy(raw_response->buffer, response_string.c_str(), response_len);
-                raw_response->length = response_string.length();
+                raw_response->buffer = std::move(response_string);
+                raw_response->length = raw_response->buffer.length();
                 
                 if (to_string(http_request.method()) == "POST") {
                     // Print info
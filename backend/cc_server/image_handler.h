@@ -2,123 +2,583 @@
 #define IMAGE_HANDLER_H_
 
 #include <string>
+#include <cstdint>
 #include <fstream>
 #include <chrono>
 #include <ctime>
 #include <iomanip>
 #include <sstream>
+#include <iostream>
+#include <iterator>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "base64/base64.h"
-#include "python/include/Python.h"
+#include "http_message.h"
+#include "backends.h"
+#include "caption/image_header.h"
+#include "caption/hash.h"
+#include "caption/clock_cache.h"
+#include "caption/perceptual_hash.h"
+#include "caption/caption_store.h"
 
 namespace http_server {
 
     static std::string file_base = "images/";
-    static std::string AI_module_path = "../AI_module/";
-    static const wchar_t* PYTHONHOME_V = L"C:/Users/wd2711/AppData/Local/Programs/Python/Python39";
-    static const wchar_t* PYTHONPATH_V = L"C:/Users/wd2711/AppData/Local/Programs/Python/Python39/Lib;C:/Users/wd2711/AppData/Local/Programs/Python/Python39/DLLs";
 
-    std::string filename_generate(const std::string s) {
+    // Per-request decode options, read from the request headers
+    struct CaptionOptions {
+        // "X-Attention-Maps: 1" also returns the attention maps of the caption, off by default
+        // because they cost memory in every beam and most clients only show the text
+        bool attention_maps = false;
+        // "X-Beam-Size: k" and "X-Max-Steps: n" decode with other settings than the server's (in-process
+        // backends only, the encoder output is reused through their feature cache), 0 = the server's
+        int beam_size = 0;
+        int max_steps = 0;
+    };
+
+    constexpr int kMaxBeamSize = 20;
+    constexpr int kMaxDecodeSteps = 100;
+
+    // Backend every request is captioned with, loaded in main
+    static std::unique_ptr<caption::CaptionBackend> caption_backend;
+
+    // value of the header within [1, limit] unless it is the default, 0 otherwise
+    int decode_setting(const std::string& header, int limit, int default_value) {
+        const int value = std::atoi(header.c_str());
+        return value >= 1 && value <= limit && value != default_value ? value : 0;
+    }
+
+    CaptionOptions caption_options(const HttpRequest& request) {
+        CaptionOptions options;
+        std::string attention_maps = request.header("X-Attention-Maps");
+        options.attention_maps = (attention_maps == "1" || attention_maps == "true");
+        const caption::InProcessBackend* in_process = dynamic_cast<const caption::InProcessBackend*>(caption_backend.get());
+        if (in_process != nullptr) {
+            const caption::BeamSearchOptions defaults = in_process->DecodeOptions();
+            options.beam_size = decode_setting(request.header("X-Beam-Size"), kMaxBeamSize, defaults.beam_size);
+            options.max_steps = decode_setting(request.header("X-Max-Steps"), kMaxDecodeSteps, defaults.max_steps);
+        }
+        return options;
+    }
+
+    caption::BeamSearchOptions decode_options(const caption::InProcessBackend& backend, const CaptionOptions& options) {
+        caption::BeamSearchOptions decode = backend.DecodeOptions();
+        if (options.beam_size > 0) {
+            decode.beam_size = options.beam_size;
+        }
+        if (options.max_steps > 0) {
+            decode.max_steps = options.max_steps;
+        }
+        return decode;
+    }
+
+    std::string json_escape(const std::string& s) {
+        std::string escaped;
+        escaped.reserve(s.size());
+        for (char ch : s) {
+            if (ch == '"' || ch == '\\') {
+                escaped.push_back('\\');
+            }
+            escaped.push_back(ch);
+        }
+        return escaped;
+    }
+
+    // Uploads saved so far, part of their file names
+    static std::atomic<std::uint64_t> uploads_saved(0);
+
+    // file_<time>_<XXH64 of the file>_<n>.jpg: the time alone is only to the second, two uploads of the same
+    // second would overwrite each other and the python backend would caption one of them twice
+    std::string filename_generate(const std::string s, std::uint64_t image_key) {
         auto now = std::chrono::system_clock::now();
         std::time_t currentTime = std::chrono::system_clock::to_time_t(now);
         std::stringstream ss;
-        ss << std::put_time(std::localtime(&currentTime), "%Y%m%d_%H%M%S");
+        ss << std::put_time(std::localtime(&currentTime), "%Y%m%d_%H%M%S") << "_" << std::hex << std::setw(16)
+           << std::setfill('0') << image_key << std::dec << "_" << uploads_saved++;
         std::string fileName = s + "file_" + ss.str() + ".jpg";
         return fileName;
     }
 
-    boolean set_env() {
-        // Set PYTHONHOME
-        const wchar_t* PYTHONHOME_N = L"PYTHONHOME";
-        if (!SetEnvironmentVariableW(PYTHONHOME_N ,PYTHONHOME_V )) {
-            std::cerr << "Failed to set PYTHONHOME environment variable." << std::endl;
-            return false;
-        }      
+    std::string caption_text(const caption::CaptionResult& result, const CaptionOptions& options) {
+        if (!options.attention_maps) {
+            return result.caption;
+        }
+        return "{\"caption\":\"" + json_escape(result.caption) + "\",\"attention_size\":" +
+               std::to_string(result.attention_size) + ",\"attention_maps\":\"" + result.attention_maps + "\"}";
+    }
+
+    // Captions of the uploads seen before: the same file with the same model and settings gets the same
+    // caption (caption::CaptionKey), so it is answered without saving the file or running the model
+    using CaptionCache = caption::ClockCache<caption::CaptionKey, caption::CaptionResult, caption::CaptionKeyHash>;
 
-        // Set PYTHONPATH
-        const wchar_t* PYTHONPATH_N = L"PYTHONPATH";
-        if (!SetEnvironmentVariableW(PYTHONPATH_N ,PYTHONPATH_V )) {
-            std::cerr << "Failed to set PYTHONHOME environment variable." << std::endl;
-            return false;
-        }   
+    // Created in main, null when caching is off
+    static std::unique_ptr<CaptionCache> caption_cache;
+    static std::uint64_t caption_params_key = 0;
 
-        return true; 
+    // Size and modification time, so a new checkpoint or export changes the key
+    std::string file_version(const std::string& path) {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            return "-";
+        }
+        return std::to_string(info.st_size) + "@" + std::to_string(info.st_mtime);
+    }
+
+    // XXH64 of everything a caption depends on beside the image: the backend, its model files and the decode
+    // parameters. The model files of every backend are included, a change of another backend's only misses.
+    // Cached features in f16 or int8 may change a caption, their format counts too.
+    std::uint64_t caption_params(const std::string& backend, const caption::BackendConfig& config) {
+        std::string params = backend + "|" + std::to_string(config.beam_size) + "|" + std::to_string(config.max_steps);
+        if (config.feature_cache_bytes > 0) {
+            params += std::string("|features=") + caption::FeatureFormatName(config.feature_format);
+        }
+        for (const std::string& path : {config.model_dir + config.model, config.model_dir + config.word_map,
+                                        config.graph_dir + "encoder.onnx", config.graph_dir + "decoder_init.onnx",
+                                        config.graph_dir + "decoder_step.onnx", config.model_dir + config.weights}) {
+            params += "|" + path + "=" + file_version(path);
+        }
+        return caption::XXHash64(params);
     }
 
-    std::string read_result_file() {
-        std::ifstream file("result.txt");
-        std::string s;
+    // budget_mb 0 turns caching off
+    void make_caption_cache(size_t budget_mb, const std::string& backend, const caption::BackendConfig& config) {
+        caption_params_key = caption_params(backend, config);
+        caption_cache.reset(budget_mb > 0 ? new CaptionCache(budget_mb << 20) : nullptr);
+    }
 
-        if (file.is_open()) {
-            std::getline(file, s);
-            file.close();
-            return s;
-        } else {
-            return "Result.txt open fail.";
+    caption::CaptionKey upload_key(const std::string& data, const CaptionOptions& options) {
+        caption::CaptionKey key;
+        key.image = caption::XXHash64(data.data(), data.size());
+        key.size = data.size();
+        key.params = caption_params_key;
+        if (options.beam_size > 0 || options.max_steps > 0) {
+            key.params = caption::XXHash64(std::to_string(caption_params_key) + "|" + std::to_string(options.beam_size) +
+                                           "|" + std::to_string(options.max_steps));
         }
+        key.attention_maps = options.attention_maps;
+        return key;
     }
-    std::string run_python_model(const std::string fileName) {
-        Py_Initialize();
-        PyRun_SimpleString("import os");
 
-        std::string demo_file_path = AI_module_path + "demo.py";
-        std::string model_file_path = AI_module_path + "BEST_checkpoint_.pth.tar";
-        std::string word_map_file_path = AI_module_path + "data/WORDMAP.json";
+    // Uploads being captioned by the model now; prewarm_caption_store waits for none
+    static std::atomic<int> captions_in_flight(0);
 
-        std::string command;
-        command += "python.exe ";
-        command += demo_file_path;
-        command += " --img ";
-        command += fileName;
-        command += " --model ";
-        command += model_file_path;
-        command += " --word_map ";
-        command += word_map_file_path;
-        command += " --beam_size 5";
+    // Captions on disk behind caption_cache, so a restart starts warm. Opened in main, null when off.
+    static std::unique_ptr<caption::CaptionStore> caption_store;
 
-        std::string full_command = "os.system('" + std::string(command) + "')";
-        if (PyRun_SimpleString(full_command.c_str()) < 0)
-        {
-            return "Python command run error.";
+    // Read-only shares the store of another process, which writes it; a writer that finds the store taken by
+    // another one opens it read-only as well
+    void open_caption_store(const std::string& path, bool read_only) {
+        if (!read_only) {
+            try {
+                caption_store.reset(new caption::CaptionStore(path, false));
+                return;
+            } catch (const caption::StoreLocked& e) {
+                std::cerr << e.what() << ", opening it read-only" << std::endl;
+            }
+        }
+        caption_store.reset(new caption::CaptionStore(path, true));
+    }
+
+    // Captions by the dHash of the preprocessed image, for the same photo re-encoded, resized or stripped of its
+    // metadata by another client. Created in main with --near_distance, null when off.
+    using NearDuplicateCache = caption::NearDuplicateCache<caption::CaptionResult>;
+    static std::unique_ptr<NearDuplicateCache> near_duplicates;
+
+    // max_distance < 0 turns the near-duplicate lookup off
+    void make_near_duplicate_cache(int max_distance, size_t capacity) {
+        near_duplicates.reset(max_distance >= 0 ? new NearDuplicateCache(max_distance, capacity) : nullptr);
+    }
+
+    // Bytes of an entry as charged to the budget: the strings and about what the map and the slot take
+    size_t cached_bytes(const caption::CaptionResult& result) {
+        return sizeof(caption::CaptionKey) + sizeof(caption::CaptionResult) + result.caption.size() +
+               result.attention_maps.size() + 64;
+    }
+
+    // GET /cache-stats
+    HttpResponse cache_stats_response() {
+        caption::CacheStats stats;
+        if (caption_cache) {
+            stats = caption_cache->stats();
+        }
+        const std::uint64_t lookups = stats.hits + stats.misses;
+        std::ostringstream content;
+        content << "{\"enabled\":" << (caption_cache ? "true" : "false") << ",\"hits\":" << stats.hits
+                << ",\"misses\":" << stats.misses << ",\"hit_rate\":"
+                << (lookups > 0 ? static_cast<double>(stats.hits) / lookups : 0.0)
+                << ",\"insertions\":" << stats.insertions << ",\"evictions\":" << stats.evictions
+                << ",\"entries\":" << stats.entries << ",\"bytes\":" << stats.bytes
+                << ",\"budget\":" << stats.budget;
+        if (near_duplicates) {
+            caption::NearDuplicateStats near = near_duplicates->stats();
+            const std::uint64_t near_lookups = near.hits + near.misses;
+            content << ",\"near_duplicates\":{\"max_distance\":" << near.max_distance << ",\"hits\":" << near.hits
+                    << ",\"misses\":" << near.misses << ",\"hit_rate\":"
+                    << (near_lookups > 0 ? static_cast<double>(near.hits) / near_lookups : 0.0)
+                    << ",\"skipped\":" << near.skipped << ",\"insertions\":" << near.insertions
+                    << ",\"evictions\":" << near.evictions << ",\"entries\":" << near.entries << ",\"capacity\":" << near.capacity
+                    << ",\"hit_distances\":[";
+            for (size_t d = 0; d < near.hit_distances.size(); d++) {
+                content << (d > 0 ? "," : "") << near.hit_distances[d];
+            }
+            content << "]}";
+        }
+        if (caption_store) {
+            caption::CaptionStoreStats stored = caption_store->stats();
+            content << ",\"store\":{\"read_only\":" << (caption_store->read_only() ? "true" : "false")
+                    << ",\"hits\":" << stored.hits << ",\"misses\":" << stored.misses
+                    << ",\"bloom_rejects\":" << stored.bloom_rejects << ",\"insertions\":" << stored.insertions
+                    << ",\"unindexed\":" << stored.unindexed << ",\"entries\":" << stored.entries
+                    << ",\"capacity\":" << stored.capacity << "}";
         }
+        const caption::InProcessBackend* in_process = dynamic_cast<const caption::InProcessBackend*>(caption_backend.get());
+        if (in_process != nullptr && in_process->feature_cache() != nullptr) {
+            caption::CacheStats features = in_process->feature_cache()->stats();
+            content << ",\"features\":{\"format\":\"" << caption::FeatureFormatName(in_process->feature_cache()->format())
+                    << "\",\"hits\":" << features.hits << ",\"misses\":" << features.misses
+                    << ",\"insertions\":" << features.insertions << ",\"evictions\":" << features.evictions
+                    << ",\"entries\":" << features.entries << ",\"bytes\":" << features.bytes
+                    << ",\"budget\":" << features.budget << "}";
+        }
+        content << "}";
+        HttpResponse response(HttpStatusCode::Ok);
+        response.SetHeader("Content-Type", "application/json");
+        response.SetHeader("Access-Control-Allow-Origin", "http://localhost:3000");
+        response.SetContent(content.str());
+        return response;
+    }
+
+    // Uploads are checked against these from their header before anything is decoded or queued
+    static caption::ImageLimits image_limits;
 
-        return read_result_file();
+    // 415 for what the decoders cannot read, 413 beyond image_limits, 400 for a broken header
+    HttpStatusCode header_status(caption::HeaderStatus status) {
+        switch (status) {
+            case caption::HeaderStatus::Ok:
+                return HttpStatusCode::Ok;
+            case caption::HeaderStatus::UnknownFormat:
+            case caption::HeaderStatus::UnsupportedEncoding:
+                return HttpStatusCode::UnsupportedMediaType;
+            case caption::HeaderStatus::TooLarge:
+                return HttpStatusCode::PayloadTooLarge;
+            default:
+                return HttpStatusCode::BadRequest;
+        }
     }
 
-    std::string model_process(const std::string fileName) {
-        if (!set_env()) {
-            return "Environment variable set error.";
+    std::string header_message(caption::HeaderStatus status, const caption::ImageHeader& header) {
+        std::string message = caption::HeaderMessage(status);
+        if (status == caption::HeaderStatus::TooLarge && header.width > 0) {
+            message += " (" + std::to_string(header.width) + "x" + std::to_string(header.height) + ", at most " +
+                       std::to_string(image_limits.max_side) + " a side and " +
+                       std::to_string(image_limits.max_pixels) + " pixels)";
         }
-        return run_python_model(fileName);
+        return message + ".";
+    }
+
+    // An upload as it arrives: the data URL prefix is skipped, the base64 after it is decoded piece by piece
+    // and the image header is checked as soon as enough of the file is in, so bad uploads are rejected while
+    // the rest of the body is still on the way
+    class ImageUpload {
+        public:
+            // content_length: of the whole body when known, 0 otherwise. Nothing is reserved from it, it is only
+            // what the client claims and arrives before any of the body; decoded_ grows as the body comes.
+            ImageUpload(const CaptionOptions& options, size_t content_length) : options_(options) {
+                if (content_length / 4 * 3 > image_limits.max_bytes + 2) {
+                    Reject(HttpStatusCode::PayloadTooLarge,
+                           "Image too large (more than " + std::to_string(image_limits.max_bytes) + " bytes).");
+                }
+            }
+
+            // false once the upload is rejected, the rest of it is not needed
+            bool Consume(const char* data, size_t size) {
+                if (rejected_) {
+                    return false;
+                }
+                if (!in_image_) {
+                    const char* comma = static_cast<const char*>(std::memchr(data, ',', size));
+                    if (comma == nullptr) {
+                        prefix_length_ += size;
+                        if (prefix_length_ > kMaxPrefixLength) {
+                            Reject(HttpStatusCode::BadRequest, "Invalid image transfer#2.");
+                        }
+                        return !rejected_;
+                    }
+                    in_image_ = true;
+                    size -= comma + 1 - data;
+                    data = comma + 1;
+                }
+
+                base64_length_ += size;
+                const size_t length = decoded_.size();
+                decoded_.resize(length + base64_decode_update_length(base64_, size));
+                base64_result result = base64_decode_update(
+                    base64_, data, size, reinterpret_cast<unsigned char*>(&decoded_[length]), decoded_.size() - length);
+                decoded_.resize(length + result.length);
+                if (result.status != base64_status::ok) {
+                    Reject(HttpStatusCode::BadRequest,
+                           "Invalid image transfer#3 (base64 character " + std::to_string(result.position) + ").");
+                } else if (decoded_.size() > image_limits.max_bytes) {
+                    Reject(HttpStatusCode::PayloadTooLarge,
+                           "Image too large (more than " + std::to_string(image_limits.max_bytes) + " bytes).");
+                } else if (!header_checked_ && decoded_.size() >= kMinHeaderLength) {
+                    CheckHeader(false);
+                }
+                return !rejected_;
+            }
+
+            // Sets *status to the HTTP status of the returned text: the caption, or why the upload was rejected
+            std::string Finish(HttpStatusCode* status) {
+                if (!rejected_) {
+                    if (!in_image_) {
+                        Reject(HttpStatusCode::BadRequest, "Invalid image transfer#2.");
+                    } else if (base64_length_ % 4 != 0) {
+                        Reject(HttpStatusCode::BadRequest, "Invalid image transfer#1.");
+                    } else {
+                        unsigned char tail[2];
+                        base64_result result = base64_decode_final(base64_, tail, sizeof(tail));
+                        decoded_.append(reinterpret_cast<const char*>(tail), result.length);
+                        if (result.status != base64_status::ok) {
+                            Reject(HttpStatusCode::BadRequest,
+                                   "Invalid image transfer#3 (base64 character " + std::to_string(result.position) + ").");
+                        } else if (!header_checked_) {
+                            CheckHeader(true);
+                        }
+                    }
+                }
+                if (rejected_) {
+                    *status = status_;
+                    return message_;
+                }
+
+                const caption::CaptionKey key = upload_key(decoded_, options_);
+                if (caption_cache) {
+                    std::shared_ptr<const caption::CaptionResult> cached = caption_cache->Lookup(key);
+                    if (cached) {
+                        *status = HttpStatusCode::Ok;
+                        return caption_text(*cached, options_);
+                    }
+                }
+                if (caption_store) {
+                    std::shared_ptr<const caption::CaptionResult> stored = caption_store->Lookup(key);
+                    if (stored) {
+                        if (caption_cache) {
+                            caption_cache->Insert(key, stored, cached_bytes(*stored));
+                        }
+                        *status = HttpStatusCode::Ok;
+                        return caption_text(*stored, options_);
+                    }
+                }
+
+                // the in-process backends caption the preprocessed image of the near-duplicate lookup directly
+                std::vector<float> image;
+                std::uint64_t image_hash = 0;
+                const std::uint64_t tag = key.params ^ static_cast<std::uint64_t>(key.attention_maps);
+                if (near_duplicates) {
+                    image.resize(static_cast<size_t>(3) * caption::kImageSize * caption::kImageSize);
+                    try {
+                        caption::PreprocessImage(reinterpret_cast<const std::uint8_t*>(decoded_.data()), decoded_.size(),
+                                                 image.data());
+                    } catch (const std::exception& e) {
+                        *status = HttpStatusCode::BadRequest;
+                        return e.what();
+                    }
+                    image_hash = caption::DifferenceHash(image.data());
+                    std::shared_ptr<const caption::CaptionResult> near = near_duplicates->Lookup(image_hash, tag);
+                    if (near) {
+                        if (caption_cache) {
+                            caption_cache->Insert(key, near, cached_bytes(*near));
+                        }
+                        *status = HttpStatusCode::Ok;
+                        return caption_text(*near, options_);
+                    }
+                }
+
+                *status = HttpStatusCode::InternalServerError;
+                std::string fileName = filename_generate(file_base, key.image);
+                std::ofstream file(fileName, std::ios::binary);
+
+                file.write(decoded_.c_str(), decoded_.length());
+                if(!file.good()) {
+                    return "Save error#1.";
+                }
+
+                file.close();
+                if(!file.good()) {
+                    return "Save error#2.";
+                }
+
+                std::shared_ptr<caption::CaptionResult> result(new caption::CaptionResult());
+                captions_in_flight++;
+                try {
+                    caption::InProcessBackend* in_process = dynamic_cast<caption::InProcessBackend*>(caption_backend.get());
+                    if (in_process != nullptr) {
+                        // the features of an earlier upload of this file with other settings, or a new encode
+                        std::vector<float> features;
+                        if (!in_process->CachedFeatures(key.image, &features)) {
+                            if (image.empty()) {
+                                image.resize(static_cast<size_t>(3) * caption::kImageSize * caption::kImageSize);
+                                caption::PreprocessImage(reinterpret_cast<const std::uint8_t*>(decoded_.data()),
+                                                         decoded_.size(), image.data());
+                            }
+                            in_process->Encode(image.data(), key.image, &features);
+                        }
+                        *result = in_process->CaptionFeatures(features.data(), decode_options(*in_process, options_));
+                    } else {
+                        *result = caption_backend->Caption(fileName, options_.attention_maps);
+                    }
+                } catch (const std::exception& e) {
+                    captions_in_flight--;
+                    return e.what();
+                }
+                captions_in_flight--;
+                if (caption_cache) {
+                    caption_cache->Insert(key, result, cached_bytes(*result));
+                }
+                if (near_duplicates) {
+                    near_duplicates->Insert(image_hash, tag, result);
+                }
+                if (caption_store && !caption_store->read_only()) {
+                    try {
+                        caption_store->Insert(key, *result);
+                    } catch (const std::exception& e) {
+                        std::cerr << e.what() << std::endl;
+                    }
+                }
+                *status = HttpStatusCode::Ok;
+                return caption_text(*result, options_);
+            }
+
+        private:
+            // "data:image/jpeg;base64," and the like
+            static constexpr size_t kMaxPrefixLength = 256;
+            // the signatures of SniffFormat
+            static constexpr size_t kMinHeaderLength = 8;
+
+            CaptionOptions options_;
+            bool in_image_ = false;
+            size_t prefix_length_ = 0;
+            size_t base64_length_ = 0;
+            base64_decode_state base64_;
+            std::string decoded_;
+            bool header_checked_ = false;
+            bool rejected_ = false;
+            HttpStatusCode status_ = HttpStatusCode::Ok;
+            std::string message_;
+
+            void Reject(HttpStatusCode status, const std::string& message) {
+                rejected_ = true;
+                status_ = status;
+                message_ = message;
+            }
+
+            // Only the container header, so broken or hostile files cost microseconds, not a decode. Until the
+            // upload is complete a header cut short only means waiting for more.
+            void CheckHeader(bool complete) {
+                caption::ImageHeader header;
+                caption::HeaderStatus checked = caption::CheckImageHeader(
+                    reinterpret_cast<const std::uint8_t*>(decoded_.data()), decoded_.size(), image_limits, &header);
+                if (checked == caption::HeaderStatus::Truncated && !complete) {
+                    return;
+                }
+                header_checked_ = true;
+                if (checked != caption::HeaderStatus::Ok) {
+                    Reject(header_status(checked), header_message(checked, header));
+                }
+            }
+    };
+
+    // The response to an upload: the caption (JSON with the attention maps), or the reason it was rejected
+    HttpResponse upload_response(HttpStatusCode status, const std::string& content, const CaptionOptions& options) {
+        HttpResponse response(status);
+        bool json = options.attention_maps && status == HttpStatusCode::Ok;
+        response.SetHeader("Content-Type", json ? "application/json" : "text/plain");
+        response.SetHeader("Access-Control-Allow-Origin", "http://localhost:3000");
+        response.SetContent(content);
+        return response;
     }
 
-    std::string request_handler(const std::string content, const size_t len) {
-        size_t commaPos = content.find(',');
-        if (commaPos != std::string::npos) {
-            std::string image = content.substr(commaPos + 1);
-            if (image.size() % 4 != 0)
-                return "Invalid image transfer#1.";
-            
-            std::string decodedImage = base64_decode(image);
-            std::string fileName = filename_generate(file_base);
-            std::ofstream file(fileName, std::ios::binary);
-            
-            file.write(decodedImage.c_str(), decodedImage.length());
-            if(!file.good()) {
-                return "Save error#1.";
+    // Decodes the upload while the server is still receiving it, see ImageUpload
+    class ImageUploadReader : public HttpBodyReader {
+        public:
+            explicit ImageUploadReader(const HttpRequest& head)
+                : options_(caption_options(head)), upload_(options_, content_length(head)) {}
+
+            bool Consume(const char* data, size_t size) override {
+                return upload_.Consume(data, size);
             }
-            
-            file.close();
-            if(!file.good()) {
-                return "Save error#2.";
+
+            HttpResponse Finish() override {
+                HttpStatusCode status;
+                std::string content = upload_.Finish(&status);
+                return upload_response(status, content, options_);
             }
 
-            return model_process(fileName);         
-        } else {
-            return "Invalid image transfer#2.";
+        private:
+            CaptionOptions options_;
+            ImageUpload upload_;
+
+            static size_t content_length(const HttpRequest& head) {
+                std::string length = head.header("Content-Length");
+                return length.empty() ? 0 : std::stoull(length);
+            }
+    };
+
+    // Captions the images of dir (the uploads of earlier runs) that are not in caption_store yet, until stop.
+    // Each image waits until no upload is being captioned, so prewarm only uses a backend the requests leave idle.
+    void prewarm_caption_store(const std::string& dir, const std::atomic<bool>& stop) {
+        DIR* folder = opendir(dir.c_str());
+        if (folder == nullptr || !caption_store || caption_store->read_only()) {
+            if (folder != nullptr) {
+                closedir(folder);
+            }
+            return;
+        }
+        int captioned = 0;
+        int stored = 0;
+        for (dirent* entry = readdir(folder); entry != nullptr && !stop; entry = readdir(folder)) {
+            const std::string path = dir + entry->d_name;
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+                continue;
+            }
+            std::ifstream file(path, std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            caption::ImageHeader header;
+            if (data.empty() || caption::CheckImageHeader(reinterpret_cast<const std::uint8_t*>(data.data()),
+                                                          data.size(), image_limits, &header) != caption::HeaderStatus::Ok) {
+                continue;
+            }
+            caption::CaptionKey key = upload_key(data, CaptionOptions());
+            if (caption_store->Lookup(key)) {
+                stored++;
+                continue;
+            }
+            while (captions_in_flight > 0 && !stop) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            if (stop) {
+                break;
+            }
+            try {
+                caption_store->Insert(key, caption_backend->Caption(path, false));
+                captioned++;
+            } catch (const std::exception& e) {
+                std::cerr << "Pre-warm: " << path << ": " << e.what() << std::endl;
+            }
         }
+        closedir(folder);
+        std::cout << "Pre-warm: captioned " << captioned << " images of " << dir << ", " << stored
+                  << " were stored already" << std::endl;
     }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,9 +1,14 @@
 #undef _WIN32_WINNT
 #define _WIN32_WINNT 0x0A00
+// windows.h would otherwise define min/max macros that break std::min/std::max in caption/
+#define NOMINMAX
 
 #include <string>
+#include <memory>
+#include <cstdlib>
 #include <chrono>
 #include <thread>
+#include <atomic>
 #include <iostream>
 #include <stdexcept>
 
@@ -17,27 +22,112 @@ using http_server::HttpRequest;
 using http_server::HttpResponse;
 using http_server::HttpServer;
 using http_server::HttpStatusCode;
-using http_server::request_handler;
+using http_server::HttpBodyReader;
+using http_server::ImageUploadReader;
+
+// main.exe [--backend python|onnx|native] [--weights file] [--threads n] [--cache_mb n] [--near_distance d] [--store path|none] [--prewarm 1]
+//          [--batch_rows n] [--store_readonly 1] [--feature_cache_mb n] [--feature_format f32|f16|int8]
+int main(int argc, char** argv) {
+    std::string backend = "python";
+    caption::BackendConfig config;
+    // captions of repeated uploads, 0 turns the cache off
+    size_t cache_mb = 64;
+    // reuse the caption of an earlier upload within d bits of dHash, off (-1) by default
+    int near_distance = -1;
+    // captions on disk, path.log and path.index; --prewarm 1 also captions the images of earlier runs
+    std::string store = "caption_store";
+    bool prewarm = false;
+    // --store_readonly 1 for worker processes that share the store of the one that writes it
+    bool store_readonly = false;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--backend") {
+            backend = argv[i + 1];
+        } else if (option == "--weights") {
+            config.weights = argv[i + 1];
+        } else if (option == "--batch_rows") {
+            config.batch_rows = std::atoi(argv[i + 1]);
+        } else if (option == "--threads") {
+            config.intra_op_threads = std::atoi(argv[i + 1]);
+        } else if (option == "--cache_mb") {
+            cache_mb = std::strtoull(argv[i + 1], nullptr, 10);
+        } else if (option == "--near_distance") {
+            near_distance = std::atoi(argv[i + 1]);
+        } else if (option == "--store") {
+            store = argv[i + 1];
+        } else if (option == "--prewarm") {
+            prewarm = std::atoi(argv[i + 1]) != 0;
+        } else if (option == "--store_readonly") {
+            store_readonly = std::atoi(argv[i + 1]) != 0;
+        } else if (option == "--feature_cache_mb") {
+            // encoder outputs of the in-process backends, so another X-Beam-Size or X-Max-Steps skips the encoder
+            config.feature_cache_bytes = static_cast<size_t>(std::strtoull(argv[i + 1], nullptr, 10)) << 20;
+        } else if (option == "--feature_format") {
+            try {
+                config.feature_format = caption::ParseFeatureFormat(argv[i + 1]);
+            } catch (std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return -1;
+            }
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return -1;
+        }
+    }
+    try {
+        http_server::caption_backend = http_server::make_backend(backend);
+        http_server::caption_backend->Load(config);
+    } catch (std::exception& e) {
+        std::cerr << "Failed to load the " << backend << " backend: " << e.what() << std::endl;
+        return -1;
+    }
+    http_server::make_caption_cache(cache_mb, backend, config);
+    http_server::make_near_duplicate_cache(near_distance, 65536);
+    if (store != "none") {
+        try {
+            http_server::open_caption_store(store, store_readonly);
+            std::cout << "Caption store " << store << ": " << http_server::caption_store->stats().entries
+                      << " captions" << (http_server::caption_store->read_only() ? ", read-only" : "") << std::endl;
+        } catch (std::exception& e) {
+            std::cerr << "Caption store disabled: " << e.what() << std::endl;
+        }
+    }
+    std::atomic<bool> stop_prewarm(false);
+    std::thread prewarm_thread;
+    if (prewarm && http_server::caption_store && !http_server::caption_store->read_only()) {
+        prewarm_thread = std::thread([&stop_prewarm]() {
+            http_server::prewarm_caption_store(http_server::file_base, stop_prewarm);
+        });
+    }
+    std::cout << "Captioning with the " << backend << " backend" << std::endl;
 
-int main(void) {
     // Can receive connection from any IP
     std::string host = "0.0.0.0";
     int port = 8080;
     HttpServer server(host, port);
 
     // Register many handler functions
-    auto send_html = [](const HttpRequest& request) -> HttpResponse {
-        HttpResponse response(HttpStatusCode::Ok);
-        std::string content;
-        content += request_handler(request.content(), request.content_length());
+    // Uploads are decoded and checked while they are received
+    auto read_upload = [](const HttpRequest& head) -> std::unique_ptr<HttpBodyReader> {
+        return std::unique_ptr<HttpBodyReader>(new ImageUploadReader(head));
+    };
 
-        response.SetHeader("Content-Type", "text/plain");
+    // Custom request headers (X-Attention-Maps, X-Beam-Size, X-Max-Steps) make browsers send a CORS preflight first
+    auto send_preflight = [](const HttpRequest& request) -> HttpResponse {
+        HttpResponse response(HttpStatusCode::NoContent);
         response.SetHeader("Access-Control-Allow-Origin", "http://localhost:3000");
-        response.SetContent(content);
+        response.SetHeader("Access-Control-Allow-Methods", "POST, OPTIONS");
+        response.SetHeader("Access-Control-Allow-Headers", "Content-Type, X-Attention-Maps, X-Beam-Size, X-Max-Steps");
         return response;
     };
 
-    server.RegisterHttpRequestHandler("/image-upload", HttpMethod::POST, send_html);
+    auto send_cache_stats = [](const HttpRequest& request) -> HttpResponse {
+        return http_server::cache_stats_response();
+    };
+
+    server.RegisterHttpBodyReader("/image-upload", HttpMethod::POST, read_upload);
+    server.RegisterHttpRequestHandler("/image-upload", HttpMethod::OPTIONS, send_preflight);
+    server.RegisterHttpRequestHandler("/cache-stats", HttpMethod::GET, send_cache_stats);
 
     try {
         std::cout << "Starting the web server.." << std::endl;
@@ -52,8 +142,16 @@ int main(void) {
         std::cout << "'quit' command entered. Stopping the web server.." << std::endl;
         server.Stop();
         std::cout << "Server stopped" << std::endl;
+        stop_prewarm = true;
+        if (prewarm_thread.joinable()) {
+            prewarm_thread.join();
+        }
     } catch (std::exception& e) {
         std::cerr << "An error occurred #1" << std::endl;
+        stop_prewarm = true;
+        if (prewarm_thread.joinable()) {
+            prewarm_thread.join();
+        }
         return -1;
     }
 
@@ -0,0 +1,131 @@
+// Times the native preprocessing (caption/preprocess.h) with and without JPEG IDCT scaling on every image
+// of a folder and on large synthetic JPEGs, and reports how far the scaled result is from the full decode:
+//   g++ -O2 -march=native -std=c++17 preprocess_bench.cc -o preprocess_bench.exe -ljpeg -lpng
+//   preprocess_bench.exe images [repeats]
+
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+
+#include "caption/preprocess.h"
+
+// Smooth gradients with some texture, quality 90, like a phone photo
+static std::vector<std::uint8_t> SyntheticJpeg(int width, int height) {
+    std::vector<std::uint8_t> pixels(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            std::uint8_t* p = pixels.data() + (static_cast<size_t>(y) * width + x) * 3;
+            p[0] = static_cast<std::uint8_t>(255 * x / width);
+            p[1] = static_cast<std::uint8_t>(255 * y / height);
+            p[2] = static_cast<std::uint8_t>(128 + 127 * std::sin(x * 0.05) * std::cos(y * 0.03));
+        }
+    }
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr error;
+    cinfo.err = jpeg_std_error(&error);
+    jpeg_create_compress(&cinfo);
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 90, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = pixels.data() + static_cast<size_t>(cinfo.next_scanline) * width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    std::vector<std::uint8_t> jpeg(buffer, buffer + size);
+    free(buffer);
+    return jpeg;
+}
+
+// Milliseconds per PreprocessImage, the best of `repeats` runs
+static double Time(const std::vector<std::uint8_t>& data, const caption::PreprocessOptions& options, int repeats,
+                   std::vector<float>* out) {
+    double best = 1e30;
+    for (int i = 0; i < repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        caption::PreprocessImage(data.data(), data.size(), out->data(), options);
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: preprocess_bench <image folder> [repeats]" << std::endl;
+        return -1;
+    }
+    const int repeats = argc > 2 ? std::max(1, std::atoi(argv[2])) : 3;
+
+    std::vector<std::pair<std::string, std::vector<std::uint8_t>>> images;
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(argv[1])) {
+        if (entry.is_regular_file()) {
+            paths.push_back(entry.path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    for (const std::string& path : paths) {
+        std::ifstream file(path, std::ios::binary);
+        images.emplace_back(path, std::vector<std::uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()));
+    }
+    for (auto size : {std::make_pair(4000, 3000), std::make_pair(6000, 4000), std::make_pair(8000, 6000)}) {
+        images.emplace_back("synthetic " + std::to_string(size.first) + "x" + std::to_string(size.second),
+                            SyntheticJpeg(size.first, size.second));
+    }
+
+    caption::PreprocessOptions full;
+    full.jpeg_scaling = false;
+    caption::PreprocessOptions scaled;
+    const size_t n = static_cast<size_t>(3) * caption::kImageSize * caption::kImageSize;
+    std::vector<float> a(n);
+    std::vector<float> b(n);
+    double full_total = 0.0;
+    double scaled_total = 0.0;
+    int count = 0;
+    for (const auto& image : images) {
+        try {
+            const double full_ms = Time(image.second, full, repeats, &a);
+            const double scaled_ms = Time(image.second, scaled, repeats, &b);
+            // in 8-bit steps of the resized image, the unit of the pixels before read_image's scaling
+            float max_diff = 0.0f;
+            double mean_diff = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                const int c = static_cast<int>(i / (n / 3));
+                const float diff = std::fabs(a[i] - b[i]) * caption::kImageStd[c] * 255.0f * 255.0f;
+                max_diff = std::max(max_diff, diff);
+                mean_diff += diff / n;
+            }
+            std::cout << image.first << ": full " << full_ms << " ms, scaled " << scaled_ms << " ms ("
+                      << full_ms / scaled_ms << "x), diff mean " << mean_diff << " max " << max_diff << " / 255" << std::endl;
+            full_total += full_ms;
+            scaled_total += scaled_ms;
+            count++;
+        } catch (const std::exception& e) {
+            std::cerr << image.first << ": " << e.what() << std::endl;
+        }
+    }
+    if (count > 0) {
+        std::cout << "[*] " << count << " images, full " << full_total / count << " ms, scaled " << scaled_total / count
+                  << " ms per image" << std::endl;
+    }
+    return 0;
+}
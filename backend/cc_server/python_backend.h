@@ -0,0 +1,118 @@
+#ifndef PYTHON_BACKEND_H_
+#define PYTHON_BACKEND_H_
+
+#include <atomic>
+#include <string>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+
+#include "caption/backend.h"
+#include "python/include/Python.h"
+
+namespace http_server {
+
+    static const wchar_t* PYTHONHOME_V = L"C:/Users/wd2711/AppData/Local/Programs/Python/Python39";
+    static const wchar_t* PYTHONPATH_V = L"C:/Users/wd2711/AppData/Local/Programs/Python/Python39/Lib;C:/Users/wd2711/AppData/Local/Programs/Python/Python39/DLLs";
+
+    // Captions by running AI_module/demo.py in a python.exe subprocess and reading its result file. Calls run
+    // concurrently: each takes the GIL only to start os.system (which releases it while python.exe runs) and
+    // has a result file of its own.
+    class PythonBackend : public caption::CaptionBackend {
+        public:
+            const char* name() const override { return "python"; }
+
+            void Load(const caption::BackendConfig& config) override {
+                config_ = config;
+                if (!set_env()) {
+                    throw std::runtime_error("Environment variable set error.");
+                }
+                Py_Initialize();
+                PyRun_SimpleString("import os");
+                // the server threads take the GIL with PyGILState_Ensure
+                PyEval_SaveThread();
+            }
+
+            caption::CaptionResult Caption(const std::string& image_path, bool attention_maps) override {
+                std::string command;
+                command += "python.exe ";
+                command += config_.model_dir + "demo.py";
+                command += " --img ";
+                command += image_path;
+                command += " --model ";
+                command += config_.model_dir + config_.model;
+                command += " --word_map ";
+                command += config_.model_dir + config_.word_map;
+                command += " --beam_size " + std::to_string(config_.beam_size);
+                command += " --max_steps " + std::to_string(config_.max_steps);
+                if (attention_maps) {
+                    command += " --alphas";
+                }
+                // a file left by an earlier run must not pass for the result of this one
+                const std::string result_path = "result_" + std::to_string(next_result_++) + ".txt";
+                std::remove(result_path.c_str());
+                command += " --result " + result_path;
+
+                std::string full_command = "os.system('" + std::string(command) + "')";
+                PyGILState_STATE gil = PyGILState_Ensure();
+                const int status = PyRun_SimpleString(full_command.c_str());
+                PyGILState_Release(gil);
+                if (status < 0) {
+                    throw std::runtime_error("Python command run error.");
+                }
+
+                caption::CaptionResult result = read_result_file(result_path, attention_maps);
+                std::remove(result_path.c_str());
+                return result;
+            }
+
+        private:
+            caption::BackendConfig config_;
+            std::atomic<unsigned> next_result_{0};
+
+            static bool set_env() {
+                // Set PYTHONHOME
+                const wchar_t* PYTHONHOME_N = L"PYTHONHOME";
+                if (!SetEnvironmentVariableW(PYTHONHOME_N ,PYTHONHOME_V )) {
+                    std::cerr << "Failed to set PYTHONHOME environment variable." << std::endl;
+                    return false;
+                }
+
+                // Set PYTHONPATH
+                const wchar_t* PYTHONPATH_N = L"PYTHONPATH";
+                if (!SetEnvironmentVariableW(PYTHONPATH_N ,PYTHONPATH_V )) {
+                    std::cerr << "Failed to set PYTHONHOME environment variable." << std::endl;
+                    return false;
+                }
+
+                return true;
+            }
+
+            static caption::CaptionResult read_result_file(const std::string& path, bool attention_maps) {
+                std::ifstream file(path);
+                caption::CaptionResult result;
+
+                if (!file.is_open()) {
+                    throw std::runtime_error(path + " open fail.");
+                }
+                std::getline(file, result.caption);
+                if (attention_maps) {
+                    // demo.py --alphas writes the map size and the base64 uint8 maps after the caption
+                    std::string map_size;
+                    std::getline(file, map_size);
+                    std::getline(file, result.attention_maps);
+                    result.attention_size = map_size.empty() ? 0 : std::stoi(map_size);
+                }
+                file.close();
+                return result;
+            }
+    };
+}
+
+#endif
@@ -25,6 +25,9 @@ const Home = (props) => {
     const handleUpload = () => {
       axios.post('http://127.0.0.1:8080/image-upload', image).then(res => {
         setResult(res.data)
+      }).catch(err => {
+        // rejected uploads (4xx) carry the reason as text
+        setResult(err.response ? err.response.data : err.message)
       })
     }
 